@@ -0,0 +1,199 @@
+/* tagbench.c : microbenchmark for the tag and role encoders, using the tags found in a PBF file */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "pbf.h"
+#include "tags.h"
+
+/*
+  The dictionary is included again here, so the linear scan that tags.c used before the perfect hash
+  can be run over the same entries for comparison.
+*/
+#include "tags-hash.h"
+
+/* Stop collecting after this many tags, which is plenty to get past the caches. */
+#define MAX_SAMPLES 10000000
+
+/* All the strings seen, and the sampled tags and roles as references into them. */
+static uint8_t *arena;
+static size_t arena_pos, arena_size;
+typedef struct {
+    size_t key, val;
+    uint32_t key_len, val_len;
+} Sample;
+static Sample *tag_samples, *role_samples;
+static size_t n_tags, n_roles, tags_size, roles_size;
+
+static void die (const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+static size_t save_string (ProtobufCBinaryData s) {
+    if (arena_pos + s.len > arena_size) {
+        arena_size = (arena_size + s.len) * 2;
+        arena = realloc(arena, arena_size);
+        if (arena == NULL) die ("could not grow string arena");
+    }
+    size_t pos = arena_pos;
+    memcpy(arena + pos, s.data, s.len);
+    arena_pos += s.len;
+    return pos;
+}
+
+static void sample (Sample **samples, size_t *n, size_t *size,
+                    ProtobufCBinaryData key, ProtobufCBinaryData val) {
+    if (*n == MAX_SAMPLES) return;
+    if (*n == *size) {
+        *size = *size == 0 ? 65536 : *size * 2;
+        *samples = realloc(*samples, *size * sizeof(Sample));
+        if (*samples == NULL) die ("could not grow sample array");
+    }
+    Sample *s = &((*samples)[(*n)++]);
+    s->key = save_string(key);
+    s->key_len = key.len;
+    s->val = save_string(val);
+    s->val_len = val.len;
+}
+
+static void sample_tags (uint32_t *keys, uint32_t *vals, size_t n, ProtobufCBinaryData *string_table) {
+    for (size_t t = 0; t < n; t++)
+        sample(&tag_samples, &n_tags, &tags_size, string_table[keys[t]], string_table[vals[t]]);
+}
+
+static void handle_node (OSMPBF__Node *node, ProtobufCBinaryData *string_table) {
+    sample_tags(node->keys, node->vals, node->n_keys, string_table);
+}
+
+static void handle_dense_nodes (PbfDenseNodes *dense, ProtobufCBinaryData *string_table) {
+    sample_tags(dense->keys, dense->vals, dense->tag_offsets[dense->n_nodes], string_table);
+}
+
+static void handle_way (OSMPBF__Way *way, ProtobufCBinaryData *string_table) {
+    sample_tags(way->keys, way->vals, way->n_keys, string_table);
+}
+
+static void handle_relation (OSMPBF__Relation *relation, ProtobufCBinaryData *string_table) {
+    sample_tags(relation->keys, relation->vals, relation->n_keys, string_table);
+    ProtobufCBinaryData none = { 0, NULL };
+    for (size_t m = 0; m < relation->n_roles_sid; m++)
+        sample(&role_samples, &n_roles, &roles_size, string_table[relation->roles_sid[m]], none);
+}
+
+/* The dictionary in the layout tags.c used before it was generated, with its search loops. */
+typedef struct {
+    char *key;
+    int  len;
+    char **vals;
+} KVTable;
+static KVTable tables[N_PAIRS + 1];
+
+static void make_tables () {
+    KVTable *table = tables;
+    for (int p = 0; p < N_PAIRS; table++) {
+        table->key = pair_keys[p];
+        table->vals = &(pair_vals[p]);
+        while (p < N_PAIRS && strcmp(pair_keys[p], table->key) == 0) {
+            table->len++;
+            p++;
+        }
+    }
+}
+
+static int8_t linear_encode_tag (ProtobufCBinaryData key, ProtobufCBinaryData val) {
+    int code = 1;
+    for (KVTable *table = &tables[0]; table->key != NULL; table++) {
+        if (memcmp(table->key, key.data, key.len) == 0) { // Found key
+            for (int v = 0; v < table->len; v++, code++) {
+                if (memcmp(table->vals[v], val.data, val.len) == 0) { // Found key+val
+                    return code;
+                }
+            }
+            break; // try free-text
+        }
+        code += table->len;
+    }
+    code = -1;
+    for (int k = 0; k < N_FREE_TEXT_KEYS; k++, code--) {
+        if (memcmp(free_text_keys[k], key.data, key.len) == 0) { // Found key
+            return code;
+        }
+    }
+    return 0;
+}
+
+static uint8_t linear_encode_role (ProtobufCBinaryData role) {
+    for (int r = 0; r < N_ROLES; r++) {
+        if (memcmp(roles[r], role.data, role.len) == 0) {
+            return r + 1;
+        }
+    }
+    return 0;
+}
+
+static double now () {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline ProtobufCBinaryData key_of (Sample *s) {
+    return (ProtobufCBinaryData) { s->key_len, arena + s->key };
+}
+
+static inline ProtobufCBinaryData val_of (Sample *s) {
+    return (ProtobufCBinaryData) { s->val_len, arena + s->val };
+}
+
+/* Run both encoders over the samples repeatedly for at least a second, and report their rates. */
+#define BENCHMARK(name, samples, n, ENCODE) do {                                       \
+    long passes = 0, checksum = 0;                                                     \
+    double t0 = now(), t1;                                                             \
+    do {                                                                               \
+        for (size_t i = 0; i < n; i++) checksum += ENCODE(&(samples[i]));              \
+        passes++;                                                                      \
+    } while ((t1 = now()) - t0 < 1.0);                                                 \
+    printf("%-20s %8.2f M/s  (checksum %ld)\n", name, passes * n / (t1 - t0) / 1e6, checksum); \
+} while (0)
+
+#define HASHED_TAG(s)  encode_tag(key_of(s), val_of(s))
+#define LINEAR_TAG(s)  linear_encode_tag(key_of(s), val_of(s))
+#define HASHED_ROLE(s) encode_role(key_of(s))
+#define LINEAR_ROLE(s) linear_encode_role(key_of(s))
+
+int main (int argc, const char *argv[]) {
+    if (argc != 2) die ("usage: tagbench input.osm.pbf");
+    PbfReadCallbacks callbacks = {
+        .node = &handle_node,
+        .dense_nodes = &handle_dense_nodes,
+        .way = &handle_way,
+        .relation = &handle_relation
+    };
+    pbf_read_set_index(false);
+    pbf_read(argv[1], &callbacks);
+    make_tables();
+    fprintf(stderr, "sampled %zu tags and %zu roles\n", n_tags, n_roles);
+    if (n_tags == 0) die ("no tags found in input");
+
+    /* The linear scan compared prefixes, so report how often it gave a different code. */
+    size_t differ = 0, coded = 0;
+    for (size_t i = 0; i < n_tags; i++) {
+        int32_t code = HASHED_TAG(&(tag_samples[i]));
+        if (code != 0) coded++;
+        if (code != LINEAR_TAG(&(tag_samples[i]))) differ++;
+    }
+    printf("%zu tags, %.1f%% found in the dictionary, %zu coded differently by the linear scan\n",
+           n_tags, coded * 100.0 / n_tags, differ);
+
+    BENCHMARK("linear encode_tag", tag_samples, n_tags, LINEAR_TAG);
+    BENCHMARK("hashed encode_tag", tag_samples, n_tags, HASHED_TAG);
+    if (n_roles > 0) {
+        BENCHMARK("linear encode_role", role_samples, n_roles, LINEAR_ROLE);
+        BENCHMARK("hashed encode_role", role_samples, n_roles, HASHED_ROLE);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,132 @@
+#!/usr/bin/python3
+
+# Generate tags-hash.h from the tag list in tags.txt. This is run by the Makefile.
+# Usage: gentags.py tags.txt > tags-hash.h
+#
+# Each of the three dictionaries (key=value pairs, free-text keys, and relation roles) is compiled
+# into a minimal perfect hash, so the loader can find the code for a string with one hash and one
+# comparison instead of scanning the whole list. Codes are assigned in the order entries appear in
+# the tag list, so entries must only ever be appended to keep existing databases readable.
+#
+# The hash is 32-bit FNV-1a over the bytes of the key (then a zero byte and the value, for pairs).
+# Each hash value falls into one of n buckets, and each bucket has a seed chosen so that mixing
+# the hash values of all its entries with that seed sends them to n distinct slots.
+# The hash and mix functions must be kept identical to those in tags.c.
+
+import sys
+
+MASK = 0xffffffff
+FNV_BASIS = 2166136261
+FNV_PRIME = 16777619
+
+def fnv(h, data):
+    for b in bytearray(data):
+        h = ((h ^ b) * FNV_PRIME) & MASK
+    return h
+
+def mix(h, seed):
+    h = (h ^ (seed * 0x9e3779b9)) & MASK
+    h ^= h >> 16
+    h = (h * 0x85ebca6b) & MASK
+    h ^= h >> 13
+    h = (h * 0xc2b2ae35) & MASK
+    h ^= h >> 16
+    return h
+
+def key_hash(key):
+    return fnv(FNV_BASIS, key)
+
+def pair_hash(key, val):
+    return fnv(fnv(key_hash(key), b'\0'), val)
+
+def perfect_hash(hashes):
+    """Find a seed for each bucket, returning the seeds and the entry index held by each slot."""
+    n = len(hashes)
+    if len(set(hashes)) != n:
+        sys.exit("hash collision between two entries, change the hash function")
+    buckets = [[] for _ in range(n)]
+    for i, h in enumerate(hashes):
+        buckets[mix(h, 0) % n].append(i)
+    seeds = [0] * n
+    slots = [None] * n
+    # Place the largest buckets first, while most slots are still free.
+    for b in sorted(range(n), key=lambda b: -len(buckets[b])):
+        entries = buckets[b]
+        if not entries:
+            break
+        seed = 1
+        while True:
+            wanted = [mix(hashes[i], seed) % n for i in entries]
+            if len(set(wanted)) == len(wanted) and all(slots[s] is None for s in wanted):
+                break
+            seed += 1
+        if seed > 0xffff:
+            sys.exit("could not find a perfect hash for the tag list")
+        seeds[b] = seed
+        for i, s in zip(entries, wanted):
+            slots[s] = i
+    return seeds, slots
+
+def c_string(s):
+    return '"' + s.decode('utf-8').replace('\\', '\\\\').replace('"', '\\"') + '"'
+
+def c_array(ctype, name, items, per_line=8):
+    lines = []
+    for i in range(0, len(items), per_line):
+        lines.append('    ' + ', '.join(str(x) for x in items[i:i + per_line]) + ',')
+    space = '' if ctype.endswith('*') else ' '
+    return 'static %s%s%s[] = {\n%s\n};\n' % (ctype, space, name, '\n'.join(lines))
+
+def emit_hash(out, name, hashes):
+    seeds, slots = perfect_hash(hashes)
+    out.append(c_array('const uint16_t', name + '_seeds', seeds, 16))
+    out.append(c_array('const uint16_t', name + '_slots', slots, 16))
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit("usage: gentags.py tags.txt > tags-hash.h")
+    pairs, keys, roles = [], [], []
+    with open(sys.argv[1], 'rb') as f:
+        for number, line in enumerate(f, 1):
+            # Anything after a tab is a comment, such as the counts written by vex tagstats.
+            line = line.split(b'\t')[0].strip()
+            if not line or line.startswith(b'#'):
+                continue
+            kind, _, entry = line.partition(b' ')
+            if kind == b'tag' and b'=' in entry:
+                pairs.append(tuple(entry.split(b'=', 1)))
+            elif kind == b'key':
+                keys.append(entry)
+            elif kind == b'role':
+                roles.append(entry)
+            else:
+                sys.exit("%s:%d: expected 'tag key=value', 'key key' or 'role role'" % (sys.argv[1], number))
+    # Positive codes are pairs and negative codes are free-text keys, with the first 126 pairs and
+    # 64 keys stored in one byte and the rest in two (see tags.c). Role code zero means any other role.
+    # These limits must match those in tags.h.
+    if len(pairs) > 126 + 8192 or len(keys) > 64 + 8192 or len(roles) > 65535:
+        sys.exit("too many entries in tag list")
+    for entries in (pairs, keys, roles):
+        if len(set(entries)) != len(entries):
+            sys.exit("duplicate entry in tag list")
+    out = ['/* tags-hash.h : generated from %s by gentags.py, do not edit. */\n' % sys.argv[1]]
+    out.append('#define N_PAIRS %d\n#define N_FREE_TEXT_KEYS %d\n#define N_ROLES %d\n'
+               % (len(pairs), len(keys), len(roles)))
+    out.append('/* Key=value pairs. Code c refers to entry c - 1. */')
+    out.append(c_array('char *', 'pair_keys', [c_string(k) for k, v in pairs], 4))
+    out.append(c_array('char *', 'pair_vals', [c_string(v) for k, v in pairs], 4))
+    out.append(c_array('const uint8_t', 'pair_key_lens', [len(k) for k, v in pairs], 16))
+    out.append(c_array('const uint8_t', 'pair_val_lens', [len(v) for k, v in pairs], 16))
+    emit_hash(out, 'pair_hash', [pair_hash(k, v) for k, v in pairs])
+    out.append('/* Keys whose values are stored as free text. Code -c refers to entry c - 1. */')
+    out.append(c_array('char *', 'free_text_keys', [c_string(k) for k in keys], 4))
+    out.append(c_array('const uint8_t', 'free_text_key_lens', [len(k) for k in keys], 16))
+    emit_hash(out, 'free_text_key_hash', [key_hash(k) for k in keys])
+    out.append('/* Relation member roles. Code c refers to entry c - 1, and zero means any other role. */')
+    out.append(c_array('char *', 'roles', [c_string(r) for r in roles], 4))
+    out.append(c_array('const uint8_t', 'role_lens', [len(r) for r in roles], 16))
+    emit_hash(out, 'role_hash', [key_hash(r) for r in roles])
+    sys.stdout.write('\n'.join(out))
+
+if __name__ == '__main__':
+    main()
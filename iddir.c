@@ -0,0 +1,152 @@
+/* iddir.c */
+#include "iddir.h"
+
+/*
+  OSM IDs are assigned sequentially and never reused, so after years of deletions the live IDs are
+  scattered thinly across a range that keeps growing. Rather than indexing the element arrays by OSM
+  ID, which wastes whole pages of them on holes and puts a hard ceiling on the IDs that can be
+  loaded, each element is given a dense internal ID and the arrays are indexed by that.
+
+  The directory has one small page for every 64 OSM IDs. A lookup reads one page: the internal ID
+  is the page's base plus the number of present IDs below the one wanted, counted with a popcount.
+  The directory is itself sparse, but at 16 bytes per 64 IDs it is a quarter of a bit per ID.
+
+  Blocks of the input are loaded on several threads at once, and the IDs of neighbouring blocks may
+  share a page, so the pages at either end of a block cannot be counted up by one thread. Those pages
+  are given a full 64 internal IDs and their IDs are placed at a fixed distance from the base instead
+  of by rank. Blocks hold thousands of elements, so this costs very little density. The pages between
+  the two ends belong to one block and are packed exactly.
+
+  Internal ID zero is never given out, so elements that were not loaded read as all zeros, just as
+  the holes of the sparse arrays did.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define IDDIR_DIRECT (1ULL << 63) // IDs are at a fixed distance from the base instead of ranked
+#define CLAIM_BASE(c) ((uint32_t) (c))
+#define CLAIM_EPOCH(c) ((uint32_t) (((c) & ~IDDIR_DIRECT) >> 32))
+
+static void die (const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+size_t IdDir_size (int64_t max_id) {
+    return ((max_id >> IDDIR_PAGE_BITS) + 1) * sizeof(IdPage);
+}
+
+/* Find the page for an OSM ID, or NULL if the ID is out of the directory's range. */
+static IdPage *page_for_id (IdDirectory *dir, int64_t id) {
+    if (id < 0 || id > dir->max_id) return NULL;
+    return &(dir->pages[id >> IDDIR_PAGE_BITS]);
+}
+
+uint32_t IdDir_lookup (IdDirectory *dir, int64_t id) {
+    IdPage *page = page_for_id (dir, id);
+    if (page == NULL) return 0;
+    uint32_t bit = id & (IDDIR_PAGE_SIZE - 1);
+    uint64_t present = page->present;
+    if (!(present & (1ULL << bit))) return 0;
+    uint32_t internal = CLAIM_BASE(page->claim);
+    if (page->claim & IDDIR_DIRECT) internal += bit;
+    else internal += __builtin_popcountll (present & ((1ULL << bit) - 1));
+    return internal;
+}
+
+bool IdDir_seen (IdDirectory *dir, int64_t id) {
+    IdPage *page = page_for_id (dir, id);
+    return page != NULL && (page->present & (1ULL << (id & (IDDIR_PAGE_SIZE - 1))));
+}
+
+/* Allocate n consecutive internal IDs, returning the first. */
+static uint32_t reserve_ids (IdDirectory *dir, uint32_t n) {
+    uint64_t first = __sync_fetch_and_add (&(dir->n_ids), n);
+    if (first + n > dir->max_ids) die ("More elements are loaded than there are internal IDs for.");
+    return first;
+}
+
+/*
+  Whether a page's claim is to be kept: it was made by the current load, or before the checkpoint
+  this load resumed from. Any other claim was made by an earlier load or after the checkpoint, and
+  the internal IDs it points to may since have been given to other pages, so it is replaced.
+*/
+static bool claim_current (IdDirectory *dir, uint64_t claim) {
+    return claim != 0 && (CLAIM_EPOCH(claim) == dir->epoch || CLAIM_BASE(claim) < dir->restored);
+}
+
+/*
+  Claim a page for the given present IDs, taking internal IDs from *next for an exactly packed
+  page, or allocating a full page of them for a page that may be shared with another block.
+*/
+static void claim_page (IdDirectory *dir, IdPage *page, uint64_t bits, bool shared, uint32_t *next) {
+    uint64_t epoch = (uint64_t) dir->epoch << 32;
+    uint64_t claim = __atomic_load_n (&(page->claim), __ATOMIC_ACQUIRE);
+    while (true) {
+        if (claim_current (dir, claim)) {
+            if (claim & IDDIR_DIRECT) {
+                __atomic_fetch_or (&(page->present), bits, __ATOMIC_RELEASE);
+            } else if ((page->present & bits) != bits) {
+                /* A packed page belongs to one block, so it is only claimed already when that block is reloaded. */
+                die ("Input blocks have overlapping IDs. The input must be sorted by type then ID.");
+            }
+            return;
+        }
+        uint64_t new_claim = shared ? (reserve_ids (dir, IDDIR_PAGE_SIZE) | epoch | IDDIR_DIRECT)
+                                    : (*next | epoch);
+        if (__atomic_compare_exchange_n (&(page->claim), &claim, new_claim, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            if (shared) {
+                __atomic_fetch_or (&(page->present), bits, __ATOMIC_RELEASE);
+            } else {
+                __atomic_store_n (&(page->present), bits, __ATOMIC_RELEASE);
+                *next += __builtin_popcountll (bits);
+            }
+            return;
+        }
+        /* Another block claimed the page first. Any full page reserved here is left unused. */
+    }
+}
+
+void IdDir_assign (IdDirectory *dir, const int64_t *ids, size_t n, uint32_t *internal) {
+    if (n == 0) return;
+    if (page_for_id (dir, ids[0]) == NULL || page_for_id (dir, ids[n - 1]) == NULL)
+        die ("OSM data contains larger IDs than expected.");
+    int64_t first_page = ids[0] >> IDDIR_PAGE_BITS;
+    int64_t last_page = ids[n - 1] >> IDDIR_PAGE_BITS;
+    /* Count and reserve the internal IDs of the pages between the ends of the block all at once. */
+    uint32_t n_inner = 0;
+    for (size_t i = 0; i < n; i++) {
+        int64_t p = ids[i] >> IDDIR_PAGE_BITS;
+        if (p != first_page && p != last_page && (i == 0 || ids[i] != ids[i - 1])) n_inner++;
+    }
+    uint32_t next = n_inner > 0 ? reserve_ids (dir, n_inner) : 0;
+    /* Claim each page the block touches, then look up the internal IDs through the claimed pages. */
+    for (size_t i = 0; i < n; ) {
+        int64_t p = ids[i] >> IDDIR_PAGE_BITS;
+        uint64_t bits = 0;
+        size_t j = i;
+        for (; j < n && (ids[j] >> IDDIR_PAGE_BITS) == p; j++)
+            bits |= 1ULL << (ids[j] & (IDDIR_PAGE_SIZE - 1));
+        claim_page (dir, &(dir->pages[p]), bits, p == first_page || p == last_page, &next);
+        for (; i < j; i++) internal[i] = IdDir_lookup (dir, ids[i]);
+    }
+}
+
+int IdDir_open_page (IdDirectory *dir, int64_t id, IdMove moves[IDDIR_PAGE_SIZE]) {
+    IdPage *page = page_for_id (dir, id);
+    if (page == NULL) die ("OSM data contains larger IDs than expected.");
+    if (!claim_current (dir, page->claim) || (page->claim & IDDIR_DIRECT)) return 0;
+    uint32_t old_base = CLAIM_BASE(page->claim);
+    uint32_t new_base = reserve_ids (dir, IDDIR_PAGE_SIZE);
+    int n = 0;
+    for (int bit = 0; bit < IDDIR_PAGE_SIZE; bit++) {
+        if (!(page->present & (1ULL << bit))) continue;
+        moves[n].from = old_base + n;
+        moves[n].to = new_base + bit;
+        n++;
+    }
+    page->claim = new_base | ((uint64_t) dir->epoch << 32) | IDDIR_DIRECT;
+    return n;
+}
@@ -0,0 +1,59 @@
+/* iddir.h : translates sparse OSM IDs into dense internal IDs. */
+#ifndef IDDIR_H_INCLUDED
+#define IDDIR_H_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* The number of consecutive OSM IDs described by one directory page. */
+#define IDDIR_PAGE_BITS 6
+#define IDDIR_PAGE_SIZE (1 << IDDIR_PAGE_BITS)
+
+/*
+  One page of the directory. The internal IDs of the present OSM IDs in a page follow on from its
+  base, either in order of their rank among the present IDs, or at a fixed distance from the base
+  for pages that were shared between input blocks (see IdDir_assign).
+*/
+typedef struct {
+    uint64_t claim;   // base internal ID in the low 32 bits, load epoch and IDDIR_DIRECT above
+    uint64_t present; // one bit for each OSM ID in the page that has an internal ID
+} IdPage;
+
+/* A directory for one element type, whose pages are usually in a memory-mapped file. */
+typedef struct {
+    IdPage *pages;     // indexed by OSM ID / IDDIR_PAGE_SIZE
+    int64_t max_id;    // the highest OSM ID the pages can describe
+    uint32_t n_ids;    // the number of internal IDs allocated, counting the unused zero
+    uint32_t max_ids;  // the number of internal IDs the dense arrays have room for
+    uint32_t restored; // n_ids at the checkpoint the current load resumed from, or 1
+    uint32_t epoch;    // distinguishes pages claimed by the current load from those of earlier ones
+} IdDirectory;
+
+/* The size of the pages of a directory covering OSM IDs up to max_id. */
+size_t IdDir_size (int64_t max_id);
+
+/* Get the internal ID of an OSM ID, or zero if it has none. */
+uint32_t IdDir_lookup (IdDirectory *dir, int64_t id);
+
+/* Check whether an OSM ID has been given an internal ID by this or an interrupted earlier load. */
+bool IdDir_seen (IdDirectory *dir, int64_t id);
+
+/* Give internal IDs to the n OSM IDs of one input block, which must be in ascending order. */
+void IdDir_assign (IdDirectory *dir, const int64_t *ids, size_t n, uint32_t *internal);
+
+/* An element that must be copied from one internal ID to another. */
+typedef struct {
+    uint32_t from;
+    uint32_t to;
+} IdMove;
+
+/*
+  Make sure the page of an OSM ID can take a new internal ID outside of a bulk load, as when
+  applying updates. A page packed by IdDir_assign has no room for more IDs, so it is given a full page
+  of new internal IDs, and the elements of its present IDs must be copied to them. The copies are
+  written to moves, and their number returned. Not thread safe.
+*/
+int IdDir_open_page (IdDirectory *dir, int64_t id, IdMove moves[IDDIR_PAGE_SIZE]);
+
+#endif /* IDDIR_H_INCLUDED */
@@ -3,15 +3,12 @@
 
 /*
   A bitset intended for tracking usage of OSM IDs, which are 64 bit integers.
-  However most of that ID range is unused. If we just reserve one bit per ID that may be flagged,
-  we get something like 512 MB of space needed. To keep this simple we just allocate all that at
-  once and let the OS take care of paging. 
-  Note that the VM page size is typically 4 kBytes, so this is not as sparse as we'd ideally like.
-  But with one or more levels of indirection to dynamically allocated bins, the pointers to the 
-  bins are each 64 bits so the bins would need to be relatively large to be effective. It would
-  only really be advantageous if the bins were looked up in a dynamically resized hashtable rather
-  than a flat array, so it gets complicated quickly.
-  The approach used here is much more simple and much less prone to error.
+  However most of that ID range is unused. Node IDs have long since passed 2^32, and one bit per ID
+  up to 2^36 would be 8 GB, so the bits are kept in large chunks which are only allocated once an ID
+  within them is set. Note that the VM page size is typically 4 kBytes, so a flat array would not be
+  as sparse as we'd like anyway. With one level of indirection to dynamically allocated chunks, the
+  pointers to the chunks are each 64 bits so the chunks need to be relatively large to be effective.
+  At 512 kBytes (4M IDs) per chunk, the table of chunk pointers is only 128 kBytes.
 */
 
 #include <stdint.h>
@@ -20,33 +17,47 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-#define MAX_ID (1L << 32)
+#define MAX_ID (1L << 36)
 #define BIN_BITS 6
 #define BIN_MASK (64 - 1)
-#define N_BINS (MAX_ID >> BIN_BITS)
+#define CHUNK_BITS 16 // number of bits of the bin index within a chunk
+#define CHUNK_BINS (1L << CHUNK_BITS)
+#define N_CHUNKS ((MAX_ID >> BIN_BITS) >> CHUNK_BITS)
 
-static uint64_t bins[N_BINS];
+static uint64_t *chunks[N_CHUNKS];
 
 void IDTracker_reset () {
-    memset (bins, 0, sizeof(bins));
+    for (long c = 0; c < N_CHUNKS; c++) {
+        if (chunks[c] != NULL) memset (chunks[c], 0, CHUNK_BINS * sizeof(uint64_t));
+    }
 }
 
 bool IDTracker_set (uint64_t id) {
-    int bin_index = id >> BIN_BITS;
+    uint64_t bin_index = id >> BIN_BITS;
     int bit_index = id & BIN_MASK;
-    if (bin_index >= N_BINS) exit (-12);
-    uint64_t bit_flag = 1L << bit_index;
-    bool already_set = bins[bin_index] & bit_flag;
-    bins[bin_index] |= bit_flag;
+    uint64_t chunk_index = bin_index >> CHUNK_BITS;
+    if (chunk_index >= N_CHUNKS) exit (-12);
+    uint64_t *chunk = chunks[chunk_index];
+    if (chunk == NULL) {
+        chunk = chunks[chunk_index] = calloc (CHUNK_BINS, sizeof(uint64_t));
+        if (chunk == NULL) exit (-12);
+    }
+    uint64_t *bin = &(chunk[bin_index & (CHUNK_BINS - 1)]);
+    uint64_t bit_flag = 1ULL << bit_index;
+    bool already_set = *bin & bit_flag;
+    *bin |= bit_flag;
     return already_set;
 }
 
 bool IDTracker_get (uint64_t id) {
-    int bin_index = id >> BIN_BITS;
+    uint64_t bin_index = id >> BIN_BITS;
     int bit_index = id & BIN_MASK;
-    if (bin_index >= N_BINS) exit (-12);
-    uint64_t bit_flag = 1L << bit_index;
-    return bins[bin_index] & bit_flag;
+    uint64_t chunk_index = bin_index >> CHUNK_BITS;
+    if (chunk_index >= N_CHUNKS) exit (-12);
+    uint64_t *chunk = chunks[chunk_index];
+    if (chunk == NULL) return false;
+    uint64_t bit_flag = 1ULL << bit_index;
+    return chunk[bin_index & (CHUNK_BINS - 1)] & bit_flag;
 }
 
 int main_test () {
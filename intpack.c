@@ -120,6 +120,40 @@ sint64_pack(int64_t value, uint8_t *out)
 	return uint64_pack(zigzag64(value), out);
 }
 
+int64_t
+unzigzag64(uint64_t v)
+{
+	if (v & 1)
+		return -(v >> 1) - 1;
+	else
+		return v >> 1;
+}
+
+/* Read a varint written by uint64_pack, returning the number of bytes it took up. */
+size_t
+uint64_unpack(const uint8_t *in, uint64_t *value)
+{
+	uint64_t rv = in[0] & 0x7f;
+	unsigned i = 0;
+
+	while (in[i] & 0x80) {
+		i++;
+		rv |= ((uint64_t) (in[i] & 0x7f)) << (7 * i);
+	}
+	*value = rv;
+	return i + 1;
+}
+
+size_t
+sint64_unpack(const uint8_t *in, int64_t *value)
+{
+	uint64_t v;
+	size_t rv = uint64_unpack(in, &v);
+
+	*value = unzigzag64(v);
+	return rv;
+}
+
 
 
 
@@ -50,6 +50,15 @@ uint64_pack(uint64_t value, uint8_t *out);
 size_t
 sint64_pack(int64_t value, uint8_t *out);
 
+int64_t
+unzigzag64(uint64_t v);
+
+size_t
+uint64_unpack(const uint8_t *in, uint64_t *value);
+
+size_t
+sint64_unpack(const uint8_t *in, int64_t *value);
+
 
 
 
@@ -0,0 +1,199 @@
+/* mempolicy.c : page size and NUMA placement of the memory-mapped database files. */
+#include "mempolicy.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include <sys/syscall.h>
+
+/*
+  A planet database maps hundreds of gigabytes, and the loader and extracts touch it all over, so
+  with normal 4kB pages most of their accesses miss the TLB. Transparent huge pages can be requested
+  for each mapping with madvise. The kernel honours this for shared memory when
+  /sys/kernel/mm/transparent_hugepage/shmem_enabled is "advise" or "always", while huge pages in the
+  page cache of files on disk depend on the filesystem and kernel version. An in-memory database
+  can instead be put in a hugetlbfs mount, whose files are always backed by huge pages from the pool
+  the administrator reserved, so the pool must be large enough to hold the whole database.
+
+  On machines with several NUMA nodes, the pages of a mapping can be interleaved across the nodes, so
+  that loader threads on every node share the memory bandwidth, or bound to one node. Libnuma is not
+  required since the mbind system call is simple to make directly. The kernel applies the policy to
+  shared memory and hugetlbfs files, while the page cache of files on disk follows the policy of the
+  process, so for those run vex under `numactl --interleave=all` instead.
+
+  Since the kernel quietly falls back to normal pages and local nodes, the page sizes each mapping
+  actually got are read back from /proc/self/smaps and reported.
+*/
+
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#define MPOL_INTERLEAVE 3
+#endif
+
+#ifndef HUGETLBFS_MAGIC
+#define HUGETLBFS_MAGIC 0x958458f6
+#endif
+
+#define NUMA_NONE       0
+#define NUMA_INTERLEAVE 1
+#define NUMA_BIND       2
+
+/* The NUMA policy for one array, or for all those without their own rule when the name is empty. */
+typedef struct {
+    char name[32];
+    int policy;
+    int node;
+} NumaRule;
+
+#define MAX_NUMA_RULES 16
+static NumaRule numa_rules[MAX_NUMA_RULES];
+static int n_numa_rules = 0;
+
+static bool use_thp = false;
+static const char *hugetlb_dir = NULL;
+static size_t page_size = 0;
+
+static void die (const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+/* Parse one [array=]policy item of a NUMA placement option. */
+static void add_numa_rule (const char *item, size_t len) {
+    if (n_numa_rules == MAX_NUMA_RULES) die ("Too many NUMA placement rules.");
+    NumaRule *rule = &(numa_rules[n_numa_rules++]);
+    const char *eq = memchr (item, '=', len);
+    if (eq != NULL) {
+        size_t name_len = eq - item;
+        if (name_len == 0 || name_len >= sizeof(rule->name)) die ("Invalid array name in NUMA placement.");
+        memcpy (rule->name, item, name_len);
+        len -= name_len + 1;
+        item = eq + 1;
+    }
+    char *end;
+    if (len == strlen("interleave") && strncmp (item, "interleave", len) == 0) {
+        rule->policy = NUMA_INTERLEAVE;
+    } else {
+        rule->node = strtol (item, &end, 10);
+        if (len == 0 || end != item + len || rule->node < 0 || rule->node >= 64)
+            die ("NUMA placement must be 'interleave' or a node number.");
+        rule->policy = NUMA_BIND;
+    }
+}
+
+void MemPolicy_init (const char *huge, const char *numa) {
+    page_size = sysconf (_SC_PAGESIZE);
+    if (huge != NULL) {
+        if (strcmp (huge, "thp") == 0) {
+            use_thp = true;
+        } else {
+            struct statfs st;
+            if (statfs (huge, &st) != 0 || st.f_type != HUGETLBFS_MAGIC)
+                die ("The huge page option must be 'thp' or a directory on a hugetlbfs mount.");
+            hugetlb_dir = huge;
+            page_size = st.f_bsize; // the huge page size of the mount
+        }
+    }
+    if (numa != NULL) {
+        while (true) {
+            const char *comma = strchr (numa, ',');
+            size_t len = comma == NULL ? strlen (numa) : (size_t) (comma - numa);
+            add_numa_rule (numa, len);
+            if (comma == NULL) break;
+            numa = comma + 1;
+        }
+    }
+}
+
+const char *MemPolicy_hugetlb_dir () {
+    return hugetlb_dir;
+}
+
+size_t MemPolicy_page_size () {
+    if (page_size == 0) page_size = sysconf (_SC_PAGESIZE);
+    return page_size;
+}
+
+/* Find the NUMA rule for an array, preferring one naming it to the general rule. */
+static NumaRule *numa_rule (const char *name) {
+    NumaRule *found = NULL;
+    for (int r = 0; r < n_numa_rules; r++) {
+        if (strcmp (numa_rules[r].name, name) == 0) return &(numa_rules[r]);
+        if (numa_rules[r].name[0] == '\0') found = &(numa_rules[r]);
+    }
+    return found;
+}
+
+/* Get the mask of online NUMA nodes, such as "0-1,3", or only node zero on a kernel without NUMA. */
+static unsigned long online_nodes () {
+    unsigned long mask = 0;
+    FILE *file = fopen ("/sys/devices/system/node/online", "r");
+    if (file != NULL) {
+        int first, last;
+        while (fscanf (file, "%d", &first) == 1) {
+            last = first;
+            if (fscanf (file, "-%d", &last) != 1) last = first;
+            for (int n = first; n <= last && n < 64; n++) mask |= 1UL << n;
+            if (fgetc (file) != ',') break;
+        }
+        fclose (file);
+    }
+    return mask == 0 ? 1 : mask;
+}
+
+void MemPolicy_apply (const char *name, void *base, size_t size) {
+    if (use_thp && madvise (base, size, MADV_HUGEPAGE) != 0)
+        fprintf (stderr, "Transparent huge pages are not available for '%s'.\n", name);
+    NumaRule *rule = numa_rule (name);
+    if (rule == NULL) return;
+    unsigned long mask;
+    int mode;
+    if (rule->policy == NUMA_INTERLEAVE) {
+        mode = MPOL_INTERLEAVE;
+        mask = online_nodes ();
+    } else {
+        mode = MPOL_BIND;
+        mask = 1UL << rule->node;
+    }
+    /* The kernel reads one less bit than the maximum node given, see mbind(2). */
+    if (syscall (SYS_mbind, base, size, mode, &mask, sizeof(mask) * 8 + 1, 0) != 0)
+        fprintf (stderr, "Could not set the NUMA policy of '%s'.\n", name);
+}
+
+void MemPolicy_report (const char *name, void *base) {
+    FILE *file = fopen ("/proc/self/smaps", "r");
+    if (file == NULL) return;
+    char line[256];
+    bool found = false;
+    long kernel_page = 0, huge = 0, value;
+    bool advised = false;
+    while (fgets (line, sizeof(line), file) != NULL) {
+        unsigned long start, end;
+        if (sscanf (line, "%lx-%lx ", &start, &end) == 2) {
+            /* A header line begins the next mapping. */
+            if (found) break;
+            found = (start == (uintptr_t) base);
+        } else if (!found) {
+            continue;
+        } else if (sscanf (line, "KernelPageSize: %ld kB", &value) == 1) {
+            kernel_page = value;
+        } else if (sscanf (line, "AnonHugePages: %ld kB", &value) == 1
+                || sscanf (line, "ShmemPmdMapped: %ld kB", &value) == 1
+                || sscanf (line, "FilePmdMapped: %ld kB", &value) == 1
+                || sscanf (line, "Shared_Hugetlb: %ld kB", &value) == 1
+                || sscanf (line, "Private_Hugetlb: %ld kB", &value) == 1) {
+            huge += value;
+        } else if (strncmp (line, "VmFlags:", 8) == 0) {
+            advised = (strstr (line, " hg") != NULL);
+        }
+    }
+    fclose (file);
+    if (!found) return;
+    fprintf (stderr, "%-12s %7ld kB pages, %10ld kB mapped in huge pages%s\n", name, kernel_page, huge,
+             advised ? ", huge pages advised" : "");
+}
@@ -0,0 +1,27 @@
+/* mempolicy.h : page size and NUMA placement of the memory-mapped database files. */
+#ifndef MEMPOLICY_H_INCLUDED
+#define MEMPOLICY_H_INCLUDED
+
+#include <stddef.h>
+
+/*
+  Set the huge page mode, either "thp" to ask for transparent huge pages on every mapping or the path
+  of a mounted hugetlbfs directory to back an in-memory database with explicit huge pages, and the
+  NUMA placement, a comma separated list of [array=]policy where policy is "interleave" or a node
+  number to bind to. Either may be NULL.
+*/
+void MemPolicy_init (const char *huge, const char *numa);
+
+/* The directory on a hugetlbfs mount in which to create in-memory database files, or NULL. */
+const char *MemPolicy_hugetlb_dir ();
+
+/* The size of the pages backing files in the hugetlbfs directory, or of normal pages without one. */
+size_t MemPolicy_page_size ();
+
+/* Apply the huge page and NUMA settings to the mapping of the named array. */
+void MemPolicy_apply (const char *name, void *base, size_t size);
+
+/* Print the page size and the amount mapped with huge pages of the mapping beginning at base. */
+void MemPolicy_report (const char *name, void *base);
+
+#endif /* MEMPOLICY_H_INCLUDED */
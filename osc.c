@@ -0,0 +1,434 @@
+/* osc.c : reads OsmChange (.osc) replication diffs, handing their elements to callbacks as PBF messages. */
+#include "osc.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "zlib.h"
+
+/*
+  An OsmChange file is XML: create, modify and delete sections holding nodes, ways and relations in
+  the same form as an .osm file. Only a handful of tags ever appear, none of them with text content,
+  so rather than a general XML parser this reads one markup tag at a time from a buffer refilled from
+  the file, splits out its attributes and unescapes their values in place. The strings and lists of
+  the element being read are copied into arrays that are reused from one element to the next.
+  zlib reads plain files as well as gzipped ones, so replication diffs can be used as downloaded.
+*/
+
+static void die(const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+#define READ_SIZE (1 << 20)
+
+/* The unread part of the file, from pos up to len. */
+typedef struct {
+    gzFile file;
+    char *buf;
+    size_t pos, len, size;
+    bool eof;
+} OscInput;
+
+/* Element types, which are the same numbers as the member types of relations. */
+#define NO_ELEMENT -1
+#define NODE     OSMPBF__RELATION__MEMBER_TYPE__NODE
+#define WAY      OSMPBF__RELATION__MEMBER_TYPE__WAY
+#define RELATION OSMPBF__RELATION__MEMBER_TYPE__RELATION
+
+/* The element being read, and the arrays its message is built from. */
+typedef struct {
+    int type;          // NODE, WAY or RELATION, or NO_ELEMENT between elements
+    int64_t id, lat, lon;
+    char *chars;       // the element's strings, one after another
+    size_t n_chars, chars_size;
+    size_t *offsets;   // where each string begins in chars
+    ProtobufCBinaryData *strings;
+    size_t n_strings, strings_size;
+    uint32_t *keys, *vals;
+    size_t n_tags, tags_size;
+    int64_t *refs;     // way refs or relation member ids, not yet delta coded
+    int32_t *roles;
+    OSMPBF__Relation__MemberType *types;
+    size_t n_refs, refs_size;
+} OscElement;
+
+/* Make room for n items in an array, doubling its size as needed. */
+static void *grow (void *array, size_t *size, size_t n, size_t item_size) {
+    if (n <= *size) return array;
+    size_t new_size = *size == 0 ? 256 : *size;
+    while (new_size < n) new_size *= 2;
+    array = realloc (array, new_size * item_size);
+    if (array == NULL) die ("Could not grow OsmChange element arrays.");
+    *size = new_size;
+    return array;
+}
+
+/* Read more of the file into the buffer, keeping its unread part. Returns false at the end of the file. */
+static bool refill (OscInput *in) {
+    if (in->eof) return false;
+    memmove (in->buf, in->buf + in->pos, in->len - in->pos);
+    in->len -= in->pos;
+    in->pos = 0;
+    in->buf = grow (in->buf, &(in->size), in->len + READ_SIZE + 1, 1);
+    int n = gzread (in->file, in->buf + in->len, READ_SIZE);
+    if (n < 0) die ("Could not read OsmChange file.");
+    if (n == 0) in->eof = true;
+    in->len += n;
+    return n > 0;
+}
+
+/*
+  Find the next markup tag, returning its text between the angle brackets as a terminated string
+  in the buffer, which stays valid until the next call. Returns NULL at the end of the file.
+  Comments are skipped, and a > within a quoted attribute value does not end the tag.
+*/
+static char *next_markup (OscInput *in) {
+    while (true) {
+        char *open = memchr (in->buf + in->pos, '<', in->len - in->pos);
+        if (open == NULL) {
+            in->pos = in->len;
+            if (!refill (in)) return NULL;
+            continue;
+        }
+        in->pos = open - in->buf;
+        size_t start = in->pos + 1;
+        size_t end = start;
+        char quote = 0;
+        bool comment = false;
+        while (true) {
+            if (end >= in->len) {
+                size_t pos = in->pos;
+                if (!refill (in)) die ("OsmChange file ends within a tag.");
+                start -= pos;
+                end -= pos;
+                continue;
+            }
+            char c = in->buf[end];
+            if (end == start + 2 && strncmp (in->buf + start, "!--", 3) == 0) comment = true;
+            if (comment) {
+                if (c == '>' && end >= start + 5 && strncmp (in->buf + end - 2, "--", 2) == 0) break;
+            } else if (quote != 0) {
+                if (c == quote) quote = 0;
+            } else if (c == '"' || c == '\'') {
+                quote = c;
+            } else if (c == '>') {
+                break;
+            }
+            end++;
+        }
+        in->pos = end + 1;
+        if (comment) continue;
+        in->buf[end] = '\0';
+        return in->buf + start;
+    }
+}
+
+/* Write a character as UTF-8, returning the number of bytes written. */
+static int put_utf8 (char *out, unsigned long c) {
+    if (c < 0x80) {
+        out[0] = c;
+        return 1;
+    } else if (c < 0x800) {
+        out[0] = 0xC0 | (c >> 6);
+        out[1] = 0x80 | (c & 0x3F);
+        return 2;
+    } else if (c < 0x10000) {
+        out[0] = 0xE0 | (c >> 12);
+        out[1] = 0x80 | ((c >> 6) & 0x3F);
+        out[2] = 0x80 | (c & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | (c >> 18);
+    out[1] = 0x80 | ((c >> 12) & 0x3F);
+    out[2] = 0x80 | ((c >> 6) & 0x3F);
+    out[3] = 0x80 | (c & 0x3F);
+    return 4;
+}
+
+/* Replace the XML character and entity references in a terminated string, in place. */
+static void unescape (char *s) {
+    static const char *entities[] = { "amp;&", "lt;<", "gt;>", "quot;\"", "apos;'" };
+    char *out = s;
+    while (*s != '\0') {
+        if (*s != '&') {
+            *(out++) = *(s++);
+            continue;
+        }
+        s++;
+        if (*s == '#') {
+            char *end;
+            unsigned long c = (s[1] == 'x') ? strtoul (s + 2, &end, 16) : strtoul (s + 1, &end, 10);
+            if (*end != ';' || c > 0x10FFFF) die ("Invalid character reference in OsmChange file.");
+            out += put_utf8 (out, c);
+            s = end + 1;
+            continue;
+        }
+        bool found = false;
+        for (int e = 0; e < sizeof(entities) / sizeof(entities[0]); e++) {
+            size_t len = strlen (entities[e]) - 1;
+            if (strncmp (s, entities[e], len) == 0) {
+                *(out++) = entities[e][len];
+                s += len;
+                found = true;
+                break;
+            }
+        }
+        if (!found) die ("Unknown entity in OsmChange file.");
+    }
+    *out = '\0';
+}
+
+/*
+  Split the next name="value" attribute from the text of a markup tag, advancing past it.
+  Returns false once there are no more attributes.
+*/
+static bool next_attribute (char **text, char **name, char **value) {
+    char *p = *text;
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+    if (*p == '\0' || *p == '/' || *p == '?') return false;
+    *name = p;
+    while (*p != '=' && *p != '\0' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') p++;
+    char *name_end = p;
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+    if (*p != '=') die ("Attribute without a value in OsmChange file.");
+    p++;
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+    char quote = *p;
+    if (quote != '"' && quote != '\'') die ("Unquoted attribute value in OsmChange file.");
+    *value = ++p;
+    p = strchr (p, quote);
+    if (p == NULL) die ("Unterminated attribute value in OsmChange file.");
+    *name_end = '\0';
+    *p = '\0';
+    unescape (*value);
+    *text = p + 1;
+    return true;
+}
+
+/* Copy a string into the element's string table, returning its index. */
+static uint32_t add_string (OscElement *e, const char *s) {
+    size_t len = strlen (s);
+    e->chars = grow (e->chars, &(e->chars_size), e->n_chars + len, 1);
+    memcpy (e->chars + e->n_chars, s, len);
+    size_t size = e->strings_size;
+    e->offsets = grow (e->offsets, &(e->strings_size), e->n_strings + 1, sizeof(size_t));
+    if (e->strings_size != size) {
+        e->strings = realloc (e->strings, e->strings_size * sizeof(ProtobufCBinaryData));
+        if (e->strings == NULL) die ("Could not grow OsmChange element arrays.");
+    }
+    e->offsets[e->n_strings] = e->n_chars;
+    e->strings[e->n_strings].len = len;
+    e->n_chars += len;
+    return e->n_strings++;
+}
+
+/* Parse an ID or reference attribute. */
+static int64_t parse_id (const char *value) {
+    char *end;
+    int64_t id = strtoll (value, &end, 10);
+    if (*value == '\0' || *end != '\0') die ("Invalid ID in OsmChange file.");
+    return id;
+}
+
+/* Parse a latitude or longitude attribute into nanodegrees. */
+static int64_t parse_coord (const char *value) {
+    char *end;
+    double degrees = strtod (value, &end);
+    if (*value == '\0' || *end != '\0') die ("Invalid coordinate in OsmChange file.");
+    return llround (degrees * 1000000000.0);
+}
+
+/* Begin a new node, way or relation from the attributes of its start tag. */
+static void begin_element (OscElement *e, int type, char *attributes) {
+    e->type = type;
+    e->id = e->lat = e->lon = 0;
+    e->n_chars = e->n_strings = e->n_tags = e->n_refs = 0;
+    char *name, *value;
+    bool has_id = false;
+    while (next_attribute (&attributes, &name, &value)) {
+        if (strcmp (name, "id") == 0) {
+            e->id = parse_id (value);
+            has_id = true;
+        } else if (strcmp (name, "lat") == 0) {
+            e->lat = parse_coord (value);
+        } else if (strcmp (name, "lon") == 0) {
+            e->lon = parse_coord (value);
+        }
+    }
+    if (!has_id) die ("Element without an ID in OsmChange file.");
+}
+
+/* Add a tag, nd or member child tag to the element being read. */
+static void add_child (OscElement *e, const char *tag, char *attributes) {
+    char *name, *value;
+    if (strcmp (tag, "tag") == 0) {
+        const char *k = NULL, *v = NULL;
+        while (next_attribute (&attributes, &name, &value)) {
+            if (strcmp (name, "k") == 0) k = value;
+            else if (strcmp (name, "v") == 0) v = value;
+        }
+        if (k == NULL || v == NULL) die ("Tag without a key or value in OsmChange file.");
+        size_t size = e->tags_size;
+        e->keys = grow (e->keys, &(e->tags_size), e->n_tags + 1, sizeof(uint32_t));
+        if (e->tags_size != size) {
+            e->vals = realloc (e->vals, e->tags_size * sizeof(uint32_t));
+            if (e->vals == NULL) die ("Could not grow OsmChange element arrays.");
+        }
+        e->keys[e->n_tags] = add_string (e, k);
+        e->vals[e->n_tags] = add_string (e, v);
+        e->n_tags++;
+        return;
+    }
+    bool nd = (strcmp (tag, "nd") == 0);
+    if (!nd && strcmp (tag, "member") != 0) return;
+    int64_t ref = 0;
+    int type = NODE;
+    const char *role = "";
+    bool has_ref = false;
+    while (next_attribute (&attributes, &name, &value)) {
+        if (strcmp (name, "ref") == 0) {
+            ref = parse_id (value);
+            has_ref = true;
+        } else if (strcmp (name, "role") == 0) {
+            role = value;
+        } else if (strcmp (name, "type") == 0) {
+            if (strcmp (value, "node") == 0) type = NODE;
+            else if (strcmp (value, "way") == 0) type = WAY;
+            else if (strcmp (value, "relation") == 0) type = RELATION;
+            else die ("Unknown member type in OsmChange file.");
+        }
+    }
+    if (!has_ref) die ("Reference without an ID in OsmChange file.");
+    size_t size = e->refs_size;
+    e->refs = grow (e->refs, &(e->refs_size), e->n_refs + 1, sizeof(int64_t));
+    if (e->refs_size != size) {
+        e->roles = realloc (e->roles, e->refs_size * sizeof(int32_t));
+        e->types = realloc (e->types, e->refs_size * sizeof(OSMPBF__Relation__MemberType));
+        if (e->roles == NULL || e->types == NULL) die ("Could not grow OsmChange element arrays.");
+    }
+    e->refs[e->n_refs] = ref;
+    if (!nd) {
+        e->roles[e->n_refs] = add_string (e, role);
+        e->types[e->n_refs] = type;
+    }
+    e->n_refs++;
+}
+
+/* Delta code an array in place, as the refs and member IDs of PBF messages are. */
+static void delta_code (int64_t *values, size_t n) {
+    for (size_t i = n; i > 1; i--) values[i - 1] -= values[i - 2];
+}
+
+/* Hand the element that has just ended to its callback, as a PBF message. */
+static void end_element (OscElement *e, int action, OscReadCallbacks *callbacks) {
+    if (action < 0) die ("OsmChange element is outside of a create, modify or delete section.");
+    /* The strings were copied into one array that may since have moved, so point at them only now. */
+    for (size_t s = 0; s < e->n_strings; s++) e->strings[s].data = (uint8_t *) e->chars + e->offsets[s];
+    if (callbacks->block_strings != NULL) (*(callbacks->block_strings))(e->strings, e->n_strings);
+    delta_code (e->refs, e->n_refs);
+    if (e->type == NODE) {
+        OSMPBF__Node node;
+        memset (&node, 0, sizeof(node));
+        node.id = e->id;
+        node.keys = e->keys;
+        node.vals = e->vals;
+        node.n_keys = node.n_vals = e->n_tags;
+        node.lat = e->lat;
+        node.lon = e->lon;
+        (*(callbacks->node))(action, &node, e->strings);
+    } else if (e->type == WAY) {
+        OSMPBF__Way way;
+        memset (&way, 0, sizeof(way));
+        way.id = e->id;
+        way.keys = e->keys;
+        way.vals = e->vals;
+        way.n_keys = way.n_vals = e->n_tags;
+        way.refs = e->refs;
+        way.n_refs = e->n_refs;
+        (*(callbacks->way))(action, &way, e->strings);
+    } else {
+        OSMPBF__Relation relation;
+        memset (&relation, 0, sizeof(relation));
+        relation.id = e->id;
+        relation.keys = e->keys;
+        relation.vals = e->vals;
+        relation.n_keys = relation.n_vals = e->n_tags;
+        relation.memids = e->refs;
+        relation.roles_sid = e->roles;
+        relation.types = e->types;
+        relation.n_memids = relation.n_roles_sid = relation.n_types = e->n_refs;
+        (*(callbacks->relation))(action, &relation, e->strings);
+    }
+    e->type = NO_ELEMENT;
+}
+
+/* Get the element type named by a tag, or NO_ELEMENT. */
+static int element_type (const char *tag) {
+    if (strcmp (tag, "node") == 0) return NODE;
+    if (strcmp (tag, "way") == 0) return WAY;
+    if (strcmp (tag, "relation") == 0) return RELATION;
+    return NO_ELEMENT;
+}
+
+/* Externally visible function. */
+void osc_read (const char *filename, OscReadCallbacks *callbacks) {
+    OscInput in;
+    memset (&in, 0, sizeof(in));
+    in.file = gzopen (filename, "rb");
+    if (in.file == NULL) die ("Could not open OsmChange file.");
+    gzbuffer (in.file, READ_SIZE);
+    OscElement e;
+    memset (&e, 0, sizeof(e));
+    e.type = NO_ELEMENT;
+    int action = -1;
+    long n_elements = 0;
+    char *markup;
+    while ((markup = next_markup (&in)) != NULL) {
+        if (markup[0] == '?' || markup[0] == '!') continue; // XML declaration or doctype
+        bool closing = (markup[0] == '/');
+        if (closing) markup++;
+        /* Split the tag name from its attributes. */
+        char *attributes = markup + strcspn (markup, " \t\n\r/");
+        size_t len = strlen (markup);
+        bool empty = !closing && len > 0 && markup[len - 1] == '/';
+        char saved = *attributes;
+        *attributes = '\0';
+        char *tag = markup;
+        if (saved != '\0') attributes++;
+        if (strcmp (tag, "create") == 0 || strcmp (tag, "modify") == 0 || strcmp (tag, "delete") == 0) {
+            if (e.type != NO_ELEMENT) die ("OsmChange section begins or ends within an element.");
+            if (closing || empty) action = -1;
+            else action = (tag[0] == 'c') ? OSC_CREATE : (tag[0] == 'm') ? OSC_MODIFY : OSC_DELETE;
+            continue;
+        }
+        int type = element_type (tag);
+        if (type != NO_ELEMENT) {
+            if (closing) {
+                if (type != e.type) die ("Mismatched element end tag in OsmChange file.");
+            } else {
+                if (e.type != NO_ELEMENT) die ("OsmChange elements are nested.");
+                begin_element (&e, type, attributes);
+            }
+            if (closing || empty) {
+                end_element (&e, action, callbacks);
+                n_elements++;
+            }
+        } else if (!closing && e.type != NO_ELEMENT) {
+            add_child (&e, tag, attributes);
+        }
+    }
+    if (e.type != NO_ELEMENT) die ("OsmChange file ends within an element.");
+    gzclose (in.file);
+    free (in.buf);
+    free (e.chars);
+    free (e.offsets);
+    free (e.strings);
+    free (e.keys);
+    free (e.vals);
+    free (e.refs);
+    free (e.roles);
+    free (e.types);
+    fprintf (stderr, "read %ld elements from OsmChange file.\n", n_elements);
+}
@@ -0,0 +1,31 @@
+/* osc.h : reads OsmChange (.osc) replication diffs, handing their elements to callbacks as PBF messages. */
+#ifndef OSC_H_INCLUDED
+#define OSC_H_INCLUDED
+
+#include "pbf.h"
+
+/* The action applied to an element, given by the section of the OsmChange file it appears in. */
+#define OSC_CREATE 0
+#define OSC_MODIFY 1
+#define OSC_DELETE 2
+
+/*
+  Each element is handed to the callback for its type as the same message the PBF reader would
+  produce, so the loader's code for storing tags and refs can be reused: way refs and relation member
+  IDs are delta coded, coordinates are in nanodegrees, and keys, values and roles are indexes into a
+  string table holding the strings of that element alone. If block_strings is defined, it is called
+  with each element's string table before the element is handed over, as with PbfReadCallbacks.
+  Elements of deletions may carry nothing but their ID. Everything is handed over on the calling
+  thread, in the order of the file.
+*/
+typedef struct {
+    void (*node)     (int action, OSMPBF__Node*,     ProtobufCBinaryData *string_table);
+    void (*way)      (int action, OSMPBF__Way*,      ProtobufCBinaryData *string_table);
+    void (*relation) (int action, OSMPBF__Relation*, ProtobufCBinaryData *string_table);
+    void (*block_strings) (ProtobufCBinaryData *string_table, size_t n_strings);
+} OscReadCallbacks;
+
+/* Read an OsmChange file, which may be gzipped, handing each element to the callbacks. */
+void osc_read (const char *filename, OscReadCallbacks *callbacks);
+
+#endif /* OSC_H_INCLUDED */
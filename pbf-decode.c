@@ -0,0 +1,592 @@
+/* pbf-decode.c : streaming decoder that reads PBF messages in place, without unpacking them */
+#include "pbf-decode.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+  protobuf-c unpacks every element of a block into its own heap-allocated message, along with all
+  of its repeated fields, only for them to be freed again once the block is handled. Here the
+  serialized block is walked directly. Packed fields are left in place as runs of varints, and are
+  only decoded as each element is handed to a callback, into arrays that are reused across elements.
+*/
+
+static void die(const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+/* Protobuf wire types. */
+#define WIRE_VARINT  0
+#define WIRE_FIXED64 1
+#define WIRE_BYTES   2
+#define WIRE_FIXED32 5
+
+static inline uint64_t read_varint (PbfBytes *b) {
+    /* Most varints in a PBF are string table indexes and deltas that fit in a single byte. */
+    if (b->pos < b->end && *b->pos < 0x80)
+        return *(b->pos++);
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64 && b->pos < b->end; shift += 7) {
+        uint8_t byte = *(b->pos++);
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (byte < 0x80)
+            return value;
+    }
+    die("malformed varint in PBF");
+    return 0;
+}
+
+/* Undo the zigzag encoding used for sint32 and sint64 fields. */
+static inline int64_t unzigzag (uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/* Read the key of the next field, returning false at the end of the message. */
+static inline bool next_field (PbfBytes *b, uint32_t *field, int *wire_type) {
+    if (b->pos >= b->end)
+        return false;
+    uint64_t key = read_varint(b);
+    *field = key >> 3;
+    *wire_type = key & 7;
+    return true;
+}
+
+/* Read the payload of a length-delimited field. */
+static inline PbfBytes read_bytes (PbfBytes *b) {
+    uint64_t len = read_varint(b);
+    if (len > (uint64_t)(b->end - b->pos))
+        die("length-delimited field runs past the end of its PBF message");
+    PbfBytes bytes = { b->pos, b->pos + len };
+    b->pos += len;
+    return bytes;
+}
+
+static void skip_field (PbfBytes *b, int wire_type) {
+    size_t len;
+    switch (wire_type) {
+    case WIRE_VARINT:
+        read_varint(b);
+        return;
+    case WIRE_BYTES:
+        read_bytes(b);
+        return;
+    case WIRE_FIXED64:
+        len = 8;
+        break;
+    case WIRE_FIXED32:
+        len = 4;
+        break;
+    default:
+        die("unsupported wire type in PBF");
+        return;
+    }
+    if (len > (size_t)(b->end - b->pos))
+        die("fixed-width field runs past the end of its PBF message");
+    b->pos += len;
+}
+
+/* Resize an array to hold exactly n elements of the given size, keeping its contents. */
+static void *resize (void *array, size_t n, size_t element_size) {
+    array = realloc(array, n * element_size);
+    if (array == NULL)
+        die("could not grow PBF decoder array");
+    return array;
+}
+
+/* Return a capacity of at least n, doubling the current size so arrays are grown only rarely. */
+static size_t grown_size (size_t size, size_t n) {
+    size_t new_size = size < 64 ? 64 : size;
+    while (new_size < n)
+        new_size *= 2;
+    return new_size;
+}
+
+/* Grow an array to hold at least n elements of the given size, keeping its contents. */
+static void *reserve (void *array, size_t *size, size_t n, size_t element_size) {
+    if (n <= *size)
+        return array;
+    *size = grown_size(*size, n);
+    return resize(array, *size, element_size);
+}
+
+/* Each varint ends in a byte with the high bit clear, so the number of values is easy to count. */
+static size_t count_varints (PbfBytes b) {
+    size_t n = 0;
+    for (const uint8_t *p = b.pos; p < b.end; ++p)
+        n += (*p < 0x80);
+    return n;
+}
+
+/*
+  Define a function that appends one occurrence of a repeated varint field to an array, and returns
+  the new number of elements. Writers should pack these fields, but unpacked values are also legal.
+*/
+#define READ_REPEATED(name, type, decode)                                               \
+static size_t name (PbfBytes *b, int wire_type, type **array, size_t *size, size_t n) { \
+    if (wire_type == WIRE_VARINT) {                                                     \
+        *array = reserve(*array, size, n + 1, sizeof(type));                            \
+        uint64_t value = read_varint(b);                                                \
+        (*array)[n++] = (type)(decode);                                                 \
+    } else if (wire_type == WIRE_BYTES) {                                               \
+        PbfBytes packed = read_bytes(b);                                                \
+        *array = reserve(*array, size, n + count_varints(packed), sizeof(type));        \
+        while (packed.pos < packed.end) {                                               \
+            uint64_t value = read_varint(&packed);                                      \
+            (*array)[n++] = (type)(decode);                                             \
+        }                                                                               \
+    } else {                                                                            \
+        die("unexpected wire type for repeated PBF field");                             \
+    }                                                                                   \
+    return n;                                                                           \
+}
+
+READ_REPEATED(read_uint32s, uint32_t, value)
+READ_REPEATED(read_int32s, int32_t, value)
+READ_REPEATED(read_sint64s, int64_t, unzigzag(value))
+READ_REPEATED(read_member_types, OSMPBF__Relation__MemberType, value)
+
+/* Externally visible function. */
+void pbf_decode_blob_header (const uint8_t *data, size_t size, PbfBytes *type, int32_t *datasize) {
+    PbfBytes b = { data, data + size };
+    type->pos = type->end = NULL;
+    *datasize = -1;
+    uint32_t field;
+    int wire_type;
+    while (next_field(&b, &field, &wire_type)) {
+        if (field == 1 && wire_type == WIRE_BYTES)
+            *type = read_bytes(&b);
+        else if (field == 3 && wire_type == WIRE_VARINT)
+            *datasize = read_varint(&b);
+        else
+            skip_field(&b, wire_type);
+    }
+    if (type->pos == NULL || *datasize < 0)
+        die("blob header is missing its type or size");
+}
+
+/* Externally visible function. */
+void pbf_decode_blob (const uint8_t *data, size_t size, PbfBytes *raw, PbfBytes *zlib_data, int32_t *raw_size) {
+    PbfBytes b = { data, data + size };
+    raw->pos = raw->end = zlib_data->pos = zlib_data->end = NULL;
+    *raw_size = 0;
+    uint32_t field;
+    int wire_type;
+    while (next_field(&b, &field, &wire_type)) {
+        if (field == 1 && wire_type == WIRE_BYTES)
+            *raw = read_bytes(&b);
+        else if (field == 2 && wire_type == WIRE_VARINT)
+            *raw_size = read_varint(&b);
+        else if (field == 3 && wire_type == WIRE_BYTES)
+            *zlib_data = read_bytes(&b);
+        else
+            skip_field(&b, wire_type);
+    }
+}
+
+/* Note which element types a group contains, without decoding any of them. */
+static void scan_group (PbfGroup *group) {
+    PbfBytes b = group->bytes;
+    group->has_nodes = group->has_ways = group->has_relations = false;
+    uint32_t field;
+    int wire_type;
+    while (next_field(&b, &field, &wire_type)) {
+        if (field == 1 || field == 2)
+            group->has_nodes = true;
+        else if (field == 3)
+            group->has_ways = true;
+        else if (field == 4)
+            group->has_relations = true;
+        skip_field(&b, wire_type);
+    }
+}
+
+/* Externally visible function. */
+void pbf_decode_block (PbfBlock *block, const uint8_t *data, size_t size) {
+    PbfBytes b = { data, data + size };
+    block->n_strings = 0;
+    block->n_groups = 0;
+    block->granularity = 100;
+    block->lat_offset = 0;
+    block->lon_offset = 0;
+    uint32_t field;
+    int wire_type;
+    while (next_field(&b, &field, &wire_type)) {
+        if (field == 1 && wire_type == WIRE_BYTES) {
+            /* The string table only holds bytes fields, which are borrowed as they lie. */
+            PbfBytes st = read_bytes(&b);
+            uint32_t st_field;
+            int st_wire_type;
+            while (next_field(&st, &st_field, &st_wire_type)) {
+                if (st_field != 1 || st_wire_type != WIRE_BYTES) {
+                    skip_field(&st, st_wire_type);
+                    continue;
+                }
+                PbfBytes s = read_bytes(&st);
+                block->string_table = reserve(block->string_table, &(block->strings_size),
+                    block->n_strings + 1, sizeof(ProtobufCBinaryData));
+                ProtobufCBinaryData *entry = &(block->string_table[block->n_strings++]);
+                entry->len = s.end - s.pos;
+                entry->data = (uint8_t *)s.pos;
+            }
+        } else if (field == 2 && wire_type == WIRE_BYTES) {
+            block->groups = reserve(block->groups, &(block->groups_size),
+                block->n_groups + 1, sizeof(PbfGroup));
+            PbfGroup *group = &(block->groups[block->n_groups++]);
+            group->bytes = read_bytes(&b);
+            scan_group(group);
+        } else if (field == 17 && wire_type == WIRE_VARINT) {
+            block->granularity = read_varint(&b);
+        } else if (field == 19 && wire_type == WIRE_VARINT) {
+            block->lat_offset = read_varint(&b);
+        } else if (field == 20 && wire_type == WIRE_VARINT) {
+            block->lon_offset = read_varint(&b);
+        } else {
+            skip_field(&b, wire_type);
+        }
+    }
+}
+
+/* Check a string table reference before it is handed to a callback or used to look up a string. */
+static inline uint32_t check_string (PbfBlock *block, uint64_t index) {
+    if (index >= block->n_strings)
+        die("string table index out of range in PBF block");
+    return index;
+}
+
+/* Reset the fields shared by nodes, ways and relations, pointing them at the block's scratch arrays. */
+#define CLEAR_ELEMENT(element, block) do {  \
+    memset(&(element), 0, sizeof(element)); \
+    (element).keys = (block)->keys;         \
+    (element).vals = (block)->vals;         \
+} while (0)
+
+/* Decode the keys and vals fields common to nodes, ways and relations. Returns false for other fields. */
+static bool read_tags (PbfBlock *block, PbfBytes *b, uint32_t field, int wire_type,
+                       size_t *n_keys, size_t *n_vals) {
+    if (field == 2)
+        *n_keys = read_uint32s(b, wire_type, &(block->keys), &(block->keys_size), *n_keys);
+    else if (field == 3)
+        *n_vals = read_uint32s(b, wire_type, &(block->vals), &(block->vals_size), *n_vals);
+    else
+        return false;
+    return true;
+}
+
+/* Verify the tags of an element once it is complete, pointing it at the scratch arrays if they moved. */
+#define FINISH_TAGS(element, block) do {                                \
+    if ((element).n_keys != (element).n_vals)                           \
+        die("PBF element has different numbers of keys and values");    \
+    for (size_t t = 0; t < (element).n_keys; ++t) {                     \
+        check_string((block), (block)->keys[t]);                        \
+        check_string((block), (block)->vals[t]);                        \
+    }                                                                   \
+    (element).keys = (block)->keys;                                     \
+    (element).vals = (block)->vals;                                     \
+} while (0)
+
+/* Externally visible function. */
+void pbf_dense_reserve (PbfDenseBuffer *buffer, size_t n_nodes, size_t n_tags) {
+    PbfDenseNodes *batch = &(buffer->batch);
+    if (n_nodes > buffer->nodes_size || batch->tag_offsets == NULL) {
+        size_t size = grown_size(buffer->nodes_size, n_nodes);
+        batch->ids  = resize(batch->ids,  size, sizeof(int64_t));
+        batch->lats = resize(batch->lats, size, sizeof(int64_t));
+        batch->lons = resize(batch->lons, size, sizeof(int64_t));
+        batch->tag_offsets = resize(batch->tag_offsets, size + 1, sizeof(uint32_t));
+        buffer->nodes_size = size;
+    }
+    if (n_tags > buffer->tags_size) {
+        size_t size = grown_size(buffer->tags_size, n_tags);
+        batch->keys = resize(batch->keys, size, sizeof(uint32_t));
+        batch->vals = resize(batch->vals, size, sizeof(uint32_t));
+        buffer->tags_size = size;
+    }
+}
+
+/* Externally visible function. */
+void pbf_dense_free (PbfDenseBuffer *buffer) {
+    PbfDenseNodes *batch = &(buffer->batch);
+    free(batch->ids);
+    free(batch->lats);
+    free(batch->lons);
+    free(batch->tag_offsets);
+    free(batch->keys);
+    free(batch->vals);
+    memset(buffer, 0, sizeof(PbfDenseBuffer));
+}
+
+/* Decode a whole DenseNodes message into arrays, and hand it to the dense_nodes callback in one call. */
+static void decode_dense_batch (PbfBlock *block, PbfBytes ids, PbfBytes lats, PbfBytes lons, PbfBytes kvs,
+                                PbfReadCallbacks *callbacks) {
+    size_t n_nodes = count_varints(ids);
+    pbf_dense_reserve(&(block->dense), n_nodes, count_varints(kvs) / 2);
+    PbfDenseNodes *batch = &(block->dense.batch);
+    int64_t id = 0;
+    int64_t lat = block->lat_offset;
+    int64_t lon = block->lon_offset;
+    uint32_t n_tags = 0;
+    for (size_t n = 0; n < n_nodes; ++n) {
+        id  += unzigzag(read_varint(&ids));
+        lat += unzigzag(read_varint(&lats)) * block->granularity;
+        lon += unzigzag(read_varint(&lons)) * block->granularity;
+        batch->ids[n]  = id;
+        batch->lats[n] = lat;
+        batch->lons[n] = lon;
+        batch->tag_offsets[n] = n_tags;
+        while (kvs.pos < kvs.end) {
+            uint32_t key = check_string(block, read_varint(&kvs));
+            if (block->string_table[key].len == 0)
+                break;
+            batch->keys[n_tags] = key;
+            batch->vals[n_tags] = check_string(block, read_varint(&kvs));
+            n_tags++;
+        }
+    }
+    batch->tag_offsets[n_nodes] = n_tags;
+    batch->n_nodes = n_nodes;
+    if (lats.pos != lats.end || lons.pos != lons.end)
+        die("dense node arrays have different lengths");
+    (*(callbacks->dense_nodes))(batch, block->string_table);
+}
+
+/* Hand the nodes in a DenseNodes message to the node callbacks, walking its packed arrays in step. */
+static void decode_dense (PbfBlock *block, PbfBytes b, PbfReadCallbacks *callbacks) {
+    PbfBytes ids = { NULL, NULL }, lats = { NULL, NULL }, lons = { NULL, NULL }, kvs = { NULL, NULL };
+    uint32_t field;
+    int wire_type;
+    while (next_field(&b, &field, &wire_type)) {
+        if (wire_type != WIRE_BYTES) {
+            skip_field(&b, wire_type);
+            continue;
+        }
+        PbfBytes packed = read_bytes(&b);
+        if (field == 1) ids = packed;
+        else if (field == 8) lats = packed;
+        else if (field == 9) lons = packed;
+        else if (field == 10) kvs = packed;
+    }
+    if (callbacks->dense_nodes != NULL) {
+        decode_dense_batch(block, ids, lats, lons, kvs, callbacks);
+        return;
+    }
+    if (callbacks->node == NULL)
+        return;
+    OSMPBF__Node node;
+    int64_t id = 0;
+    // lat and lon are passed into node callback function in nanodegrees.
+    int64_t lat = block->lat_offset;
+    int64_t lon = block->lon_offset;
+    while (ids.pos < ids.end) {
+        /* Coordinates and IDs are delta coded. */
+        id  += unzigzag(read_varint(&ids));
+        lat += unzigzag(read_varint(&lats)) * block->granularity;
+        lon += unzigzag(read_varint(&lons)) * block->granularity;
+        CLEAR_ELEMENT(node, block);
+        node.id  = id;
+        node.lat = lat;
+        node.lon = lon;
+        /* The key-val list for each node is terminated with a zero-length string. */
+        size_t n_tags = 0;
+        while (kvs.pos < kvs.end) {
+            uint32_t key = check_string(block, read_varint(&kvs));
+            if (block->string_table[key].len == 0)
+                break;
+            uint32_t val = check_string(block, read_varint(&kvs));
+            block->keys = reserve(block->keys, &(block->keys_size), n_tags + 1, sizeof(uint32_t));
+            block->vals = reserve(block->vals, &(block->vals_size), n_tags + 1, sizeof(uint32_t));
+            block->keys[n_tags] = key;
+            block->vals[n_tags] = val;
+            n_tags++;
+        }
+        node.keys = block->keys;
+        node.vals = block->vals;
+        node.n_keys = node.n_vals = n_tags;
+        (*(callbacks->node))(&node, block->string_table);
+    }
+    if (lats.pos != lats.end || lons.pos != lons.end)
+        die("dense node arrays have different lengths");
+}
+
+/* Externally visible function. */
+void pbf_decode_nodes (PbfBlock *block, PbfGroup *group, PbfReadCallbacks *callbacks) {
+    PbfBytes b = group->bytes;
+    uint32_t field;
+    int wire_type;
+    while (next_field(&b, &field, &wire_type)) {
+        if (wire_type != WIRE_BYTES || (field != 1 && field != 2)) {
+            skip_field(&b, wire_type);
+            continue;
+        }
+        PbfBytes element = read_bytes(&b);
+        if (field == 2) {
+            decode_dense(block, element, callbacks);
+            continue;
+        }
+        if (callbacks->node == NULL)
+            continue;
+        OSMPBF__Node node;
+        CLEAR_ELEMENT(node, block);
+        uint32_t node_field;
+        int node_wire_type;
+        while (next_field(&element, &node_field, &node_wire_type)) {
+            if (read_tags(block, &element, node_field, node_wire_type, &(node.n_keys), &(node.n_vals)))
+                continue;
+            if (node_field == 1 && node_wire_type == WIRE_VARINT)
+                node.id = unzigzag(read_varint(&element));
+            else if (node_field == 8 && node_wire_type == WIRE_VARINT)
+                node.lat = unzigzag(read_varint(&element));
+            else if (node_field == 9 && node_wire_type == WIRE_VARINT)
+                node.lon = unzigzag(read_varint(&element));
+            else
+                skip_field(&element, node_wire_type);
+        }
+        FINISH_TAGS(node, block);
+        node.lat = block->lat_offset + (node.lat * block->granularity);
+        node.lon = block->lon_offset + (node.lon * block->granularity);
+        (*(callbacks->node))(&node, block->string_table);
+    }
+}
+
+/* Externally visible function. */
+void pbf_decode_ways (PbfBlock *block, PbfGroup *group, PbfReadCallbacks *callbacks) {
+    PbfBytes b = group->bytes;
+    uint32_t field;
+    int wire_type;
+    while (next_field(&b, &field, &wire_type)) {
+        if (field != 3 || wire_type != WIRE_BYTES) {
+            skip_field(&b, wire_type);
+            continue;
+        }
+        PbfBytes element = read_bytes(&b);
+        OSMPBF__Way way;
+        CLEAR_ELEMENT(way, block);
+        uint32_t way_field;
+        int way_wire_type;
+        while (next_field(&element, &way_field, &way_wire_type)) {
+            if (read_tags(block, &element, way_field, way_wire_type, &(way.n_keys), &(way.n_vals)))
+                continue;
+            if (way_field == 1 && way_wire_type == WIRE_VARINT)
+                way.id = read_varint(&element);
+            else if (way_field == 8)
+                way.n_refs = read_sint64s(&element, way_wire_type, &(block->refs), &(block->refs_size), way.n_refs);
+            else
+                skip_field(&element, way_wire_type);
+        }
+        FINISH_TAGS(way, block);
+        way.refs = block->refs;
+        (*(callbacks->way))(&way, block->string_table);
+    }
+}
+
+/* Externally visible function. */
+void pbf_decode_relations (PbfBlock *block, PbfGroup *group, PbfReadCallbacks *callbacks) {
+    PbfBytes b = group->bytes;
+    uint32_t field;
+    int wire_type;
+    while (next_field(&b, &field, &wire_type)) {
+        if (field != 4 || wire_type != WIRE_BYTES) {
+            skip_field(&b, wire_type);
+            continue;
+        }
+        PbfBytes element = read_bytes(&b);
+        OSMPBF__Relation relation;
+        CLEAR_ELEMENT(relation, block);
+        uint32_t rel_field;
+        int rel_wire_type;
+        while (next_field(&element, &rel_field, &rel_wire_type)) {
+            if (read_tags(block, &element, rel_field, rel_wire_type, &(relation.n_keys), &(relation.n_vals)))
+                continue;
+            if (rel_field == 1 && rel_wire_type == WIRE_VARINT)
+                relation.id = read_varint(&element);
+            else if (rel_field == 8)
+                relation.n_roles_sid = read_int32s(&element, rel_wire_type,
+                    &(block->roles_sid), &(block->roles_size), relation.n_roles_sid);
+            else if (rel_field == 9)
+                relation.n_memids = read_sint64s(&element, rel_wire_type,
+                    &(block->refs), &(block->refs_size), relation.n_memids);
+            else if (rel_field == 10)
+                relation.n_types = read_member_types(&element, rel_wire_type,
+                    &(block->types), &(block->types_size), relation.n_types);
+            else
+                skip_field(&element, rel_wire_type);
+        }
+        FINISH_TAGS(relation, block);
+        if (relation.n_roles_sid != relation.n_memids || relation.n_types != relation.n_memids)
+            die("PBF relation has different numbers of member ids, roles and types");
+        for (size_t m = 0; m < relation.n_roles_sid; ++m)
+            check_string(block, block->roles_sid[m]);
+        relation.roles_sid = block->roles_sid;
+        relation.memids = block->refs;
+        relation.types = block->types;
+        (*(callbacks->relation))(&relation, block->string_table);
+    }
+}
+
+/* Read the id field of a node, way or relation, which is zigzag coded only for nodes. */
+static int64_t element_id (PbfBytes element, bool zigzag) {
+    uint32_t field;
+    int wire_type;
+    while (next_field(&element, &field, &wire_type)) {
+        if (field == 1 && wire_type == WIRE_VARINT) {
+            uint64_t id = read_varint(&element);
+            return zigzag ? unzigzag(id) : (int64_t) id;
+        }
+        skip_field(&element, wire_type);
+    }
+    die("PBF element has no id");
+    return 0;
+}
+
+/* Externally visible function. */
+void pbf_block_id_range (PbfBlock *block, int64_t *min_id, int64_t *max_id) {
+    *min_id = INT64_MAX;
+    *max_id = INT64_MIN;
+    for (size_t g = 0; g < block->n_groups; ++g) {
+        PbfBytes b = block->groups[g].bytes;
+        uint32_t field;
+        int wire_type;
+        while (next_field(&b, &field, &wire_type)) {
+            if (wire_type != WIRE_BYTES || field < 1 || field > 4) {
+                skip_field(&b, wire_type);
+                continue;
+            }
+            PbfBytes element = read_bytes(&b);
+            if (field != 2) {
+                int64_t id = element_id(element, field == 1);
+                if (id < *min_id) *min_id = id;
+                if (id > *max_id) *max_id = id;
+                continue;
+            }
+            /* Dense node IDs are delta coded, so every one of them has to be visited. */
+            uint32_t dense_field;
+            int dense_wire_type;
+            while (next_field(&element, &dense_field, &dense_wire_type)) {
+                if (dense_field != 1 || dense_wire_type != WIRE_BYTES) {
+                    skip_field(&element, dense_wire_type);
+                    continue;
+                }
+                PbfBytes ids = read_bytes(&element);
+                int64_t id = 0;
+                while (ids.pos < ids.end) {
+                    id += unzigzag(read_varint(&ids));
+                    if (id < *min_id) *min_id = id;
+                    if (id > *max_id) *max_id = id;
+                }
+            }
+        }
+    }
+}
+
+/* Externally visible function. */
+void pbf_block_free (PbfBlock *block) {
+    free(block->string_table);
+    free(block->groups);
+    free(block->keys);
+    free(block->vals);
+    free(block->refs);
+    free(block->roles_sid);
+    free(block->types);
+    pbf_dense_free(&(block->dense));
+    memset(block, 0, sizeof(PbfBlock));
+}
@@ -0,0 +1,81 @@
+/* pbf-decode.h : streaming decoder that reads PBF messages in place, without unpacking them */
+#ifndef PBF_DECODE_H_INCLUDED
+#define PBF_DECODE_H_INCLUDED
+
+#include "pbf.h"
+#include <stdint.h>
+#include <stddef.h>
+
+/* A run of serialized protobuf, consumed from the front as fields are decoded. */
+typedef struct {
+    const uint8_t *pos;
+    const uint8_t *end;
+} PbfBytes;
+
+/* One PrimitiveGroup within a block, and which element types it contains (dense counts as nodes). */
+typedef struct {
+    PbfBytes bytes;
+    bool has_nodes;
+    bool has_ways;
+    bool has_relations;
+} PbfGroup;
+
+/* Growable arrays backing a batch for the dense_nodes callback, reused from one group to the next. */
+typedef struct {
+    PbfDenseNodes batch;
+    size_t nodes_size; // capacity of the per-node arrays, not counting the extra tag offset
+    size_t tags_size;
+} PbfDenseBuffer;
+
+/*
+  A PrimitiveBlock viewed in place within its inflated buffer. Decoding the block only locates its
+  groups and string table entries. Elements are decoded one at a time as they are handed to the
+  callbacks, into the scratch arrays below. Everything is owned by the block and grown on demand,
+  then reused for the next block, so in steady state no heap allocation happens at all.
+  The string table and the callback messages borrow from the inflated buffer, which must outlive them.
+*/
+typedef struct {
+    ProtobufCBinaryData *string_table;
+    size_t n_strings, strings_size;
+    PbfGroup *groups;
+    size_t n_groups, groups_size;
+    int32_t granularity;
+    int64_t lat_offset;
+    int64_t lon_offset;
+    /* Scratch arrays for the element currently being handed to a callback. */
+    uint32_t *keys, *vals;
+    size_t keys_size, vals_size;
+    int64_t *refs; // way refs or relation member ids, still delta coded
+    size_t refs_size;
+    int32_t *roles_sid;
+    size_t roles_size;
+    OSMPBF__Relation__MemberType *types;
+    size_t types_size;
+    PbfDenseBuffer dense;
+} PbfBlock;
+
+/* Read the type and payload size from a BlobHeader. */
+void pbf_decode_blob_header (const uint8_t *data, size_t size, PbfBytes *type, int32_t *datasize);
+
+/* Locate the payload of a Blob. Exactly one of raw and zlib_data will be non-empty. */
+void pbf_decode_blob (const uint8_t *data, size_t size, PbfBytes *raw, PbfBytes *zlib_data, int32_t *raw_size);
+
+/* Locate the string table and groups of a PrimitiveBlock, without decoding any elements. */
+void pbf_decode_block (PbfBlock *block, const uint8_t *data, size_t size);
+
+/* Decode the elements of one group, handing each one to the corresponding callback. */
+void pbf_decode_nodes     (PbfBlock *block, PbfGroup *group, PbfReadCallbacks *callbacks);
+void pbf_decode_ways      (PbfBlock *block, PbfGroup *group, PbfReadCallbacks *callbacks);
+void pbf_decode_relations (PbfBlock *block, PbfGroup *group, PbfReadCallbacks *callbacks);
+
+/* Find the lowest and highest element IDs in a block, or INT64_MAX and INT64_MIN if it is empty. */
+void pbf_block_id_range (PbfBlock *block, int64_t *min_id, int64_t *max_id);
+
+/* Release the arrays owned by a block. */
+void pbf_block_free (PbfBlock *block);
+
+/* Make room for a batch of dense nodes with the given total number of tags, then release it when done. */
+void pbf_dense_reserve (PbfDenseBuffer *buffer, size_t n_nodes, size_t n_tags);
+void pbf_dense_free (PbfDenseBuffer *buffer);
+
+#endif /* PBF_DECODE_H_INCLUDED */
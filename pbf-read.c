@@ -1,5 +1,6 @@
 /* pbf.c */
 #include "pbf.h"
+#include "pbf-decode.h"
 #include "fileformat.pb-c.h"
 #include "osmformat.pb-c.h"
 #include <fcntl.h>
@@ -12,6 +13,9 @@
 #include <limits.h>
 #include <arpa/inet.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 #include "zlib.h"
 
 // sudo apt-get install protobuf-c-compiler libprotobuf-c0-dev zlib1g-dev
@@ -35,6 +39,7 @@ static int phase;
 
 static void *map;
 static size_t map_size;
+static time_t map_mtime; // used to tell whether a blob index still matches its PBF file
 
 static void pbf_map(const char *filename) {
     int fd = open(filename, O_RDONLY);
@@ -45,6 +50,7 @@ static void pbf_map(const char *filename) {
         die("could not stat input file");
     map = mmap((void*)0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
     map_size = st.st_size;
+    map_mtime = st.st_mtime;
     if (map == (void*)(-1))
         die("could not map input file");
 }
@@ -56,52 +62,404 @@ static void pbf_unmap() {
 // "The uncompressed length of a Blob *should* be less than 16 MiB (16*1024*1024 bytes)
 // and *must* be less than 32 MiB."
 #define MAX_BLOB_SIZE_UNCOMPRESSED 32 * 1024 * 1024
-static unsigned char zbuf[MAX_BLOB_SIZE_UNCOMPRESSED];
 
-// ZLIB has utility (un)compress functions that work on buffers.
-static int zinflate(ProtobufCBinaryData *in, unsigned char *out) {
-    int ret;
+/* Number of threads inflating and unpacking blobs. Set with pbf_read_set_threads. */
+static int n_threads = 1;
 
-    /* initialize inflate state */
+/* Which decoder turns blobs into elements. Set with pbf_read_set_decoder. */
+static int decoder = PBF_DECODER_PROTOBUF;
+
+/*
+  One blob in flight through the read pipeline. The scanner thread locates the blob in the mapped
+  file, a worker thread inflates and unpacks it, and the thread that called pbf_read hands it to
+  the callbacks. Slots are reused round-robin, so blobs are always consumed in file order.
+  Each slot owns its inflate buffer, which is grown on demand and kept between blobs.
+*/
+#define SLOT_EMPTY   0
+#define SLOT_SCANNED 1
+#define SLOT_DECODED 2
+typedef struct {
+    int state;
+    bool is_header;             // blob type is OSMHeader
+    bool is_data;               // blob type is OSMData, anything else is skipped
+    uint8_t *data;              // serialized Blob message within the mapped file
+    size_t size;
+    uint8_t *zbuf;              // inflated payload
+    size_t zbuf_size;
+    OSMPBF__HeaderBlock *header;
+    OSMPBF__PrimitiveBlock *block;
+    PbfBlock stream;            // block viewed in place by the streaming decoder, reused between blobs
+    PbfDenseBuffer dense;       // dense node batches from protobuf-c blocks, reused between blobs
+    bool ways_pending;          // decoded, but waiting to run way callbacks on the decoder thread
+    bool callbacks_done;        // node or way callbacks were already run on the decoder thread
+    size_t offset;              // position of the blob's length prefix within the file
+    size_t total_size;          // bytes from the length prefix to the end of the blob
+    int element_type;           // for the blob index, see BlobIndexEntry
+    int64_t min_id, max_id;
+} BlobSlot;
+
+/*
+  One entry per blob in the sidecar index file. Consumers that only want some element types can
+  seek straight to the blobs containing them, instead of inflating every blob to find out.
+  element_type is one of the PHASE constants, or -1 for the header and any blocks mixing types.
+*/
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+    int32_t element_type;
+    int64_t min_id;
+    int64_t max_id;
+} BlobIndexEntry;
+
+/* The index file begins with this header, which ties it to one version of its PBF file. */
+#define INDEX_MAGIC "PBFIDX01"
+typedef struct {
+    char magic[8];
+    uint64_t pbf_size;
+    int64_t pbf_mtime;
+    uint64_t n_entries;
+} BlobIndexHeader;
+
+static bool use_index = false;      // build and save an index during pbf_read if none is present
+static bool index_building = false; // record an index entry for every blob read
+static bool full_scan = false;      // never stop early, even if no callbacks remain
+static BlobIndexEntry *blob_index;
+static size_t n_index_entries, index_size;
+
+/* Pipeline state, all protected by slot_mutex. A single condition variable signals any change. */
+static pthread_mutex_t slot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  slot_cond  = PTHREAD_COND_INITIALIZER;
+static BlobSlot *slots;
+static int  n_slots;
+static long n_scanned;   // number of blobs located by the scanner so far
+static long next_decode; // sequence number of the next blob to be claimed by a worker
+static bool scan_done;   // the scanner has reached the end of the file
+static bool stop;        // the consumer has asked the pipeline to shut down early
+static bool nodes_complete; // the consumer has seen every node block, so ways may be handled
+static PbfReadCallbacks *read_callbacks;
+static size_t scan_begin, scan_end; // range of the file being read, on blob boundaries
+static int  sample_every = 1;  // the scanner passes on only one in this many data blobs
+static bool draining;        // decoder threads must not start callbacks, so a checkpoint can be taken
+static int  callbacks_running; // number of decoder threads currently inside callbacks
+
+/* Seconds between checkpoints, for callers that provide a checkpoint callback. */
+static int checkpoint_interval = 600;
+
+/* Per-stage timings and byte counts, for reporting where the load is bound. */
+static double scan_seconds, inflate_seconds, unpack_seconds, callback_seconds, wait_seconds;
+static double node_seconds, way_seconds; // time spent in callbacks on decoder threads
+static size_t compressed_bytes, inflated_bytes;
+
+static double now () {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Inflate into the given buffer, reusing a z_stream owned by the calling worker. */
+static size_t zinflate(z_stream *strm, ProtobufCBinaryData *in, unsigned char *out, size_t out_size) {
+    if (inflateReset(strm) != Z_OK)
+        die("zlib reset failed");
+    /* ProtobufCBinaryData is {size_t len; uint8_t *data} */
+    strm->avail_in = in->len;
+    strm->next_in = in->data;
+    strm->avail_out = out_size;
+    strm->next_out = out;
+    int ret = inflate(strm, Z_FINISH);
+    if (ret != Z_STREAM_END)
+        die("zlib inflate failed");
+    return out_size - strm->avail_out;
+}
+
+static int  block_element_type(BlobSlot *slot);
+static void block_id_range(OSMPBF__PrimitiveBlock *block, int64_t *min_id, int64_t *max_id);
+static void handle_block(BlobSlot *slot, int element_type, PbfReadCallbacks *callbacks);
+
+/* 
+  Called by a decoder thread before it runs callbacks. Returns false if a checkpoint is being taken,
+  in which case the consumer will run the callbacks for this blob itself.
+*/
+static bool begin_worker_callbacks () {
+    pthread_mutex_lock(&slot_mutex);
+    bool allowed = !draining;
+    if (allowed)
+        callbacks_running++;
+    pthread_mutex_unlock(&slot_mutex);
+    return allowed;
+}
+
+static void end_worker_callbacks () {
+    pthread_mutex_lock(&slot_mutex);
+    callbacks_running--;
+    pthread_cond_broadcast(&slot_cond);
+    pthread_mutex_unlock(&slot_mutex);
+}
+
+/* 
+  Inflate and unpack the blob in one slot. Called on worker threads without holding the lock.
+  If the callbacks allow it, blocks containing only nodes are also handed to the node callback here,
+  and blocks containing only ways are flagged to be handed to the way callback once all nodes are in.
+*/
+static void decode_blob (BlobSlot *slot, z_stream *strm) {
+    /* Blobs of unrecognized types are passed along undecoded so the consumer can skip them. */
+    if (!slot->is_header && !slot->is_data)
+        return;
+    /* The streaming decoder does not use anything in the header block, so it is not even inflated. */
+    if (slot->is_header && decoder == PBF_DECODER_STREAM)
+        return;
+    double t0 = now();
+    OSMPBF__Blob *blob = NULL;
+    ProtobufCBinaryData raw = { 0, NULL };
+    ProtobufCBinaryData zlib_data = { 0, NULL };
+    int32_t raw_size = 0;
+    if (decoder == PBF_DECODER_STREAM) {
+        PbfBytes raw_bytes, zlib_bytes;
+        pbf_decode_blob(slot->data, slot->size, &raw_bytes, &zlib_bytes, &raw_size);
+        raw.data = (uint8_t *)raw_bytes.pos;
+        raw.len = raw_bytes.end - raw_bytes.pos;
+        zlib_data.data = (uint8_t *)zlib_bytes.pos;
+        zlib_data.len = zlib_bytes.end - zlib_bytes.pos;
+    } else {
+        blob = osmpbf__blob__unpack(NULL, slot->size, slot->data);
+        if (blob == NULL)
+            die("error unpacking blob data");
+        if (blob->has_raw)
+            raw = blob->raw;
+        if (blob->has_zlib_data)
+            zlib_data = blob->zlib_data;
+        raw_size = blob->raw_size;
+    }
+    /* check if the blob is raw or compressed */
+    uint8_t* bdata;
+    size_t bsize;
+    if (zlib_data.data != NULL) {
+        bsize = raw_size;
+        if (bsize > MAX_BLOB_SIZE_UNCOMPRESSED)
+            die("blob is larger than allowed by the PBF specification");
+        if (bsize > slot->zbuf_size) {
+            free(slot->zbuf);
+            slot->zbuf = malloc(bsize);
+            if (slot->zbuf == NULL)
+                die("could not allocate inflate buffer");
+            slot->zbuf_size = bsize;
+        }
+        bdata = slot->zbuf;
+        size_t inflated_size = zinflate(strm, &zlib_data, bdata, bsize);
+        if (inflated_size != bsize)
+            die("inflated blob size does not match expected size");
+    } else if (raw.data != NULL) {
+        bdata = raw.data;
+        bsize = raw.len;
+    } else
+        die("neither compressed nor raw data present in blob");
+    double t1 = now();
+    if (slot->is_header) {
+        slot->header = osmpbf__header_block__unpack(NULL, bsize, bdata);
+        if (slot->header == NULL)
+            die("failed to read OSM header message from header blob");
+    } else if (decoder == PBF_DECODER_STREAM) {
+        /* Raw blocks are viewed in place in the mapped file, compressed ones in the inflate buffer. */
+        pbf_decode_block(&(slot->stream), bdata, bsize);
+    } else {
+        slot->block = osmpbf__primitive_block__unpack(NULL, bsize, bdata);
+        if (slot->block == NULL)
+            die("error unpacking primitive block");
+    }
+    if (blob != NULL)
+        osmpbf__blob__free_unpacked(blob, NULL);
+    /* Classifying the block and finding its ID range for the index count as unpacking. */
+    int element_type = slot->is_header ? -1 : block_element_type(slot);
+    if (index_building) {
+        slot->element_type = element_type;
+        if (slot->is_data && decoder == PBF_DECODER_STREAM)
+            pbf_block_id_range(&(slot->stream), &(slot->min_id), &(slot->max_id));
+        else if (slot->is_data)
+            block_id_range(slot->block, &(slot->min_id), &(slot->max_id));
+    }
+    double t2 = now();
+    double t3 = t2;
+    if (element_type == PHASE_NODE && read_callbacks->concurrent_nodes &&
+        (read_callbacks->node != NULL || read_callbacks->dense_nodes != NULL) &&
+        begin_worker_callbacks()) {
+        handle_block(slot, PHASE_NODE, read_callbacks);
+        slot->callbacks_done = true;
+        end_worker_callbacks();
+        t3 = now();
+    }
+    if (element_type == PHASE_WAY && read_callbacks->concurrent_ways && read_callbacks->way != NULL)
+        slot->ways_pending = true;
+    pthread_mutex_lock(&slot_mutex);
+    inflate_seconds += t1 - t0;
+    unpack_seconds += t2 - t1;
+    node_seconds += t3 - t2;
+    inflated_bytes += bsize;
+    pthread_mutex_unlock(&slot_mutex);
+}
+
+/* Read the type and payload size from the blob header at the given position. */
+static void read_blob_header (uint8_t *buf, int32_t msg_length,
+                              bool *is_header, bool *is_data, int32_t *datasize) {
+    if (decoder == PBF_DECODER_STREAM) {
+        PbfBytes type;
+        pbf_decode_blob_header(buf, msg_length, &type, datasize);
+        size_t len = type.end - type.pos;
+        *is_header = (len == strlen("OSMHeader") && memcmp(type.pos, "OSMHeader", len) == 0);
+        *is_data = (len == strlen("OSMData") && memcmp(type.pos, "OSMData", len) == 0);
+        return;
+    }
+    OSMPBF__BlobHeader *blobh = osmpbf__blob_header__unpack(NULL, msg_length, buf);
+    if (blobh == NULL)
+        die("error unpacking blob header");
+    *is_header = (strcmp(blobh->type, "OSMHeader") == 0);
+    *is_data = (strcmp(blobh->type, "OSMData") == 0);
+    *datasize = blobh->datasize;
+    osmpbf__blob_header__free_unpacked(blobh, NULL);
+}
+
+/* Walk the mapped file, recording where each blob begins. Runs on its own thread. */
+static void *scan_blobs (void *arg) {
+    double t0 = now();
+    uint8_t *buf = (uint8_t *)map + scan_begin;
+    long seq = 0, data_blobs = 0;
+    while (buf < (uint8_t *)map + scan_end) {
+        uint8_t *blob_start = buf;
+        // header prefixed with 4-byte contain network (big-endian) order message length
+        int32_t msg_length = ntohl(*((int32_t*)buf));
+        buf += sizeof(int32_t);
+        bool is_header, is_data;
+        int32_t datasize;
+        read_blob_header(buf, msg_length, &is_header, &is_data, &datasize);
+        buf += msg_length;
+        /* When sampling, only every nth data blob is passed on, without being decompressed. */
+        if (is_data && data_blobs++ % sample_every != 0) {
+            buf += datasize;
+            continue;
+        }
+        BlobSlot *slot = &(slots[seq % n_slots]);
+        pthread_mutex_lock(&slot_mutex);
+        while (slot->state != SLOT_EMPTY && !stop)
+            pthread_cond_wait(&slot_cond, &slot_mutex);
+        if (stop) {
+            pthread_mutex_unlock(&slot_mutex);
+            break;
+        }
+        slot->is_header = is_header;
+        slot->is_data = is_data;
+        slot->data = buf;
+        slot->size = datasize;
+        slot->offset = blob_start - (uint8_t *)map;
+        slot->total_size = buf + datasize - blob_start;
+        slot->element_type = -1;
+        slot->min_id = slot->max_id = 0;
+        slot->header = NULL;
+        slot->block = NULL;
+        slot->ways_pending = false;
+        slot->callbacks_done = false;
+        slot->state = SLOT_SCANNED;
+        n_scanned = ++seq;
+        compressed_bytes += datasize;
+        pthread_cond_broadcast(&slot_cond);
+        pthread_mutex_unlock(&slot_mutex);
+        buf += datasize;
+    }
+    pthread_mutex_lock(&slot_mutex);
+    scan_done = true;
+    scan_seconds = now() - t0;
+    pthread_cond_broadcast(&slot_cond);
+    pthread_mutex_unlock(&slot_mutex);
+    return NULL;
+}
+
+/* Claim scanned blobs in sequence and decode them until the file is exhausted. */
+static void *decode_blobs (void *arg) {
     z_stream strm;
     strm.zalloc = Z_NULL;
     strm.zfree = Z_NULL;
     strm.opaque = Z_NULL;
     strm.avail_in = 0;
     strm.next_in = Z_NULL;
-    ret = inflateInit(&strm);
-    if (ret != Z_OK)
+    if (inflateInit(&strm) != Z_OK)
         die("zlib init failed");
-
-    /* ProtobufCBinaryData is {size_t len; uint8_t *data} */
-    strm.avail_in = in->len;
-    strm.next_in = in->data;
-    strm.avail_out = MAX_BLOB_SIZE_UNCOMPRESSED;
-    strm.next_out = out;
-
-    ret = inflate(&strm, Z_NO_FLUSH);
-    // check ret
+    pthread_mutex_lock(&slot_mutex);
+    for (;;) {
+        if (stop || (scan_done && next_decode >= n_scanned))
+            break;
+        if (next_decode >= n_scanned) {
+            pthread_cond_wait(&slot_cond, &slot_mutex);
+            continue;
+        }
+        BlobSlot *slot = &(slots[next_decode++ % n_slots]);
+        pthread_mutex_unlock(&slot_mutex);
+        decode_blob(slot, &strm);
+        pthread_mutex_lock(&slot_mutex);
+        slot->state = SLOT_DECODED;
+        pthread_cond_broadcast(&slot_cond);
+        if (slot->ways_pending) {
+            /* Ways refer to nodes, so wait until the consumer has passed every node block. */
+            while (!nodes_complete && !stop)
+                pthread_cond_wait(&slot_cond, &slot_mutex);
+            if (!stop && !draining) {
+                callbacks_running++;
+                pthread_mutex_unlock(&slot_mutex);
+                double t0 = now();
+                handle_block(slot, PHASE_WAY, read_callbacks);
+                double t1 = now();
+                pthread_mutex_lock(&slot_mutex);
+                way_seconds += t1 - t0;
+                slot->callbacks_done = true;
+                callbacks_running--;
+            }
+            slot->ways_pending = false;
+            pthread_cond_broadcast(&slot_cond);
+        }
+    }
+    pthread_mutex_unlock(&slot_mutex);
     (void)inflateEnd(&strm);
-    return MAX_BLOB_SIZE_UNCOMPRESSED - strm.avail_out;
+    return NULL;
+}
 
+/* Megabytes per second, or zero for a stage too quick to time or never used. */
+static double rate (double bytes, double seconds) {
+    return seconds > 0 ? bytes / (1024 * 1024) / seconds : 0;
+}
+
+/* Print the time spent in each pipeline stage, so we can see which one bounds the load. */
+static void report_throughput (double elapsed) {
+    double mb = 1024 * 1024;
+    fprintf(stderr, "PBF read %.1fMB compressed, %.1fMB inflated in %.1fs using %d %s decoder threads.\n",
+        compressed_bytes / mb, inflated_bytes / mb, elapsed, n_threads,
+        decoder == PBF_DECODER_STREAM ? "streaming" : "protobuf-c");
+    fprintf(stderr, "  scan     %6.1fs %8.1fMB/s\n", scan_seconds, rate (compressed_bytes, scan_seconds));
+    fprintf(stderr, "  inflate  %6.1fs %8.1fMB/s per thread\n", inflate_seconds, rate (inflated_bytes, inflate_seconds));
+    fprintf(stderr, "  unpack   %6.1fs %8.1fMB/s per thread\n", unpack_seconds, rate (inflated_bytes, unpack_seconds));
+    if (node_seconds > 0)
+        fprintf(stderr, "  nodes    %6.1fs in node callbacks on decoder threads\n", node_seconds);
+    if (way_seconds > 0)
+        fprintf(stderr, "  ways     %6.1fs in way callbacks on decoder threads\n", way_seconds);
+    fprintf(stderr, "  callback %6.1fs, %.1fs waiting for decoded blocks\n", callback_seconds, wait_seconds);
+    if (wait_seconds > callback_seconds)
+        fprintf(stderr, "  bound by decoding, more threads may help.\n");
+    else
+        fprintf(stderr, "  bound by callbacks, more decoder threads will not help.\n");
 }
 
 /* 
   Enforce (node, way, relation) ordering, and bail out early when possible. 
   Returns true if loading should terminate due to incorrect ordering or just to save time.
 */
-static bool enforce_ordering (OSMPBF__PrimitiveGroup *group, PbfReadCallbacks *callbacks) {
+static bool enforce_ordering (bool has_nodes, bool has_ways, bool has_relations,
+                              PbfReadCallbacks *callbacks) {
     int n_element_types = 0;
     int element_type = -1;
-    if (group->dense || group->n_nodes > 0) {
+    if (has_nodes) {
         n_element_types += 1;
         element_type = PHASE_NODE;
     }
-    if (group->n_ways > 0) {
+    if (has_ways) {
         n_element_types += 1;
         element_type = PHASE_WAY;
     }
-    if (group->n_relations > 0) {
+    if (has_relations) {
         n_element_types += 1;
         element_type = PHASE_RELATION;
     }
@@ -115,8 +473,11 @@ static bool enforce_ordering (OSMPBF__PrimitiveGroup *group, PbfReadCallbacks *c
     }
     if (element_type > phase) {
         phase = element_type;
+        if (full_scan)
+            return false;
         if (phase == PHASE_NODE && 
-            callbacks->node == NULL && callbacks->way == NULL && callbacks->relation == NULL) {
+            callbacks->node == NULL && callbacks->dense_nodes == NULL &&
+            callbacks->way == NULL && callbacks->relation == NULL) {
             fprintf (stderr, "Skipping the rest of the PBF file, no callbacks were defined.\n");
             return true;
         } 
@@ -135,170 +496,621 @@ static bool enforce_ordering (OSMPBF__PrimitiveGroup *group, PbfReadCallbacks *c
 
 /* Tags are stored in a string table at the PrimitiveBlock level. */
 #define MAX_TAGS 256
-static bool handle_primitive_block(OSMPBF__PrimitiveBlock *block, PbfReadCallbacks *callbacks) {
+
+/* Delta-decode a whole DenseNodes group into the given buffer, and pass it to the dense_nodes callback. */
+static void handle_dense_batch(OSMPBF__DenseNodes *dense, ProtobufCBinaryData *string_table,
+                               int32_t granularity, int64_t lat_offset, int64_t lon_offset,
+                               PbfDenseBuffer *buffer, PbfReadCallbacks *callbacks) {
+    pbf_dense_reserve(buffer, dense->n_id, dense->n_keys_vals / 2);
+    PbfDenseNodes *batch = &(buffer->batch);
+    int64_t id  = 0;
+    int64_t lat = lat_offset;
+    int64_t lon = lon_offset;
+    for (int n = 0; n < dense->n_id; ++n) {
+        id  += dense->id[n];
+        lat += dense->lat[n] * granularity;
+        lon += dense->lon[n] * granularity;
+        batch->ids[n]  = id;
+        batch->lats[n] = lat;
+        batch->lons[n] = lon;
+    }
+    /* The key-val list for each node is terminated with a zero-length string. */
+    uint32_t n_tags = 0;
+    int kv = 0;
+    for (int n = 0; n < dense->n_id; ++n) {
+        batch->tag_offsets[n] = n_tags;
+        while (kv < dense->n_keys_vals && string_table[dense->keys_vals[kv]].len > 0) {
+            batch->keys[n_tags] = dense->keys_vals[kv++];
+            batch->vals[n_tags] = dense->keys_vals[kv++];
+            n_tags++;
+        }
+        kv++;
+    }
+    batch->tag_offsets[dense->n_id] = n_tags;
+    batch->n_nodes = dense->n_id;
+    (*(callbacks->dense_nodes))(batch, string_table);
+}
+
+/* 
+  Pass all the plain and dense nodes in one group to the node callbacks. Dense nodes are batched
+  in the given buffer if there is a dense_nodes callback.
+*/
+static void handle_node_group(OSMPBF__PrimitiveBlock *block, OSMPBF__PrimitiveGroup *group,
+                              PbfDenseBuffer *dense_buffer, PbfReadCallbacks *callbacks) {
     ProtobufCBinaryData *string_table = block->stringtable->s;
     int32_t granularity = block->has_granularity ? block->granularity : 100;
     int64_t lat_offset = block->has_lat_offset ? block->lat_offset : 0;
     int64_t lon_offset = block->has_lon_offset ? block->lon_offset : 0;
     // fprintf(stderr, "pblock with granularity %d and offsets %d, %d\n", granularity, lat_offset, lon_offset);
-    // It seems like a block often contains only one group.
+    for (int n = 0; n < group->n_nodes && callbacks->node; ++n) {
+        OSMPBF__Node *node = group->nodes[n];
+        node->lat = lat_offset + (node->lat * granularity);
+        node->lon = lon_offset + (node->lon * granularity);
+        (*(callbacks->node))(node, string_table);
+    }
+    if (group->dense && callbacks->dense_nodes) {
+        handle_dense_batch(group->dense, string_table, granularity, lat_offset, lon_offset,
+                           dense_buffer, callbacks);
+    } else if (group->dense && callbacks->node) {
+        OSMPBF__DenseNodes *dense = group->dense;
+        OSMPBF__Node node; // struct reused to carry the data from each dense node
+        uint32_t keys[MAX_TAGS]; // keys and vals reused for string table references
+        uint32_t vals[MAX_TAGS];
+        node.keys = keys;
+        node.vals = vals;
+        node.n_keys = 0;
+        node.n_vals = 0;
+        int kv0 = 0; // index into source keys_values array (concatenated, 0-len separated)
+        int64_t id  = 0;
+        // lat and lon are passed into node callback function in nanodegrees.
+        // offsets are also in nanodegrees.
+        int64_t lat = lat_offset;
+        int64_t lon = lon_offset;
+        for (int n = 0; n < dense->n_id; ++n) {
+            // Coordinates and IDs are delta coded
+            id  += dense->id[n];
+            lat += dense->lat[n] * granularity;
+            lon += dense->lon[n] * granularity;
+            node.id  = id;
+            node.lat = lat;
+            node.lon = lon;
+            // Copy tag string indexes over from concatenated alternating array
+            int kv1 = 0; // index into target keys and values array
+            // some blocks have no tags at all, check that the array pointer is not null
+            if (dense->keys_vals != NULL) {
+                // key-val list for each node is terminated with a zero-length string
+                while (string_table[dense->keys_vals[kv0]].len > 0) {
+                    if (kv1 < MAX_TAGS) { // target buffers are reused and fixed-length
+                        keys[kv1] = dense->keys_vals[kv0++];
+                        vals[kv1] = dense->keys_vals[kv0++];
+                        kv1++;
+                    } else {
+                        kv0 += 2; // skip both key and value
+                        fprintf (stderr, "skipping tags after number %d.\n", MAX_TAGS);
+                    }
+                }
+            }
+            node.n_keys = kv1;
+            node.n_vals = kv1;
+            kv0++; // skip zero length string indicating end of k-v pairs for this node
+            (*(callbacks->node))(&node, string_table);
+        }
+    }
+}
+
+/* Pass all the ways in one group to the way callback. */
+static void handle_way_group(OSMPBF__PrimitiveBlock *block, OSMPBF__PrimitiveGroup *group,
+                             PbfReadCallbacks *callbacks) {
+    ProtobufCBinaryData *string_table = block->stringtable->s;
+    for (int w = 0; w < group->n_ways; ++w) {
+        OSMPBF__Way *way = group->ways[w];
+        (*(callbacks->way))(way, string_table);
+    }
+}
+
+/* Pass all the relations in one group to the relation callback. */
+static void handle_relation_group(OSMPBF__PrimitiveBlock *block, OSMPBF__PrimitiveGroup *group,
+                                  PbfReadCallbacks *callbacks) {
+    ProtobufCBinaryData *string_table = block->stringtable->s;
+    for (int r = 0; r < group->n_relations; ++r) {
+        OSMPBF__Relation *relation = group->relations[r];
+        (*(callbacks->relation))(relation, string_table);
+    }
+}
+
+/* The number of groups in the block held by a slot, whichever decoder produced it. */
+static size_t slot_n_groups(BlobSlot *slot) {
+    return decoder == PBF_DECODER_STREAM ? slot->stream.n_groups : slot->block->n_primitivegroup;
+}
+
+/* Find out which element types one group of the slot's block contains. */
+static void group_contents(BlobSlot *slot, size_t g, bool *has_nodes, bool *has_ways, bool *has_relations) {
+    if (decoder == PBF_DECODER_STREAM) {
+        PbfGroup *group = &(slot->stream.groups[g]);
+        *has_nodes = group->has_nodes;
+        *has_ways = group->has_ways;
+        *has_relations = group->has_relations;
+    } else {
+        OSMPBF__PrimitiveGroup *group = slot->block->primitivegroup[g];
+        *has_nodes = group->dense || group->n_nodes > 0;
+        *has_ways = group->n_ways > 0;
+        *has_relations = group->n_relations > 0;
+    }
+}
+
+/* Pass the elements of the given type in one group of the slot's block to their callback. */
+static void handle_group(BlobSlot *slot, size_t g, int element_type, PbfReadCallbacks *callbacks) {
+    if (decoder == PBF_DECODER_STREAM) {
+        PbfGroup *group = &(slot->stream.groups[g]);
+        if (element_type == PHASE_NODE)
+            pbf_decode_nodes(&(slot->stream), group, callbacks);
+        else if (element_type == PHASE_WAY)
+            pbf_decode_ways(&(slot->stream), group, callbacks);
+        else
+            pbf_decode_relations(&(slot->stream), group, callbacks);
+    } else {
+        OSMPBF__PrimitiveGroup *group = slot->block->primitivegroup[g];
+        if (element_type == PHASE_NODE)
+            handle_node_group(slot->block, group, &(slot->dense), callbacks);
+        else if (element_type == PHASE_WAY)
+            handle_way_group(slot->block, group, callbacks);
+        else
+            handle_relation_group(slot->block, group, callbacks);
+    }
+}
+
+/* Hand the string table of the slot's block to the callback, before handling any of its elements. */
+static void begin_block(BlobSlot *slot, PbfReadCallbacks *callbacks) {
+    if (callbacks->block_strings == NULL)
+        return;
+    if (decoder == PBF_DECODER_STREAM)
+        (*(callbacks->block_strings))(slot->stream.string_table, slot->stream.n_strings);
+    else
+        (*(callbacks->block_strings))(slot->block->stringtable->s, slot->block->stringtable->n_s);
+}
+
+/* Tell the callbacks that all the elements of a block have been handed to them. */
+static void end_block(PbfReadCallbacks *callbacks) {
+    if (callbacks->block_done != NULL)
+        (*(callbacks->block_done))();
+}
+
+/* Pass the elements of the given type in every group of the slot's block to their callback. */
+static void handle_block(BlobSlot *slot, int element_type, PbfReadCallbacks *callbacks) {
+    begin_block(slot, callbacks);
+    for (size_t g = 0; g < slot_n_groups(slot); ++g)
+        handle_group(slot, g, element_type, callbacks);
+    end_block(callbacks);
+}
+
+/* Find the lowest and highest element IDs in a protobuf-c block. Dense node IDs are delta coded. */
+static void block_id_range(OSMPBF__PrimitiveBlock *block, int64_t *min_id, int64_t *max_id) {
+    int64_t min = INT64_MAX;
+    int64_t max = INT64_MIN;
     for (int g = 0; g < block->n_primitivegroup; ++g) {
         OSMPBF__PrimitiveGroup *group = block->primitivegroup[g];
-        if (enforce_ordering (group, callbacks)) {
+        for (int n = 0; n < group->n_nodes; ++n) {
+            if (group->nodes[n]->id < min) min = group->nodes[n]->id;
+            if (group->nodes[n]->id > max) max = group->nodes[n]->id;
+        }
+        int64_t id = 0;
+        for (int n = 0; group->dense != NULL && n < group->dense->n_id; ++n) {
+            id += group->dense->id[n];
+            if (id < min) min = id;
+            if (id > max) max = id;
+        }
+        for (int w = 0; w < group->n_ways; ++w) {
+            if (group->ways[w]->id < min) min = group->ways[w]->id;
+            if (group->ways[w]->id > max) max = group->ways[w]->id;
+        }
+        for (int r = 0; r < group->n_relations; ++r) {
+            if (group->relations[r]->id < min) min = group->relations[r]->id;
+            if (group->relations[r]->id > max) max = group->relations[r]->id;
+        }
+    }
+    *min_id = min;
+    *max_id = max;
+}
+
+/* 
+  Return the single element type (PHASE_NODE, PHASE_WAY or PHASE_RELATION) found in all the groups
+  of the slot's block, or -1 if the block is empty or mixes element types.
+*/
+static int block_element_type(BlobSlot *slot) {
+    int element_type = -1;
+    for (size_t g = 0; g < slot_n_groups(slot); ++g) {
+        bool has_nodes, has_ways, has_relations;
+        group_contents(slot, g, &has_nodes, &has_ways, &has_relations);
+        int group_type;
+        if (has_nodes && !has_ways && !has_relations)
+            group_type = PHASE_NODE;
+        else if (!has_nodes && has_ways && !has_relations)
+            group_type = PHASE_WAY;
+        else if (!has_nodes && !has_ways && has_relations)
+            group_type = PHASE_RELATION;
+        else
+            return -1;
+        if (element_type != -1 && element_type != group_type)
+            return -1;
+        element_type = group_type;
+    }
+    return element_type;
+}
+
+/* 
+  Hand all the elements in the slot's block to the callbacks. If the nodes or ways in this block were
+  already handled on a decoder thread, only the ordering checks are performed.
+*/
+static bool handle_primitive_block(BlobSlot *slot, PbfReadCallbacks *callbacks) {
+    begin_block(slot, callbacks);
+    // It seems like a block often contains only one group.
+    for (size_t g = 0; g < slot_n_groups(slot); ++g) {
+        bool has_nodes, has_ways, has_relations;
+        group_contents(slot, g, &has_nodes, &has_ways, &has_relations);
+        if (enforce_ordering (has_nodes, has_ways, has_relations, callbacks)) {
+            end_block(callbacks);
             return true; // signal early exit due to improper ordering or callbacks were exhausted
         }
-        // fprintf(stderr, "pgroup with %d nodes, %d dense nodes, %d ways, %d relations\n",  group->n_nodes,
-        //     group->dense ? group->dense->n_id : 0, group->n_ways, group->n_relations);
-        if (callbacks->way) {
-            for (int w = 0; w < group->n_ways; ++w) {
-                OSMPBF__Way *way = group->ways[w];
-                (*(callbacks->way))(way, string_table);
-            }
+        if (callbacks->way && has_ways && !slot->callbacks_done) {
+            handle_group(slot, g, PHASE_WAY, callbacks);
         }
-        if (callbacks->node) {
-            for (int n = 0; n < group->n_nodes; ++n) {
-                OSMPBF__Node *node = group->nodes[n];
-                node->lat = lat_offset + (node->lat * granularity);
-                node->lon = lon_offset + (node->lon * granularity);
-                (*(callbacks->node))(node, string_table);
-            }
-            if (group->dense) {
-                OSMPBF__DenseNodes *dense = group->dense;
-                OSMPBF__Node node; // struct reused to carry the data from each dense node
-                uint32_t keys[MAX_TAGS]; // keys and vals reused for string table references
-                uint32_t vals[MAX_TAGS];
-                node.keys = keys;
-                node.vals = vals;
-                node.n_keys = 0;
-                node.n_vals = 0;
-                int kv0 = 0; // index into source keys_values array (concatenated, 0-len separated)
-                int64_t id  = 0;
-                // lat and lon are passed into node callback function in nanodegrees.
-                // offsets are also in nanodegrees.
-                int64_t lat = lat_offset;
-                int64_t lon = lon_offset;
-                for (int n = 0; n < dense->n_id; ++n) {
-                    // Coordinates and IDs are delta coded
-                    id  += dense->id[n];
-                    lat += dense->lat[n] * granularity;
-                    lon += dense->lon[n] * granularity;
-                    node.id  = id;
-                    node.lat = lat;
-                    node.lon = lon;
-                    // Copy tag string indexes over from concatenated alternating array
-                    int kv1 = 0; // index into target keys and values array
-                    // some blocks have no tags at all, check that the array pointer is not null
-                    if (dense->keys_vals != NULL) {
-                        // key-val list for each node is terminated with a zero-length string
-                        while (string_table[dense->keys_vals[kv0]].len > 0) {
-                            if (kv1 < MAX_TAGS) { // target buffers are reused and fixed-length
-                                keys[kv1] = dense->keys_vals[kv0++];
-                                vals[kv1] = dense->keys_vals[kv0++];
-                                kv1++;
-                            } else {
-                                kv0 += 2; // skip both key and value
-                                fprintf (stderr, "skipping tags after number %d.\n", MAX_TAGS);
-                            }
-                        }
-                    }
-                    node.n_keys = kv1;
-                    node.n_vals = kv1;
-                    kv0++; // skip zero length string indicating end of k-v pairs for this node
-                    (*(callbacks->node))(&node, string_table);
-                }
-            }
+        if ((callbacks->node || callbacks->dense_nodes) && has_nodes && !slot->callbacks_done) {
+            handle_group(slot, g, PHASE_NODE, callbacks);
         }
-        if (callbacks->relation) {
-            for (int r = 0; r < group->n_relations; ++r) {
-                OSMPBF__Relation *relation = group->relations[r];
-                (*(callbacks->relation))(relation, string_table);
-            }
+        if (callbacks->relation && has_relations) {
+            handle_group(slot, g, PHASE_RELATION, callbacks);
         }
     }
+    end_block(callbacks);
     return false; // signal not to break iteration, loading should continue
 }
 
 // TODO break out open, read, and close into separate functions
-// TODO store PBF file offsets to each entity type when they are found, allowing repeated calls
-// TODO pbf_read_nodes, pbf_read_ways, pbf_read_relations convenience functions
 
-/* Externally visible function. */
-void pbf_read (const char *filename, PbfReadCallbacks *callbacks) {
-    pbf_map(filename);
-    OSMPBF__HeaderBlock *header = NULL;
-    int blobcount = 0;
-    phase = PHASE_NODE;
-    bool break_iteration = false;
-    for (void *buf = map; buf < map + map_size; ++blobcount) {
+/* Externally visible function. Zero or negative means one thread per online processor. */
+void pbf_read_set_threads (int threads) {
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    n_threads = threads < 1 ? 1 : threads;
+}
+
+/* Externally visible function. Takes one of the PBF_DECODER_* constants. */
+void pbf_read_set_decoder (int d) {
+    if (d != PBF_DECODER_PROTOBUF && d != PBF_DECODER_STREAM)
+        die("unrecognized PBF decoder");
+    decoder = d;
+}
+
+/* Release any decoded messages left in the slots and the slots themselves. */
+static void free_slots () {
+    for (int i = 0; i < n_slots; i++) {
+        if (slots[i].header != NULL)
+            osmpbf__header_block__free_unpacked(slots[i].header, NULL);
+        if (slots[i].block != NULL)
+            osmpbf__primitive_block__free_unpacked(slots[i].block, NULL);
+        pbf_block_free(&(slots[i].stream));
+        pbf_dense_free(&(slots[i].dense));
+        free(slots[i].zbuf);
+    }
+    free(slots);
+    slots = NULL;
+}
+
+/* The sidecar index for a PBF file is stored next to it, with an extra extension. */
+static char *index_filename (const char *filename) {
+    char *name = malloc(strlen(filename) + strlen(".idx") + 1);
+    if (name == NULL)
+        die("could not allocate index file name");
+    strcpy(name, filename);
+    strcat(name, ".idx");
+    return name;
+}
+
+/* Load the blob index for the mapped PBF file. Returns false if it is missing or out of date. */
+static bool load_index (const char *filename) {
+    char *name = index_filename(filename);
+    FILE *f = fopen(name, "rb");
+    free(name);
+    if (f == NULL)
+        return false;
+    BlobIndexHeader header;
+    bool valid = fread(&header, sizeof(header), 1, f) == 1 &&
+        memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+        header.pbf_size == map_size && header.pbf_mtime == map_mtime && header.n_entries > 0;
+    if (valid) {
+        free(blob_index);
+        blob_index = malloc(header.n_entries * sizeof(BlobIndexEntry));
+        if (blob_index == NULL)
+            die("could not allocate blob index");
+        n_index_entries = index_size = header.n_entries;
+        valid = fread(blob_index, sizeof(BlobIndexEntry), n_index_entries, f) == n_index_entries;
+    }
+    fclose(f);
+    if (!valid)
+        fprintf(stderr, "Ignoring blob index for %s, which does not match the file.\n", filename);
+    return valid;
+}
+
+/* Save the blob index for the mapped PBF file. Failing to do so is not fatal, it can be rebuilt. */
+static void save_index (const char *filename) {
+    char *name = index_filename(filename);
+    FILE *f = fopen(name, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Could not write blob index to %s.\n", name);
+        free(name);
+        return;
+    }
+    BlobIndexHeader header;
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.pbf_size = map_size;
+    header.pbf_mtime = map_mtime;
+    header.n_entries = n_index_entries;
+    if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+        fwrite(blob_index, sizeof(BlobIndexEntry), n_index_entries, f) != n_index_entries)
+        fprintf(stderr, "Could not write blob index to %s.\n", name);
+    else
+        fprintf(stderr, "Saved index of %zu blobs to %s.\n", n_index_entries, name);
+    fclose(f);
+    free(name);
+}
+
+/* Add the blob in a slot to the index being built. Only called on the consumer thread. */
+static void index_blob (BlobSlot *slot) {
+    if (n_index_entries == index_size) {
+        index_size = index_size == 0 ? 1024 : index_size * 2;
+        blob_index = realloc(blob_index, index_size * sizeof(BlobIndexEntry));
+        if (blob_index == NULL)
+            die("could not grow blob index");
+    }
+    BlobIndexEntry *entry = &(blob_index[n_index_entries++]);
+    entry->offset = slot->offset;
+    entry->size = slot->total_size;
+    entry->element_type = slot->element_type;
+    entry->min_id = slot->min_id;
+    entry->max_id = slot->max_id;
+}
+
+/*
+  Stop decoder threads from starting any more callbacks, and wait for those already running.
+  Blobs after the given one may already have been handled out of order on decoder threads. Returns
+  the last such blob, since the checkpoint can only be taken once the consumer has caught up to it.
+*/
+static long begin_drain (long blobcount) {
+    pthread_mutex_lock(&slot_mutex);
+    draining = true;
+    while (callbacks_running > 0)
+        pthread_cond_wait(&slot_cond, &slot_mutex);
+    long last_handled = blobcount;
+    for (long seq = blobcount + 1; seq < n_scanned; seq++) {
+        if (slots[seq % n_slots].callbacks_done)
+            last_handled = seq;
+    }
+    pthread_mutex_unlock(&slot_mutex);
+    return last_handled;
+}
+
+static void end_drain () {
+    pthread_mutex_lock(&slot_mutex);
+    draining = false;
+    pthread_cond_broadcast(&slot_cond);
+    pthread_mutex_unlock(&slot_mutex);
+}
+
+/*
+  Read the blobs lying between the given file offsets, which must fall on blob boundaries.
+  A scanner thread locates blobs and a pool of worker threads inflates and unpacks them, while the
+  calling thread hands each block to the callbacks strictly in file order. The first blob in the file
+  must be a header, but a range starting later begins directly with blocks of the given phase.
+  Returns true if every blob in the range was read, false if reading stopped early.
+*/
+static bool read_blobs (PbfReadCallbacks *callbacks, size_t begin, size_t end, int first_phase) {
+    double t0 = now();
+    scan_begin = begin;
+    scan_end = end;
+    if (index_building)
+        n_index_entries = 0;
+    /* Enough slots to keep every worker busy while the consumer is still working on older blocks. */
+    n_slots = n_threads * 2 + 2;
+    slots = calloc(n_slots, sizeof(BlobSlot));
+    if (slots == NULL)
+        die("could not allocate blob slots");
+    n_scanned = next_decode = 0;
+    scan_done = stop = false;
+    scan_seconds = inflate_seconds = unpack_seconds = callback_seconds = wait_seconds = 0;
+    node_seconds = way_seconds = 0;
+    nodes_complete = false;
+    read_callbacks = callbacks;
+    compressed_bytes = inflated_bytes = 0;
+    pthread_t scanner;
+    pthread_t workers[n_threads];
+    if (pthread_create(&scanner, NULL, scan_blobs, NULL) != 0)
+        die("could not start PBF scanner thread");
+    for (int t = 0; t < n_threads; t++) {
+        if (pthread_create(&(workers[t]), NULL, decode_blobs, NULL) != 0)
+            die("could not start PBF decoder thread");
+    }
+    bool have_header = (begin > 0);
+    bool complete = true;
+    phase = first_phase;
+    draining = false;
+    callbacks_running = 0;
+    double last_checkpoint = now();
+    long checkpoint_at = -1; // the blob after which a pending checkpoint will be taken
+    for (long blobcount = 0; ; ++blobcount) {
+        BlobSlot *slot = &(slots[blobcount % n_slots]);
+        double t1 = now();
+        pthread_mutex_lock(&slot_mutex);
+        while (!(blobcount < n_scanned && slot->state == SLOT_DECODED) &&
+               !(scan_done && blobcount >= n_scanned))
+            pthread_cond_wait(&slot_cond, &slot_mutex);
+        bool finished = blobcount >= n_scanned;
+        if (!finished && slot->ways_pending) {
+            /* Every block before this one has been handled, so all nodes are in. Release the ways. */
+            nodes_complete = true;
+            pthread_cond_broadcast(&slot_cond);
+            while (slot->ways_pending)
+                pthread_cond_wait(&slot_cond, &slot_mutex);
+        }
+        pthread_mutex_unlock(&slot_mutex);
+        if (finished) break;
+        double t2 = now();
+        wait_seconds += t2 - t1;
         if (blobcount % 1000 == 0) {
-            fprintf(stderr, "Loading PBF blob %dk (position %ldMB)\n", blobcount/1000, (buf - map) / 1024 / 1024);
+            fprintf(stderr, "Loading PBF blob %ldk (position %ldMB)\n", blobcount/1000, 
+                (long)(slot->data - (uint8_t *)map) / 1024 / 1024);
         }
-        /* read blob header */
-        OSMPBF__BlobHeader *blobh;
-        // header prefixed with 4-byte contain network (big-endian) order message length
-        int32_t msg_length = ntohl(*((int*)buf)); // TODO shouldn't this be an exact-width type cast?
-        buf += sizeof(int32_t);
-        blobh = osmpbf__blob_header__unpack(NULL, msg_length, buf);
-        buf += msg_length;
-        if (blobh == NULL)
-            die("error unpacking blob header");
-
-        /* read blob data */
-        OSMPBF__Blob *blob;
-        blob = osmpbf__blob__unpack(NULL, blobh->datasize, buf);
-        buf += blobh->datasize;
-        if (blobh == NULL)
-            die("error unpacking blob data");
-
-        /* check if the blob is raw or compressed */
-        uint8_t* bdata;
-        size_t bsize;
-        if (blob->has_zlib_data) {
-            bdata = zbuf;
-            bsize = blob->raw_size;
-            int inflated_size = zinflate(&(blob->zlib_data), zbuf);
-            if (inflated_size != bsize)
-                die("inflated blob size does not match expected size");
-        } else if (blob->has_raw) {
-            fprintf(stderr, "uncompressed\n");
-            bdata = blob->raw.data;
-            bsize = blob->raw.len;
-        } else
-            die("neither compressed nor raw data present in blob");
-
-        /* get header block from first blob */
-        if (header == NULL) {
-            if (strcmp(blobh->type, "OSMHeader") != 0)
+        bool break_iteration = false;
+        if (!have_header) {
+            /* get header block from first blob */
+            if (!slot->is_header)
                 die("expected first blob to be a header");
-            header = osmpbf__header_block__unpack(NULL, bsize, bdata);
-            if (header == NULL)
-                die("failed to read OSM header message from header blob");
-            goto free_blob;
-        }
-
-        /* get an OSM primitive block from subsequent blobs */
-        if (strcmp(blobh->type, "OSMData") != 0) {
+            have_header = true;
+        } else if (!slot->is_data) {
             fprintf(stderr, "skipping unrecognized blob type\n");
-            goto free_blob;
+        } else {
+            /* get an OSM primitive block from subsequent blobs */
+            break_iteration = handle_primitive_block(slot, callbacks);
         }
-        
-        OSMPBF__PrimitiveBlock *block;
-        block = osmpbf__primitive_block__unpack(NULL, bsize, bdata);
-        if (block == NULL)
-            die("error unpacking primitive block");
-        break_iteration = handle_primitive_block(block, callbacks);
-        osmpbf__primitive_block__free_unpacked(block, NULL);
+        if (index_building)
+            index_blob(slot);
+        size_t next_offset = slot->offset + slot->total_size;
+        if (slot->header != NULL)
+            osmpbf__header_block__free_unpacked(slot->header, NULL);
+        if (slot->block != NULL)
+            osmpbf__primitive_block__free_unpacked(slot->block, NULL);
+        slot->header = NULL;
+        slot->block = NULL;
+        callback_seconds += now() - t2;
+        /* Hand the slot back to the scanner, or shut down the pipeline if we are exiting early. */
+        pthread_mutex_lock(&slot_mutex);
+        slot->state = SLOT_EMPTY;
+        if (break_iteration) stop = true;
+        pthread_cond_broadcast(&slot_cond);
+        pthread_mutex_unlock(&slot_mutex);
+        if (break_iteration) {
+            complete = false;
+            break;
+        }
+        /* 
+          Once every blob up to this one has been handled and no later blob has been, everything
+          before next_offset is loaded and nothing after it is, so the caller can take a checkpoint.
+        */
+        if (callbacks->checkpoint != NULL && checkpoint_at < 0 &&
+                now() - last_checkpoint >= checkpoint_interval)
+            checkpoint_at = begin_drain(blobcount);
+        if (checkpoint_at >= 0 && blobcount >= checkpoint_at) {
+            PbfResumePoint resume = { next_offset, phase };
+            (*(callbacks->checkpoint))(&resume);
+            end_drain();
+            checkpoint_at = -1;
+            last_checkpoint = now();
+        }
+    }
+    pthread_join(scanner, NULL);
+    for (int t = 0; t < n_threads; t++)
+        pthread_join(workers[t], NULL);
+    report_throughput(now() - t0);
+    free_slots();
+    return complete;
+}
 
-        /* post-iteration cleanup */
-        free_blob:
-        osmpbf__blob_header__free_unpacked(blobh, NULL);
-        osmpbf__blob__free_unpacked(blob, NULL);
-        if (break_iteration) break;
+/* Externally visible function. Seconds between calls to the checkpoint callback. */
+void pbf_read_set_checkpoint_interval (int seconds) {
+    checkpoint_interval = seconds;
+}
+
+/* Externally visible function. If true, pbf_read saves a blob index when it reads a whole file. */
+void pbf_read_set_index (bool enabled) {
+    use_index = enabled;
+}
+
+/*
+  Externally visible function.
+  Read the whole file, handing every element to the callbacks. If indexing is enabled and the file
+  has no up-to-date index, one is built along the way and saved if the whole file was read.
+*/
+void pbf_read (const char *filename, PbfReadCallbacks *callbacks) {
+    pbf_map(filename);
+    index_building = use_index && !load_index(filename);
+    bool complete = read_blobs(callbacks, 0, map_size, PHASE_NODE);
+    if (index_building && complete)
+        save_index(filename);
+    index_building = false;
+    pbf_unmap();
+}
+
+/*
+  Externally visible function.
+  Continue reading a file from a resume point passed to the checkpoint callback by an earlier read.
+*/
+void pbf_read_resume (const char *filename, PbfReadCallbacks *callbacks, PbfResumePoint *resume) {
+    pbf_map(filename);
+    if (resume->offset > map_size)
+        die("resume point is beyond the end of the PBF file");
+    fprintf(stderr, "Resuming PBF read at position %ldMB.\n", (long)(resume->offset / 1024 / 1024));
+    read_blobs(callbacks, resume->offset, map_size, resume->phase);
+    pbf_unmap();
+}
+
+/*
+  Externally visible function.
+  Read only every nth data blob of a file, to gather statistics about it quickly. The skipped blobs
+  are not even decompressed. Any checkpoint callback should be left out.
+*/
+void pbf_read_sample (const char *filename, PbfReadCallbacks *callbacks, int every) {
+    pbf_map(filename);
+    sample_every = every < 1 ? 1 : every;
+    read_blobs(callbacks, 0, map_size, PHASE_NODE);
+    sample_every = 1;
+    pbf_unmap();
+}
+
+/* Make sure the blob index for the mapped file is loaded, reading the whole file to build it if needed. */
+static void require_index (const char *filename) {
+    if (load_index(filename))
+        return;
+    fprintf(stderr, "Building blob index for %s.\n", filename);
+    PbfReadCallbacks no_callbacks = { NULL };
+    index_building = full_scan = true;
+    if (!read_blobs(&no_callbacks, 0, map_size, PHASE_NODE))
+        die("could not read the whole PBF file to index it");
+    index_building = full_scan = false;
+    save_index(filename);
+}
+
+/* Use the blob index to read only the blobs containing elements of one type. */
+static void read_element_type (const char *filename, PbfReadCallbacks *callbacks, int element_type) {
+    pbf_map(filename);
+    require_index(filename);
+    size_t begin = 0, end = 0;
+    for (size_t i = 0; i < n_index_entries; i++) {
+        BlobIndexEntry *entry = &(blob_index[i]);
+        if (entry->element_type != element_type)
+            continue;
+        if (end == 0)
+            begin = entry->offset;
+        end = entry->offset + entry->size;
     }
-    osmpbf__header_block__free_unpacked(header, NULL);
+    if (end == 0)
+        fprintf(stderr, "No blocks of the requested element type in %s.\n", filename);
+    else
+        read_blobs(callbacks, begin, end, element_type);
     pbf_unmap();
 }
 
+/* Externally visible functions. These build a blob index for the file the first time they are used. */
+void pbf_read_nodes (const char *filename, PbfReadCallbacks *callbacks) {
+    read_element_type(filename, callbacks, PHASE_NODE);
+}
+
+void pbf_read_ways (const char *filename, PbfReadCallbacks *callbacks) {
+    read_element_type(filename, callbacks, PHASE_WAY);
+}
+
+void pbf_read_relations (const char *filename, PbfReadCallbacks *callbacks) {
+    read_element_type(filename, callbacks, PHASE_RELATION);
+}
+
 /* Example way callback that just counts node references. */
 static long noderefs = 0;
 static void handle_way(OSMPBF__Way *way, ProtobufCBinaryData *string_table) {
@@ -16,6 +16,7 @@
 #include "zlib.h"
 #include "tags.h"
 #include "dedup.h"
+#include "intpack.h"
 
 /*
     We are using the c protobuf compiler https://github.com/protobuf-c/protobuf-c/
@@ -292,27 +293,18 @@ void pbf_write_flush() {
 
 
 /* PUBLIC Write one way in a buffered fashion, writing out a blob as needed (every 8k objects). */
-void pbf_write_way (int64_t way_id, int64_t *refs, uint8_t *coded_tags) {
+void pbf_write_way (int64_t way_id, uint8_t *packed_refs, uint8_t *coded_tags) {
 
     /*
-      We must copy the refs list, and cannot use it directly:
-      It contains negative sentinel values and is not delta coded.
-      First, count number of node refs in this way.
+      The packed list gives the number of refs up front, followed by the refs already delta coded
+      as in PBF, so they can be decoded straight into a dynamically allocated buffer in one pass.
     */
-    size_t n_refs = 1;
-    for (int64_t *r = refs; *r >= 0; r++) {
-        n_refs++;
-    }
-
-    /* Delta code refs, copying them into a dynamically allocated buffer. */
+    uint64_t n_refs;
+    packed_refs += uint64_unpack(packed_refs, &n_refs);
     int64_t *refs_buf = malloc(n_refs * sizeof(int64_t)); // deallocated in reset_way_block
     if (refs_buf == NULL) exit (-1);
-    int64_t prev_ref = 0;
     for (int i = 0; i < n_refs; i++) {
-        int64_t ref = refs[i];
-        if (ref < 0) ref = -ref; // should only happen on the last ref in the list
-        refs_buf[i] = ref - prev_ref; // refs within a way are delta coded
-        prev_ref = ref;
+        packed_refs += sint64_unpack(packed_refs, &(refs_buf[i]));
     }
 
     /* Grab an unused OSMPBF Way struct from the block. */
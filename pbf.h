@@ -4,12 +4,56 @@
 #include "fileformat.pb-c.h"
 #include "osmformat.pb-c.h"
 #include <stdio.h> // for FILE
+#include <stdbool.h>
 
-/* This bundles together callback functions for reading the three main OSM element types. */
+/*
+  All the nodes in one DenseNodes group, with IDs and coordinates already delta-decoded.
+  Coordinates are in nanodegrees. The tags of node i are the string table indexes in keys and vals
+  from tag_offsets[i] up to tag_offsets[i + 1], so tag_offsets has n_nodes + 1 entries.
+*/
+typedef struct {
+    size_t n_nodes;
+    int64_t *ids;
+    int64_t *lats;
+    int64_t *lons;
+    uint32_t *tag_offsets;
+    uint32_t *keys;
+    uint32_t *vals;
+} PbfDenseNodes;
+
+/* A position between two blobs of a PBF file, from which reading can be resumed. */
+typedef struct {
+    uint64_t offset; // file offset of the first blob not yet read
+    int32_t phase;   // the element type (node, way or relation) of the last block read
+} PbfResumePoint;
+
+/* 
+  This bundles together callback functions for reading the three main OSM element types.
+  If dense_nodes is defined, each DenseNodes group is passed to it as a whole instead of passing its
+  nodes one by one to the node callback. Plain nodes still go to the node callback.
+  If concurrent_nodes is true, the node callbacks may be called from several decoder threads at once
+  and in no particular order. All nodes are still handled before the first way or relation.
+  Likewise if concurrent_ways is true for the way callback. All ways are handled before the first
+  relation.
+  If block_strings is defined, it is called with the string table of each block before any of the
+  block's elements are handed to the other callbacks, on the thread that will handle them. This lets
+  the callbacks do per-string work once per block rather than once per element.
+  If block_done is defined, it is called on the same thread once all of a block's elements have been
+  handed to the other callbacks, so work staged for the block can be completed before the next phase.
+  If checkpoint is defined, it is called periodically on the thread that called pbf_read, at a moment
+  when no other callbacks are running and the elements of every blob before the resume point, and
+  of no blob after it, have been handled.
+*/
 typedef struct {
     void (*way)      (OSMPBF__Way*,      ProtobufCBinaryData *string_table);
     void (*node)     (OSMPBF__Node*,     ProtobufCBinaryData *string_table);
     void (*relation) (OSMPBF__Relation*, ProtobufCBinaryData *string_table);
+    void (*dense_nodes) (PbfDenseNodes*, ProtobufCBinaryData *string_table);
+    void (*block_strings) (ProtobufCBinaryData *string_table, size_t n_strings);
+    void (*block_done) (void);
+    void (*checkpoint) (PbfResumePoint*);
+    bool concurrent_nodes;
+    bool concurrent_ways;
 } PbfReadCallbacks;
 
 /* This bundles together callback functions for writing the three main OSM element types. (incomplete) */
@@ -21,24 +65,37 @@ typedef struct {
 
 /* 
   A single member of a relation. We lose some information so that these can be fixed-width. 
-  Specifically, only the 255 most common roles are supported.
+  Specifically, only the roles in the tag dictionary are supported.
   FIXME this is the only internal OSM storage type that is in the read/write header, which breaks 
   library encapsulation. Perhaps the write code should not be kept separate from vex itself, and 
   all vex internal storage arrays should be in extern declarations in the header, which would 
   simplify pbf write function call signatures. 
 */
 typedef struct {
-    uint8_t role; // 1-255 are the 255 most common roles, 0 for all others
+    uint16_t role; // codes of the roles in the tag dictionary from 1, 0 for all others
     uint8_t element_type; // NODE, WAY, or RELATION
     int64_t id; // the id of the node or way being referenced, last ID in the list is negative
 } RelMember;
 
+/* Decoders for PBF blocks, selected with pbf_read_set_decoder. */
+#define PBF_DECODER_PROTOBUF 0 // unpack each block into protobuf-c messages (default)
+#define PBF_DECODER_STREAM   1 // decode elements in place, without heap allocation
+
 /* PUBLIC READ FUNCTIONS */
 void pbf_read(const char *filename, PbfReadCallbacks *callbacks);
+void pbf_read_nodes(const char *filename, PbfReadCallbacks *callbacks);
+void pbf_read_ways(const char *filename, PbfReadCallbacks *callbacks);
+void pbf_read_relations(const char *filename, PbfReadCallbacks *callbacks);
+void pbf_read_resume(const char *filename, PbfReadCallbacks *callbacks, PbfResumePoint *resume);
+void pbf_read_sample(const char *filename, PbfReadCallbacks *callbacks, int every);
+void pbf_read_set_threads(int threads);
+void pbf_read_set_decoder(int decoder);
+void pbf_read_set_index(bool enabled);
+void pbf_read_set_checkpoint_interval(int seconds);
 
 /* PUBLIC WRITE FUNCTIONS */
 void pbf_write_begin(FILE *out);
-void pbf_write_way(int64_t way_id, int64_t *refs, uint8_t *coded_tags);
+void pbf_write_way(int64_t way_id, uint8_t *packed_refs, uint8_t *coded_tags);
 void pbf_write_node(int64_t node_id, double lat, double lon, uint8_t *coded_tags);
 void pbf_write_relation(int64_t relation_id, RelMember *members, uint8_t *coded_tags);
 void pbf_write_flush();
@@ -0,0 +1,240 @@
+/* tagfilter.c : decides which tags are stored, according to a list of keep and drop rules. */
+#include "tagfilter.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+  Each rule is written on its own line as 'drop' or 'keep' followed by a pattern:
+    drop created_by        a key
+    drop tiger:*           any key beginning with tiger:
+    drop highway=proposed  a key=value pair
+    keep name:*            the same forms work for keep rules, and values may also end with *
+  Lines that are blank or begin with # are ignored.
+  A tag is dropped if it matches any drop rule. If there are any keep rules, a tag is also dropped
+  unless it matches one of them.
+
+  All the patterns are compiled into a single automaton over the bytes of the key, followed by a zero
+  byte and the bytes of the value for patterns that include a value. Each state of the automaton
+  records which patterns end there exactly, and which patterns match anything that continues from
+  there. The loader only evaluates this once for each distinct string in a PBF block.
+*/
+
+/* Flags on automaton states. */
+#define EXACT_DROP  1
+#define EXACT_KEEP  2
+#define PREFIX_DROP 4
+#define PREFIX_KEEP 8
+
+#define NO_STATE UINT32_MAX
+
+/* The trie of patterns as they are added, before it is compiled. Node zero is the root. */
+typedef struct {
+    uint8_t byte;     // label on the edge leading to this node
+    uint8_t flags;
+    uint32_t child;   // first child, or zero if there are none
+    uint32_t sibling; // next child of the same parent, or zero
+} TrieNode;
+static TrieNode *trie;
+static uint32_t n_trie, trie_size;
+
+/* The compiled automaton. The edges leaving each state are contiguous and sorted by byte. */
+typedef struct {
+    uint32_t first_edge;
+    uint16_t n_edges;
+    uint8_t flags;
+} State;
+static State *states;
+static uint8_t *edge_bytes;
+static uint32_t *edge_targets;
+static bool have_keep_rules;
+
+/* Rules applied when no filter file is given: bot and import bookkeeping we never serve. */
+static const char *default_rules[] = {
+    "drop created_by",
+    "drop import_uuid",
+    "drop attribution",
+    "drop source*",
+    "drop tiger:*",
+    NULL // list terminator
+};
+
+static void die (const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+static uint32_t new_trie_node (uint8_t byte) {
+    if (n_trie == trie_size) {
+        trie_size = trie_size == 0 ? 256 : trie_size * 2;
+        trie = realloc(trie, trie_size * sizeof(TrieNode));
+        if (trie == NULL) die ("Could not allocate tag filter.");
+    }
+    TrieNode *node = &(trie[n_trie]);
+    node->byte = byte;
+    node->flags = 0;
+    node->child = 0;
+    node->sibling = 0;
+    return n_trie++;
+}
+
+/* Find the child of a trie node along the edge with the given byte, adding it if necessary. */
+static uint32_t trie_child (uint32_t parent, uint8_t byte) {
+    uint32_t *link = &(trie[parent].child);
+    while (*link != 0 && trie[*link].byte < byte)
+        link = &(trie[*link].sibling);
+    if (*link != 0 && trie[*link].byte == byte)
+        return *link;
+    uint32_t node = new_trie_node(byte); // may move the trie, so the link is found again below
+    link = &(trie[parent].child);
+    while (*link != 0 && trie[*link].byte < byte)
+        link = &(trie[*link].sibling);
+    trie[node].sibling = *link;
+    *link = node;
+    return node;
+}
+
+/* Add the bytes of a string to the trie starting from the given node, returning the final node. */
+static uint32_t trie_add (uint32_t node, const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        node = trie_child(node, (uint8_t) s[i]);
+    return node;
+}
+
+/* Add one rule to the trie. Returns false if it is not a valid rule. */
+static bool add_rule (const char *rule) {
+    bool drop;
+    if (strncmp(rule, "drop ", 5) == 0) drop = true;
+    else if (strncmp(rule, "keep ", 5) == 0) drop = false;
+    else return false;
+    const char *pattern = rule + 5;
+    size_t len = strlen(pattern);
+    if (len == 0) return false;
+    bool prefix = (pattern[len - 1] == '*');
+    if (prefix) len--;
+    const char *eq = memchr(pattern, '=', len);
+    uint32_t node;
+    if (eq == NULL) {
+        node = trie_add(0, pattern, len);
+    } else {
+        node = trie_add(0, pattern, eq - pattern);
+        node = trie_child(node, 0); // separates the key from the value
+        node = trie_add(node, eq + 1, len - (eq - pattern) - 1);
+    }
+    if (prefix) trie[node].flags |= drop ? PREFIX_DROP : PREFIX_KEEP;
+    else trie[node].flags |= drop ? EXACT_DROP : EXACT_KEEP;
+    if (!drop) have_keep_rules = true;
+    return true;
+}
+
+/* Number the trie nodes breadth first, and lay out their edges contiguously. */
+static void compile () {
+    states = malloc(n_trie * sizeof(State));
+    edge_bytes = malloc(n_trie);
+    edge_targets = malloc(n_trie * sizeof(uint32_t));
+    uint32_t *order = malloc(n_trie * sizeof(uint32_t)); // trie nodes in breadth first order
+    if (states == NULL || edge_bytes == NULL || edge_targets == NULL || order == NULL)
+        die ("Could not allocate tag filter.");
+    order[0] = 0;
+    uint32_t n_states = 1, n_edges = 0;
+    for (uint32_t s = 0; s < n_states; s++) {
+        TrieNode *node = &(trie[order[s]]);
+        states[s].first_edge = n_edges;
+        states[s].n_edges = 0;
+        states[s].flags = node->flags;
+        for (uint32_t c = node->child; c != 0; c = trie[c].sibling) {
+            edge_bytes[n_edges] = trie[c].byte;
+            edge_targets[n_edges] = n_states;
+            order[n_states++] = c;
+            n_edges++;
+            states[s].n_edges++;
+        }
+    }
+    free(order);
+    free(trie);
+    trie = NULL;
+}
+
+/* Externally visible function. */
+void TagFilter_init (const char *filename) {
+    new_trie_node(0); // root
+    if (filename == NULL) {
+        for (const char **rule = default_rules; *rule != NULL; rule++)
+            add_rule(*rule);
+    } else {
+        FILE *file = fopen(filename, "r");
+        if (file == NULL) die ("Could not open tag filter file.");
+        char line[1024];
+        for (int number = 1; fgets(line, sizeof(line), file) != NULL; number++) {
+            size_t len = strlen(line);
+            while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' || line[len - 1] == ' '))
+                line[--len] = '\0';
+            if (len == 0 || line[0] == '#') continue;
+            if (!add_rule(line)) {
+                fprintf(stderr, "%s:%d: expected 'drop pattern' or 'keep pattern'\n", filename, number);
+                exit(EXIT_FAILURE);
+            }
+        }
+        fclose(file);
+    }
+    compile();
+}
+
+/* Follow the edge with the given byte out of a state, returning NO_STATE if there is none. */
+static uint32_t step (uint32_t s, uint8_t byte) {
+    State *state = &(states[s]);
+    uint8_t *bytes = &(edge_bytes[state->first_edge]);
+    for (int e = 0; e < state->n_edges && bytes[e] <= byte; e++) {
+        if (bytes[e] == byte) return edge_targets[state->first_edge + e];
+    }
+    return NO_STATE;
+}
+
+/*
+  Advance from a state over some bytes, noting any prefix patterns passed along the way.
+  Returns the state reached, or NO_STATE if no pattern continues with these bytes.
+*/
+static uint32_t walk (uint32_t s, const uint8_t *data, size_t len, uint8_t *matched) {
+    for (size_t i = 0; s != NO_STATE; i++) {
+        *matched |= states[s].flags & (PREFIX_DROP | PREFIX_KEEP);
+        if (i == len) return s;
+        s = step(s, data[i]);
+    }
+    return NO_STATE;
+}
+
+/* Combine the patterns matched into a verdict on a tag. */
+static bool dropped (uint8_t matched) {
+    if (matched & (EXACT_DROP | PREFIX_DROP)) return true;
+    return have_keep_rules && !(matched & (EXACT_KEEP | PREFIX_KEEP));
+}
+
+/* Externally visible function. Returns TAG_KEEP, TAG_DROP or TAG_BY_VALUE. */
+int TagFilter_key (ProtobufCBinaryData key) {
+    uint8_t matched = 0;
+    uint32_t s = walk(0, key.data, key.len, &matched);
+    if (s != NO_STATE) {
+        matched |= states[s].flags & (EXACT_DROP | EXACT_KEEP);
+        if (!(matched & (EXACT_DROP | PREFIX_DROP)) && step(s, 0) != NO_STATE)
+            return TAG_BY_VALUE;
+    }
+    return dropped(matched) ? TAG_DROP : TAG_KEEP;
+}
+
+/* Externally visible function. */
+bool TagFilter_drop_tag (ProtobufCBinaryData key, ProtobufCBinaryData val) {
+    uint8_t matched = 0;
+    uint32_t s = walk(0, key.data, key.len, &matched);
+    if (s != NO_STATE) {
+        matched |= states[s].flags & (EXACT_DROP | EXACT_KEEP);
+        s = step(s, 0);
+        if (s != NO_STATE) {
+            s = walk(s, val.data, val.len, &matched);
+            if (s != NO_STATE)
+                matched |= states[s].flags & (EXACT_DROP | EXACT_KEEP);
+        }
+    }
+    return dropped(matched);
+}
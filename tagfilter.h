@@ -0,0 +1,20 @@
+/* tagfilter.h : decides which tags are stored, according to a list of keep and drop rules. */
+#ifndef TAGFILTER_H_INCLUDED
+#define TAGFILTER_H_INCLUDED
+
+#include <stdbool.h>
+#include "pbf.h"
+
+/* The outcome of filtering a key alone. */
+#define TAG_KEEP     0
+#define TAG_DROP     1
+#define TAG_BY_VALUE 2 // some rules apply to particular values of this key, so filter the whole tag
+
+/* Compile the rules in the given file, or the default rules if filename is NULL. */
+void TagFilter_init (const char *filename);
+
+int TagFilter_key (ProtobufCBinaryData key);
+
+bool TagFilter_drop_tag (ProtobufCBinaryData key, ProtobufCBinaryData val);
+
+#endif /* TAGFILTER_H_INCLUDED */
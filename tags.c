@@ -2,190 +2,16 @@
 #include "tags.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "pbf.h"
 
-// http://taginfo.openstreetmap.org/keys
-
-typedef struct {
-    char *key;
-    int  len;     // works as long as len >= size of first dimension of vals
-    char **vals;  // strings could also be fixed-width
-} KVTable;
-
-
-// This could just be one giant char*[] with null separators
-
-static KVTable tables[] = {
-    {
-        "highway", 32, (char *[]) {
-            "residential",
-            "service",
-            "track",
-            "unclassified",
-            "footway",
-            "tertiary",
-            "path",
-            "secondary",
-            "primary",
-            "bus_stop",
-            "crossing",
-            "turning_circle",
-            "cycleway",
-            "trunk",
-            "traffic_signals",
-            "living_street",
-            "motorway",
-            "steps",
-            "motorway_link",
-            "road",
-            "pedestrian",
-            "trunk_link",
-            "primary_link",
-            "stop",
-            "secondary_link",
-            "motorway_junction",
-            "tertiary_link",
-            "construction",
-            "give_way",
-            "bridleway",
-            "platform",
-            "mini_roundabout"
-        }
-    },
-    {
-        "building", 8, (char *[]) {
-            "yes",
-            "house",
-            "residential",
-            "garage",
-            "hut",
-            "industrial",
-            "commercial",
-            "retail"
-        }
-    },
-    {
-        "landuse", 8, (char *[]) {
-            "forest",
-            "residential",
-            "grass",
-            "farmland",
-            "meadow",
-            "farm",
-            "reservoir",
-            "industrial"
-        }
-    },
-    {
-        "surface", 12, (char *[]) {
-            "asphalt",
-            "unpaved",
-            "paved",
-            "gravel",
-            "ground",
-            "dirt",
-            "grass",
-            "concrete",
-            "paving_stones",
-            "sand",
-            "cobblestone",
-            "compacted"
-        }
-    },
-    {
-        "amenity", 8, (char *[]) {
-            "parking",
-            "place_of_worship",
-            "school",
-            "restaurant",
-            "bench",
-            "fuel",
-            "post_box",
-            "bank"
-        }
-    },
-    {
-        "power", 8, (char *[]) {
-            "tower",
-            "pole",
-            "line",
-            "generator",
-            "minor_line",
-            "sub_station",
-            "substation",
-            "station"
-        }
-    },
-    {
-        "traffic_calming", 5, (char *[]) {
-            "bump",
-            "hump",
-            "table",
-            "yes",
-            "island"
-        }
-    },
-    {
-        "railway", 8, (char *[]) {
-            "rail",
-            "level_crossing",
-            "abandoned",
-            "station",
-            "buffer_stop",
-            "tram",
-            "switch",
-            "platform"
-        }
-    },
-    {
-        "service", 8, (char *[]) {
-            "parking_aisle",
-            "driveway",
-            "alley",
-            "spur",
-            "yard",
-            "siding",
-            "drive-through",
-            "emergency_access"
-        }
-    },
-    {
-        "access", 8, (char *[]) {
-            "private",
-            "yes",
-            "no",
-            "permissive",
-            "destination",
-            "agricultural",
-            "customers",
-            "designated"
-        }
-    },
-    {
-        "crossing", 6, (char *[]) {
-            "uncontrolled",
-            "traffic_signals",
-            "unmarked",
-            "island",
-            "zebra",
-            "no"
-        }
-    },
-    {
-        "footway", 8, (char *[]) {
-            "sidewalk",
-            "crossing",
-            "both",
-            "none",
-            "right",
-            "left",
-            "no",
-            "yes"
-        }
-    },
-    {NULL, 0, NULL} // sentinel
-};
-
+/*
+  The built-in tag dictionary is generated from tags.txt by gentags.py. It holds the common key=value
+  pairs, the keys whose values are stored as free text, and the common relation roles, each with a
+  minimal perfect hash for finding an entry from its string. A database may instead be loaded with
+  a dictionary learned from its input, which is hashed the same way when it is loaded.
+*/
+#include "tags-hash.h"
 
 /* retain by string:
 name
@@ -194,69 +20,131 @@ all nodes and edges point into a char array: kvkvkvkv\0key=value\0key=value
 it is tempting to try to save all needed tags as numbers, but remember we need free-text for names etc.
 */
 
-char *free_text_keys[] = {
-    "addr:postcode",
-    "addr:postcode:left",
-    "addr:postcode:right",
-    "addr:housenumber",
-    "addr:street",
-    "addr:city",
-    "addr:country",
-    "addr:full",
-    "addr:state",
-    "amenity",
-    "bicycle",
-    "bridge",
-    "building",
-    "cycleway",
-    "embankment",
-    "exit_to",
-    "footway",
-    "highway",
-    "landuse",
-    "lanes",
-    "maxspeed",
-    "name",
-    "oneway",
-    "phone",
-    "public_transport",
-    "railway",
-    "service",
-    "surface",
-    "tunnel",
-    "website",
-    "zip_left",
-    "zip_right",
-    NULL // list terminator
-};
+/*
+  Each tag in a stored tag list begins with its code, in one or two bytes. Read as a signed char,
+  the first byte is:
+    0            the key and value follow as zero-terminated strings
+    1 to 126     a pair code
+    127          (INT8_MAX) not a tag, the end of the list
+    -1 to -64    a free-text key code, the value follows as a zero-terminated string
+    -65 to -96   the high bits of a pair code above 126, whose low 8 bits are in the second byte
+    -97 to -128  the high bits of a free-text key code below -64, likewise
+  The one-byte codes are the same as those written when all codes fitted in a byte.
+*/
+#define ONE_BYTE_PAIRS 126
+#define ONE_BYTE_KEYS  64
+#define TWO_BYTE_PAIR_LEAD (-96)  // first byte of the lowest two-byte pair code
+#define TWO_BYTE_KEY_LEAD  (-128) // first byte of the highest two-byte free-text key code
 
-int8_t encode_tag (ProtobufCBinaryData key, ProtobufCBinaryData val) {
-    int code = 1;
-    for (KVTable *table = &tables[0]; table->key != NULL; table++) {
-        if (memcmp(table->key, key.data, key.len) == 0) { // Found key
-            for (int v = 0; v < table->len; v++, code++) {
-                if (memcmp(table->vals[v], val.data, val.len) == 0) { // Found key+val
-                    return code;
-                }
-            }
-            break; // try free-text
-        }
-        code += table->len;
+/* One dictionary: its entries and a perfect hash from their strings to their indexes. */
+typedef struct {
+    uint32_t n;               // number of entries
+    uint32_t n_slots;         // number of hash buckets, and of slots, which is at least n
+    char **keys;              // the key, free-text key or role of each entry
+    char **vals;              // the value of each entry, for key=value pairs only
+    const uint8_t *key_lens;
+    const uint8_t *val_lens;
+    const uint16_t *seeds;    // seed of each bucket
+    const uint16_t *slots;    // entry held by each slot
+} Dictionary;
+
+/* The dictionaries in use, which are the built-in ones unless a database supplies its own. */
+static Dictionary pair_dict = { N_PAIRS, N_PAIRS, pair_keys, pair_vals, pair_key_lens, pair_val_lens,
+                                pair_hash_seeds, pair_hash_slots };
+static Dictionary key_dict  = { N_FREE_TEXT_KEYS, N_FREE_TEXT_KEYS, free_text_keys, NULL,
+                                free_text_key_lens, NULL, free_text_key_hash_seeds, free_text_key_hash_slots };
+static Dictionary role_dict = { N_ROLES, N_ROLES, roles, NULL, role_lens, NULL,
+                                role_hash_seeds, role_hash_slots };
+
+static void die (const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+/* The string hash used by gentags.py: 32-bit FNV-1a, which can be continued over several strings. */
+#define FNV_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+static uint32_t fnv (uint32_t h, const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= data[i];
+        h *= FNV_PRIME;
     }
+    return h;
+}
+
+/* Scramble a hash value with a seed, to choose a bucket (seed zero) or a slot within the table. */
+static uint32_t mix (uint32_t h, uint32_t seed) {
+    h ^= seed * 0x9e3779b9u;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+/* The hash of a key=value pair continues the hash of the key over a zero byte and the value. */
+static uint32_t pair_hash (uint32_t key_hash, const uint8_t *val, size_t val_len) {
+    static const uint8_t zero = 0;
+    return fnv(fnv(key_hash, &zero, 1), val, val_len);
+}
+
+/* Find the only entry of a dictionary that can match the given hash value, or -1 if it is empty. */
+static int hash_lookup (uint32_t h, const Dictionary *d) {
+    if (d->n == 0) return -1;
+    return d->slots[mix(h, d->seeds[mix(h, 0) % d->n_slots]) % d->n_slots];
+}
+
+/* Exact comparison of a length-delimited PBF string with a dictionary entry. */
+static bool same_string (ProtobufCBinaryData s, const char *entry, size_t entry_len) {
+    return s.len == entry_len && memcmp(s.data, entry, entry_len) == 0;
+}
+
+/* Returns a positive pair code, a negative free-text key code, or zero if the tag is not coded. */
+int32_t encode_tag (ProtobufCBinaryData key, ProtobufCBinaryData val) {
+    uint32_t h = fnv(FNV_BASIS, key.data, key.len);
+    /* The hash of the key alone is reused for free-text keys, the pair hash continues from it. */
+    int p = hash_lookup(pair_hash(h, val.data, val.len), &pair_dict);
+    if (p >= 0 && same_string(key, pair_dict.keys[p], pair_dict.key_lens[p]) &&
+            same_string(val, pair_dict.vals[p], pair_dict.val_lens[p]))
+        return p + 1;
     // Key-value combination was not found, next try free-text keys
-    code = -1;
-    for (char **k = &(free_text_keys[0]); *k != NULL; k++, code--) {
-        if (memcmp(*k, key.data, key.len) == 0) { // Found key
-            return code;
-        }
-    }
+    int k = hash_lookup(h, &key_dict);
+    if (k >= 0 && same_string(key, key_dict.keys[k], key_dict.key_lens[k]))
+        return -(k + 1);
     return 0; // No code found for this KV pair
 }
 
+/* Write the bytes of a tag code into a tag list, returning the number of bytes written. */
+size_t write_tag_code (int32_t code, uint8_t *buf) {
+    if (code >= -ONE_BYTE_KEYS && code <= ONE_BYTE_PAIRS) {
+        buf[0] = (int8_t) code;
+        return 1;
+    }
+    int32_t lead, rest;
+    if (code > 0) {
+        lead = TWO_BYTE_PAIR_LEAD;
+        rest = code - ONE_BYTE_PAIRS - 1;
+    } else {
+        lead = TWO_BYTE_KEY_LEAD;
+        rest = -code - ONE_BYTE_KEYS - 1;
+    }
+    buf[0] = (int8_t) (lead + (rest >> 8));
+    buf[1] = rest & 0xff;
+    return 2;
+}
+
 /* Return the number of characters consumed. We could also just return the new position of the pointer? */
 size_t decode_tag (char *buf, KeyVal *kv) {
     char *c = buf;
-    int8_t code = (int8_t) *(c++);
+    int32_t code = (int8_t) *(c++);
+    if (code < -ONE_BYTE_KEYS) {
+        int32_t low = (uint8_t) *(c++);
+        if (code < TWO_BYTE_PAIR_LEAD)
+            code = -((((code - TWO_BYTE_KEY_LEAD) << 8) | low) + ONE_BYTE_KEYS + 1);
+        else
+            code = (((code - TWO_BYTE_PAIR_LEAD) << 8) | low) + ONE_BYTE_PAIRS + 1;
+    }
     if (code == 0) {
         kv->key = c;
         while (*c != '\0') c++;
@@ -265,21 +153,15 @@ size_t decode_tag (char *buf, KeyVal *kv) {
         c++;
     } else if (code < 0) {
         code += 1; // table codes are one-based, shift toward zero
-        kv->key = free_text_keys[-code];
+        if (-code >= key_dict.n) return -1; // invalid input code
+        kv->key = key_dict.keys[-code];
         kv->val = c;
         while (*c != '\0') c++;
         c++;
     } else {
-        code -= 1; // table codes are one-based, shift toward zero
-        KVTable *table = &tables[0];
-        while (code >= table->len) {
-            code -= table->len;
-            table++;
-            if (table->key == NULL) return -1; // table overrun, invalid input code
-        }
-        // code is in the current table
-        kv->key = table->key;
-        kv->val = table->vals[code];
+        if (code > pair_dict.n) return -1; // invalid input code
+        kv->key = pair_dict.keys[code - 1]; // pair codes are one-based
+        kv->val = pair_dict.vals[code - 1];
     }
     size_t n_decoded = c - buf;
     // fprintf (stderr, "\ndecoded %zd bytes: ", n_decoded);
@@ -290,42 +172,176 @@ size_t decode_tag (char *buf, KeyVal *kv) {
 
 /* We also include relation role encoding here because the logic is so similar. */
 
-/* These are the most common roles in the Northeast United States according to our tagstats script. */
-char *relation_roles[] = {
-    "[OTHER]", // zero is used for all unrecognized roles
-    "forward",
-    "outer",
-    "inner",
-    "from",
-    "to",
-    "via",
-    "south",
-    "platform",
-    "west",
-    "east",
-    "north",
-    "stop",
-    "backward",
-    "label",
-    "link",
-    "subarea",
-    "device",
-    "intersection",
-    "sign",
-    NULL // list terminator, max allowed array length is 256
-};
+/* Role code zero is used for all unrecognized roles, so the dictionary roles are numbered from one. */
+uint16_t encode_role (ProtobufCBinaryData role) {
+    int r = hash_lookup(fnv(FNV_BASIS, role.data, role.len), &role_dict);
+    if (r >= 0 && same_string(role, role_dict.keys[r], role_dict.key_lens[r]))
+        return r + 1; // Found role string, return its code
+    return 0; // No code found for this role
+}
+
+char *decode_role (uint16_t code) {
+    if (code == 0 || code > role_dict.n) return "[OTHER]";
+    return role_dict.keys[code - 1];
+}
+
+/* Sort order for hash values packed with their entry index into the low bits. */
+static int compare_packed (const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
 
-uint8_t encode_role (ProtobufCBinaryData role) {
-    /* Start at 1 because zero signifies "other role". */
-    for (uint8_t code = 1; relation_roles[code] != NULL; code++) {
-        if (memcmp(relation_roles[code], role.data, role.len) == 0) {
-            return code; // Found role string, return its index
+/*
+  Find a perfect hash for a dictionary, the same way gentags.py does but with some spare slots, so
+  it can be found quickly for thousands of entries. Spare slots hold entry zero, which the string
+  comparison will reject. If two entries have the same hash value, only the first is hashed and the
+  other is never used to encode anything, though it can still be decoded.
+*/
+static void build_hash (Dictionary *d, const uint32_t *hashes) {
+    uint32_t n = d->n, n_slots = n + n / 4 + 1;
+    uint16_t *seeds = calloc(n_slots, sizeof(uint16_t));
+    uint16_t *slots = calloc(n_slots, sizeof(uint16_t));
+    bool *taken = calloc(n_slots, sizeof(bool));
+    bool *hashed = malloc(n * sizeof(bool) + 1);
+    uint64_t *packed = malloc(n * sizeof(uint64_t) + 1);
+    uint32_t *bucket_start = calloc(n_slots + 1, sizeof(uint32_t));
+    uint32_t *members = malloc(n * sizeof(uint32_t) + 1);
+    if (!seeds || !slots || !taken || !hashed || !packed || !bucket_start || !members)
+        die ("Could not allocate tag dictionary hash.");
+    for (uint32_t i = 0; i < n; i++)
+        packed[i] = ((uint64_t) hashes[i] << 32) | i;
+    qsort(packed, n, sizeof(uint64_t), compare_packed);
+    for (uint32_t i = 0; i < n; i++)
+        hashed[(uint32_t) packed[i]] = i == 0 || (packed[i] >> 32) != (packed[i - 1] >> 32);
+    /* Group the entries by bucket. */
+    for (uint32_t i = 0; i < n; i++)
+        if (hashed[i]) bucket_start[mix(hashes[i], 0) % n_slots + 1]++;
+    uint32_t max_size = 0;
+    for (uint32_t b = 0; b < n_slots; b++) {
+        if (bucket_start[b + 1] > max_size) max_size = bucket_start[b + 1];
+        bucket_start[b + 1] += bucket_start[b];
+    }
+    uint32_t *fill = malloc(n_slots * sizeof(uint32_t));
+    if (fill == NULL) die ("Could not allocate tag dictionary hash.");
+    memcpy(fill, bucket_start, n_slots * sizeof(uint32_t));
+    for (uint32_t i = 0; i < n; i++)
+        if (hashed[i]) members[fill[mix(hashes[i], 0) % n_slots]++] = i;
+    /* Place the largest buckets first, while most slots are still free. */
+    uint32_t wanted[max_size + 1];
+    for (uint32_t size = max_size; size > 0; size--) {
+        for (uint32_t b = 0; b < n_slots; b++) {
+            if (bucket_start[b + 1] - bucket_start[b] != size) continue;
+            uint32_t *entries = &(members[bucket_start[b]]);
+            uint32_t seed, placed = 0;
+            for (seed = 1; placed < size; seed++) {
+                if (seed > UINT16_MAX) die ("Could not find a perfect hash for the tag dictionary.");
+                for (placed = 0; placed < size; placed++) {
+                    uint32_t s = mix(hashes[entries[placed]], seed) % n_slots;
+                    uint32_t j = 0;
+                    while (j < placed && wanted[j] != s) j++;
+                    if (taken[s] || j < placed) break;
+                    wanted[placed] = s;
+                }
+            }
+            seeds[b] = seed - 1;
+            for (uint32_t i = 0; i < size; i++) {
+                taken[wanted[i]] = true;
+                slots[wanted[i]] = entries[i];
+            }
         }
     }
-    return 0; // No code found for this role
+    free(fill);
+    free(taken);
+    free(hashed);
+    free(packed);
+    free(bucket_start);
+    free(members);
+    d->n_slots = n_slots;
+    d->seeds = seeds;
+    d->slots = slots;
 }
 
-char *decode_role (uint8_t code) {
-    return relation_roles[code];
+/* Fill in a dictionary from its entries, working out their lengths and hashing them. */
+static void make_dictionary (Dictionary *d, uint32_t n, char **keys, char **vals) {
+    uint8_t *key_lens = malloc(n + 1);
+    uint8_t *val_lens = vals == NULL ? NULL : malloc(n + 1);
+    uint32_t *hashes = malloc(n * sizeof(uint32_t) + 1);
+    if (key_lens == NULL || hashes == NULL || (vals != NULL && val_lens == NULL))
+        die ("Could not allocate tag dictionary.");
+    for (uint32_t i = 0; i < n; i++) {
+        key_lens[i] = strlen(keys[i]);
+        hashes[i] = fnv(FNV_BASIS, (uint8_t *) keys[i], key_lens[i]);
+        if (vals != NULL) {
+            val_lens[i] = strlen(vals[i]);
+            hashes[i] = pair_hash(hashes[i], (uint8_t *) vals[i], val_lens[i]);
+        }
+    }
+    d->n = n;
+    d->keys = keys;
+    d->vals = vals;
+    d->key_lens = key_lens;
+    d->val_lens = val_lens;
+    build_hash(d, hashes);
+    free(hashes);
 }
 
+/* Externally visible function. The entries point into a private copy of the text. */
+uint32_t tag_dictionary_load (const char *text, size_t size) {
+    char *copy = malloc(size + 1);
+    if (copy == NULL) die ("Could not allocate tag dictionary.");
+    memcpy(copy, text, size);
+    copy[size] = '\0';
+    /* No kind of entry can have more entries than there are lines. */
+    size_t n_lines = 1;
+    for (size_t i = 0; i < size; i++)
+        if (copy[i] == '\n') n_lines++;
+    char **keys = malloc(n_lines * sizeof(char *));
+    char **vals = malloc(n_lines * sizeof(char *));
+    char **free_keys = malloc(n_lines * sizeof(char *));
+    char **role_names = malloc(n_lines * sizeof(char *));
+    if (keys == NULL || vals == NULL || free_keys == NULL || role_names == NULL)
+        die ("Could not allocate tag dictionary.");
+    uint32_t n_pairs = 0, n_keys = 0, n_roles = 0;
+    char *line = copy;
+    for (int number = 1; line < copy + size; number++) {
+        char *end = strchr(line, '\n');
+        if (end == NULL) end = copy + size;
+        *end = '\0';
+        if (end > line && end[-1] == '\r') end[-1] = '\0';
+        char *next = end + 1;
+        /* Anything after a tab is a comment, such as the counts written by vex tagstats. */
+        char *tab = strchr(line, '\t');
+        if (tab != NULL) *tab = '\0';
+        if (*line == '\0' || *line == '#') {
+            line = next;
+            continue;
+        }
+        /* The kind of entry is separated from the entry by the first space. An empty role has none. */
+        char *entry = strchr(line, ' ');
+        if (entry == NULL) entry = line + strlen(line);
+        else *(entry++) = '\0';
+        char *eq = strchr(entry, '=');
+        bool valid = strlen(entry) <= UINT8_MAX;
+        if (strcmp(line, "tag") == 0 && eq != NULL && valid && strlen(eq + 1) <= UINT8_MAX) {
+            *eq = '\0';
+            keys[n_pairs] = entry;
+            vals[n_pairs++] = eq + 1;
+        } else if (strcmp(line, "key") == 0 && valid) {
+            free_keys[n_keys++] = entry;
+        } else if (strcmp(line, "role") == 0 && valid) {
+            role_names[n_roles++] = entry;
+        } else {
+            fprintf(stderr, "tag dictionary line %d: expected 'tag key=value', 'key key' or 'role role'"
+                    " of at most 255 bytes\n", number);
+            exit(EXIT_FAILURE);
+        }
+        line = next;
+    }
+    if (n_pairs > MAX_TAG_PAIRS || n_keys > MAX_FREE_TEXT_KEYS || n_roles > MAX_ROLES)
+        die ("Too many entries in tag dictionary.");
+    make_dictionary(&pair_dict, n_pairs, keys, vals);
+    make_dictionary(&key_dict, n_keys, free_keys, NULL);
+    make_dictionary(&role_dict, n_roles, role_names, NULL);
+    uint32_t h = fnv(FNV_BASIS, (const uint8_t *) text, size);
+    return h == 0 ? 1 : h;
+}
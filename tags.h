@@ -10,10 +10,28 @@ typedef struct {
     char *val;
 } KeyVal;
 
-int8_t encode_tag (ProtobufCBinaryData key, ProtobufCBinaryData val);
+/*
+  Largest dictionaries that can be coded. The first 126 pairs and 64 free-text keys have one-byte
+  codes, the rest have two-byte codes. Role codes are 16 bits wide, with zero for any other role.
+*/
+#define MAX_TAG_PAIRS      (126 + 8192)
+#define MAX_FREE_TEXT_KEYS (64 + 8192)
+#define MAX_ROLES          65535
+
+/* The most bytes a tag code takes up in a stored tag list. */
+#define MAX_TAG_CODE_BYTES 2
+
+int32_t encode_tag (ProtobufCBinaryData key, ProtobufCBinaryData val);
+size_t write_tag_code (int32_t code, uint8_t *buf);
 size_t decode_tag (char *buf, KeyVal *kv);
 
-uint8_t encode_role (ProtobufCBinaryData role);
-char *decode_role (uint8_t code);
+uint16_t encode_role (ProtobufCBinaryData role);
+char *decode_role (uint16_t code);
+
+/*
+  Replace the built-in dictionary with one in the format of tags.txt, held in memory.
+  Returns a nonzero hash of the text, so a database can check it is given the same dictionary again.
+*/
+uint32_t tag_dictionary_load (const char *text, size_t size);
 
 #endif /* TAGS_H_INCLUDED */
@@ -0,0 +1,388 @@
+/* tagstats.c : counts how often tags and roles occur in a PBF file, to choose a tag dictionary. */
+#include "tagstats.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include "pbf.h"
+#include "tags.h"
+#include "tagfilter.h"
+
+/*
+  Every key, key=value pair and role is counted in a hash table, keyed on its kind and its bytes.
+  Each thread reading the file counts into a table of its own, and these are merged at the end.
+  A table is kept within MAX_ENTRIES by periodically discarding its rarest entries, which are
+  mostly names and other free text that would never make it into a dictionary anyway. Each thread
+  prunes its own table, so once any table has been pruned the merged counts depend on how the blocks
+  were shared out among the threads, and entries near the cutoff can differ from run to run.
+  Without pruning, the counts and the dictionary are the same for any number of threads.
+*/
+#define PAIR 0
+#define KEY  1
+#define ROLE 2
+
+#define MAX_ENTRIES (1 << 21) // in each table
+#define MAX_ARENA   (1 << 30)
+
+/* Entries seen fewer times than this in the part of the file read are not worth a code. */
+#define MIN_COUNT 2
+
+typedef struct {
+    uint64_t count;
+    uint64_t bytes;   // bytes taken up by the tags counted, as key=value text with two terminators
+    uint32_t hash;
+    uint32_t offset;  // position of the key, followed by the value for pairs, in the arena
+    uint8_t key_len;  // the key, or the role
+    uint8_t val_len;
+    uint8_t kind;     // PAIR, KEY or ROLE
+} Entry;
+
+typedef struct Table Table;
+struct Table {
+    Entry *entries;
+    uint32_t n_entries, entries_size;
+    uint32_t *slots;    // one more than the index of the entry in each slot, or zero if it is empty
+    uint32_t n_slots;
+    uint8_t *arena;     // the strings of all the entries
+    uint32_t arena_pos, arena_size;
+    uint64_t prune_threshold; // entries counted this many times or fewer were discarded at least once
+    Table *next;
+};
+
+static __thread Table *thread_table = NULL;
+static Table *thread_tables = NULL;
+static pthread_mutex_t thread_tables_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The counts of all threads, once they have been merged. */
+static Table counts;
+static const char *stats_filename;
+
+static void die (const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+static uint32_t hash (uint8_t kind, ProtobufCBinaryData key, ProtobufCBinaryData val) {
+    uint32_t h = 2166136261u ^ kind;
+    for (size_t i = 0; i < key.len; i++) h = (h ^ key.data[i]) * 16777619u;
+    h *= 16777619u; // a zero byte between key and value
+    for (size_t i = 0; i < val.len; i++) h = (h ^ val.data[i]) * 16777619u;
+    return h;
+}
+
+/* Put an entry into the first free slot on its probe sequence. */
+static void table_insert (Table *t, uint32_t e) {
+    uint32_t mask = t->n_slots - 1;
+    uint32_t s = t->entries[e].hash & mask;
+    while (t->slots[s] != 0) s = (s + 1) & mask;
+    t->slots[s] = e + 1;
+}
+
+/* Rebuild the hash table from the entries, at a size that keeps it at most half full. */
+static void rebuild_table (Table *t) {
+    uint32_t size = 1024;
+    while (size < t->n_entries * 2 + 2) size *= 2;
+    if (size != t->n_slots) {
+        free(t->slots);
+        t->slots = malloc(size * sizeof(uint32_t));
+        if (t->slots == NULL) die ("Could not allocate tag statistics table.");
+        t->n_slots = size;
+    }
+    memset(t->slots, 0, t->n_slots * sizeof(uint32_t));
+    for (uint32_t e = 0; e < t->n_entries; e++) table_insert(t, e);
+}
+
+/* Discard the least common entries, raising the threshold until at least half the room is free. */
+static void prune (Table *t) {
+    uint32_t before = t->n_entries;
+    do {
+        t->prune_threshold++;
+        uint32_t kept = 0, pos = 0;
+        for (uint32_t e = 0; e < t->n_entries; e++) {
+            Entry *entry = &(t->entries[e]);
+            if (entry->count <= t->prune_threshold) continue;
+            uint32_t len = entry->key_len + entry->val_len;
+            memmove(t->arena + pos, t->arena + entry->offset, len);
+            entry->offset = pos;
+            pos += len;
+            t->entries[kept++] = *entry;
+        }
+        t->n_entries = kept;
+        t->arena_pos = pos;
+    } while (t->n_entries > MAX_ENTRIES / 2 || t->arena_pos > MAX_ARENA / 2);
+    rebuild_table(t);
+    fprintf(stderr, "Discarded %u tag statistics entries seen %lu times or fewer.\n",
+            before - t->n_entries, (unsigned long) t->prune_threshold);
+}
+
+/* Find an entry, returning NULL if it is not in the table. */
+static Entry *find (Table *t, uint32_t h, uint8_t kind, ProtobufCBinaryData key, ProtobufCBinaryData val) {
+    uint32_t mask = t->n_slots - 1;
+    for (uint32_t s = h & mask; t->n_slots > 0 && t->slots[s] != 0; s = (s + 1) & mask) {
+        Entry *e = &(t->entries[t->slots[s] - 1]);
+        if (e->hash == h && e->kind == kind && e->key_len == key.len && e->val_len == val.len &&
+                memcmp(t->arena + e->offset, key.data, key.len) == 0 &&
+                memcmp(t->arena + e->offset + key.len, val.data, val.len) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+/* Add to the count and bytes of an entry, creating it if necessary. */
+static void add (Table *t, uint8_t kind, ProtobufCBinaryData key, ProtobufCBinaryData val,
+                 uint64_t count, uint64_t bytes) {
+    uint32_t h = hash(kind, key, val);
+    Entry *e = find(t, h, kind, key, val);
+    if (e != NULL) {
+        e->count += count;
+        e->bytes += bytes;
+        return;
+    }
+    if (t->n_entries >= MAX_ENTRIES || t->arena_pos + key.len + val.len > MAX_ARENA) prune(t);
+    if (t->n_entries == t->entries_size) {
+        t->entries_size = t->entries_size == 0 ? 65536 : t->entries_size * 2;
+        t->entries = realloc(t->entries, t->entries_size * sizeof(Entry));
+        if (t->entries == NULL) die ("Could not grow tag statistics entries.");
+    }
+    if (t->arena_pos + key.len + val.len > t->arena_size) {
+        t->arena_size = t->arena_size == 0 ? 1 << 20 : t->arena_size * 2;
+        t->arena = realloc(t->arena, t->arena_size);
+        if (t->arena == NULL) die ("Could not grow tag statistics strings.");
+    }
+    e = &(t->entries[t->n_entries++]);
+    e->count = count;
+    e->bytes = bytes;
+    e->hash = h;
+    e->offset = t->arena_pos;
+    e->key_len = key.len;
+    e->val_len = val.len;
+    e->kind = kind;
+    memcpy(t->arena + t->arena_pos, key.data, key.len);
+    memcpy(t->arena + t->arena_pos + key.len, val.data, val.len);
+    t->arena_pos += key.len + val.len;
+    if (t->n_entries * 2 > t->n_slots) rebuild_table(t);
+    else table_insert(t, t->n_entries - 1);
+}
+
+/* Get the table for the calling thread, creating and registering it the first time. */
+static Table *get_thread_table () {
+    if (thread_table == NULL) {
+        thread_table = calloc(1, sizeof(Table));
+        if (thread_table == NULL) die ("Could not allocate tag statistics table.");
+        pthread_mutex_lock(&thread_tables_mutex);
+        thread_table->next = thread_tables;
+        thread_tables = thread_table;
+        pthread_mutex_unlock(&thread_tables_mutex);
+    }
+    return thread_table;
+}
+
+static void free_table (Table *t) {
+    free(t->entries);
+    free(t->slots);
+    free(t->arena);
+    memset(t, 0, sizeof(Table));
+}
+
+/*
+  Whether a string can be written into a dictionary file: short enough for its length to fit in a
+  byte, on one line, without trailing spaces that would be lost, and not splitting a key from a value.
+*/
+static bool storable (ProtobufCBinaryData s, bool is_key) {
+    if (s.len > UINT8_MAX) return false;
+    if (s.len > 0 && s.data[s.len - 1] == ' ') return false;
+    if (is_key && (s.len == 0 || memchr(s.data, '=', s.len) != NULL)) return false;
+    for (size_t i = 0; i < s.len; i++)
+        if (s.data[i] < ' ') return false;
+    return true;
+}
+
+/* Tags are weighed the same way as in tagstats.py, by their length as key=value text. */
+static void count_tags (uint32_t *keys, uint32_t *vals, size_t n, ProtobufCBinaryData *string_table) {
+    static ProtobufCBinaryData none = { 0, NULL };
+    Table *t = get_thread_table();
+    for (size_t i = 0; i < n; i++) {
+        ProtobufCBinaryData key = string_table[keys[i]];
+        ProtobufCBinaryData val = string_table[vals[i]];
+        if (!storable(key, true)) continue;
+        int verdict = TagFilter_key(key);
+        if (verdict == TAG_DROP) continue;
+        if (verdict == TAG_BY_VALUE && TagFilter_drop_tag(key, val)) continue;
+        uint64_t bytes = key.len + val.len + 2;
+        add(t, KEY, key, none, 1, bytes);
+        if (storable(val, false)) add(t, PAIR, key, val, 1, bytes);
+    }
+}
+
+static void handle_node (OSMPBF__Node *node, ProtobufCBinaryData *string_table) {
+    count_tags(node->keys, node->vals, node->n_keys, string_table);
+}
+
+static void handle_dense_nodes (PbfDenseNodes *dense, ProtobufCBinaryData *string_table) {
+    count_tags(dense->keys, dense->vals, dense->tag_offsets[dense->n_nodes], string_table);
+}
+
+static void handle_way (OSMPBF__Way *way, ProtobufCBinaryData *string_table) {
+    count_tags(way->keys, way->vals, way->n_keys, string_table);
+}
+
+static void handle_relation (OSMPBF__Relation *relation, ProtobufCBinaryData *string_table) {
+    static ProtobufCBinaryData none = { 0, NULL };
+    count_tags(relation->keys, relation->vals, relation->n_keys, string_table);
+    Table *t = get_thread_table();
+    for (size_t m = 0; m < relation->n_roles_sid; m++) {
+        ProtobufCBinaryData role = string_table[relation->roles_sid[m]];
+        if (storable(role, false)) add(t, ROLE, role, none, 1, role.len + 1);
+    }
+}
+
+/* Externally visible function. Nodes and ways are counted on the decoder threads. */
+void TagStats_read (const char *filename, int every) {
+    PbfReadCallbacks callbacks = {
+        .node = &handle_node,
+        .dense_nodes = &handle_dense_nodes,
+        .way = &handle_way,
+        .relation = &handle_relation,
+        .concurrent_nodes = true,
+        .concurrent_ways = true
+    };
+    stats_filename = filename;
+    pbf_read_sample(filename, &callbacks, every);
+    /* Merge the tables of all the threads, freeing each as it is merged. */
+    uint64_t pruned_threshold = 0;
+    for (Table *t = thread_tables, *next; t != NULL; t = next) {
+        if (t->prune_threshold > pruned_threshold) pruned_threshold = t->prune_threshold;
+        for (uint32_t e = 0; e < t->n_entries; e++) {
+            Entry *entry = &(t->entries[e]);
+            ProtobufCBinaryData key = { entry->key_len, t->arena + entry->offset };
+            ProtobufCBinaryData val = { entry->val_len, t->arena + entry->offset + entry->key_len };
+            add(&counts, entry->kind, key, val, entry->count, entry->bytes);
+        }
+        next = t->next;
+        free_table(t);
+        free(t);
+    }
+    if (pruned_threshold > 0)
+        fprintf(stderr, "Counts are approximate, since entries seen up to %lu times by one thread were discarded.\n",
+                (unsigned long) pruned_threshold);
+    thread_tables = NULL;
+    thread_table = NULL;
+    uint64_t totals[3] = { 0, 0, 0 }, distinct[3] = { 0, 0, 0 };
+    for (uint32_t e = 0; e < counts.n_entries; e++) {
+        totals[counts.entries[e].kind] += counts.entries[e].count;
+        distinct[counts.entries[e].kind]++;
+    }
+    fprintf(stderr, "Counted %lu tags with %lu distinct keys and %lu distinct pairs, "
+            "and %lu roles with %lu distinct values.\n", (unsigned long) totals[KEY],
+            (unsigned long) distinct[KEY], (unsigned long) distinct[PAIR],
+            (unsigned long) totals[ROLE], (unsigned long) distinct[ROLE]);
+}
+
+/* A candidate dictionary entry, with the number of bytes its code would save. */
+typedef struct {
+    uint64_t weight;
+    uint64_t count;
+    uint32_t entry;
+} Candidate;
+
+/* Sort order: heaviest first, breaking ties on the strings so the result does not depend on reading order. */
+static int compare_weight (const void *a, const void *b) {
+    const Candidate *x = a, *y = b;
+    if (x->weight != y->weight) return x->weight < y->weight ? 1 : -1;
+    const Entry *ex = &(counts.entries[x->entry]), *ey = &(counts.entries[y->entry]);
+    int c = memcmp(counts.arena + ex->offset, counts.arena + ey->offset,
+                   ex->key_len + ex->val_len < ey->key_len + ey->val_len ?
+                   ex->key_len + ex->val_len : ey->key_len + ey->val_len);
+    if (c != 0) return c;
+    if (ex->key_len != ey->key_len) return ex->key_len < ey->key_len ? -1 : 1;
+    return ex->val_len < ey->val_len ? -1 : ex->val_len > ey->val_len;
+}
+
+/* Sort order: most common first, so the most common entries get the shortest codes. */
+static int compare_count (const void *a, const void *b) {
+    const Candidate *x = a, *y = b;
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    return compare_weight(a, b);
+}
+
+/*
+  Rank the candidates by weight, keep at most max of them, and put those in order of frequency.
+  Returns the number kept.
+*/
+static size_t select_candidates (Candidate *candidates, size_t n, size_t max) {
+    qsort(candidates, n, sizeof(Candidate), compare_weight);
+    if (n > max) n = max;
+    qsort(candidates, n, sizeof(Candidate), compare_count);
+    return n;
+}
+
+/* Write one line of the dictionary, with the count and bytes of the entry after a tab. */
+static void write_entry (FILE *out, const char *kind, Entry *entry, uint64_t count) {
+    uint8_t *s = counts.arena + entry->offset;
+    if (entry->kind == PAIR)
+        fprintf(out, "%s %.*s=%.*s", kind, entry->key_len, s, entry->val_len, s + entry->key_len);
+    else if (entry->key_len == 0)
+        fprintf(out, "%s", kind); // the empty role
+    else
+        fprintf(out, "%s %.*s", kind, entry->key_len, s);
+    fprintf(out, "\t%lu\t%lu\n", (unsigned long) count, (unsigned long) entry->bytes);
+}
+
+/* Externally visible function. */
+void TagStats_write_dictionary (FILE *out) {
+    static ProtobufCBinaryData none = { 0, NULL };
+    uint32_t n_entries = counts.n_entries;
+    Candidate *pairs = malloc((n_entries + 1) * sizeof(Candidate));
+    Candidate *keys = malloc((n_entries + 1) * sizeof(Candidate));
+    Candidate *roles = malloc((n_entries + 1) * sizeof(Candidate));
+    uint64_t *uncoded = malloc((n_entries + 1) * sizeof(uint64_t)); // tags of each key not given pair codes
+    if (pairs == NULL || keys == NULL || roles == NULL || uncoded == NULL)
+        die ("Could not allocate tag dictionary candidates.");
+    /* A pair code replaces the key, the value and their terminators, less the code itself. */
+    size_t n_pairs = 0, n_keys = 0, n_roles = 0;
+    for (uint32_t e = 0; e < n_entries; e++) {
+        Entry *entry = &(counts.entries[e]);
+        uncoded[e] = entry->count;
+        if (entry->kind == PAIR && entry->count >= MIN_COUNT)
+            pairs[n_pairs++] = (Candidate) { entry->count * (entry->key_len + entry->val_len + 1), entry->count, e };
+        else if (entry->kind == ROLE && entry->count >= MIN_COUNT)
+            roles[n_roles++] = (Candidate) { entry->count, entry->count, e };
+    }
+    n_pairs = select_candidates(pairs, n_pairs, MAX_TAG_PAIRS);
+    n_roles = select_candidates(roles, n_roles, MAX_ROLES);
+    /* A free-text key code replaces the key and its terminator, on the tags not given a pair code. */
+    for (size_t p = 0; p < n_pairs; p++) {
+        Entry *pair = &(counts.entries[pairs[p].entry]);
+        ProtobufCBinaryData key = { pair->key_len, counts.arena + pair->offset };
+        Entry *key_entry = find(&counts, hash(KEY, key, none), KEY, key, none);
+        if (key_entry != NULL) uncoded[key_entry - counts.entries] -= pairs[p].count;
+    }
+    for (uint32_t e = 0; e < n_entries; e++) {
+        Entry *entry = &(counts.entries[e]);
+        if (entry->kind == KEY && uncoded[e] >= MIN_COUNT)
+            keys[n_keys++] = (Candidate) { uncoded[e] * entry->key_len, uncoded[e], e };
+    }
+    n_keys = select_candidates(keys, n_keys, MAX_FREE_TEXT_KEYS);
+    fprintf(out, "# Tag dictionary learned by vex from %s.\n", stats_filename);
+    fprintf(out, "# Each entry is followed by the number of times it was seen and the bytes its tags took up\n");
+    fprintf(out, "# as text. The count of a key leaves out its tags coded as pairs, the bytes include them.\n");
+    for (size_t p = 0; p < n_pairs; p++)
+        write_entry(out, "tag", &(counts.entries[pairs[p].entry]), pairs[p].count);
+    for (size_t k = 0; k < n_keys; k++)
+        write_entry(out, "key", &(counts.entries[keys[k].entry]), keys[k].count);
+    for (size_t r = 0; r < n_roles; r++)
+        write_entry(out, "role", &(counts.entries[roles[r].entry]), roles[r].count);
+    fprintf(stderr, "Chose %zu pairs, %zu free-text keys and %zu roles for the tag dictionary.\n",
+            n_pairs, n_keys, n_roles);
+    free(pairs);
+    free(keys);
+    free(roles);
+    free(uncoded);
+}
+
+/* Externally visible function. */
+void TagStats_clear () {
+    free_table(&counts);
+}
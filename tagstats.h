@@ -0,0 +1,16 @@
+/* tagstats.h : counts how often tags and roles occur in a PBF file, to choose a tag dictionary. */
+#ifndef TAGSTATS_H_INCLUDED
+#define TAGSTATS_H_INCLUDED
+
+#include <stdio.h>
+
+/* Count the tags and relation member roles in every nth block of a PBF file, as the tag filter allows. */
+void TagStats_read (const char *filename, int every);
+
+/* Write out the most valuable entries as a tag dictionary, in the same format as tags.txt. */
+void TagStats_write_dictionary (FILE *out);
+
+/* Free the counts. */
+void TagStats_clear ();
+
+#endif /* TAGSTATS_H_INCLUDED */
@@ -0,0 +1,96 @@
+#!/usr/bin/python3
+
+# Write a small OSM PBF file for the tests, from a Python file defining nodes, ways and relations.
+# Usage: mkpbf.py output.pbf elements.py
+#
+#   nodes = [(id, lat, lon, {tags}), ...]
+#   ways = [(id, [node ids], {tags}), ...]
+#   relations = [(id, [('n'|'w'|'r', member id, role), ...], {tags}), ...]
+#
+# Tags are optional. Each element type goes in one block, in the order nodes, ways, relations.
+
+import struct, sys, zlib
+
+def varint(v):
+    out = bytearray()
+    while True:
+        b = v & 0x7f
+        v >>= 7
+        if v == 0:
+            out.append(b)
+            return bytes(out)
+        out.append(b | 0x80)
+
+def zigzag(v):
+    return (v << 1) ^ (v >> 63)
+
+def number(field, v):
+    return varint(field << 3) + varint(v & 0xffffffffffffffff)
+
+def delimited(field, data):
+    return varint(field << 3 | 2) + varint(len(data)) + data
+
+def packed(field, values):
+    return delimited(field, b''.join(varint(v & 0xffffffffffffffff) for v in values))
+
+def deltas(values):
+    last, out = 0, []
+    for v in values:
+        out.append(zigzag(v - last))
+        last = v
+    return out
+
+class StringTable:
+    def __init__(self):
+        self.strings = [b'']
+        self.index = {b'': 0}
+    def __call__(self, text):
+        b = text.encode()
+        if b not in self.index:
+            self.index[b] = len(self.strings)
+            self.strings.append(b)
+        return self.index[b]
+    def encode(self):
+        return delimited(1, b''.join(delimited(1, s) for s in self.strings))
+
+def tags(st, element, position):
+    t = element[position] if len(element) > position else {}
+    if not t:
+        return b''
+    return packed(2, [st(k) for k in t]) + packed(3, [st(v) for v in t.values()])
+
+def node(st, n):
+    # Coordinates in units of 100 nanodegrees, the default granularity.
+    return (number(1, zigzag(n[0])) + tags(st, n, 3) +
+            number(8, zigzag(round(n[1] * 1e7))) + number(9, zigzag(round(n[2] * 1e7))))
+
+def way(st, w):
+    return number(1, w[0]) + tags(st, w, 2) + packed(8, deltas(w[1]))
+
+MEMBER_TYPES = {'n': 0, 'w': 1, 'r': 2}
+
+def relation(st, r):
+    members = r[1]
+    return (number(1, r[0]) + tags(st, r, 2) + packed(8, [st(m[2]) for m in members]) +
+            packed(9, deltas([m[1] for m in members])) + packed(10, [MEMBER_TYPES[m[0]] for m in members]))
+
+def blob(kind, payload):
+    data = delimited(3, zlib.compress(payload)) + number(2, len(payload))
+    header = delimited(1, kind.encode()) + number(3, len(data))
+    return struct.pack('>I', len(header)) + header + data
+
+def block(group_field, encode, elements):
+    st = StringTable()
+    group = b''.join(delimited(group_field, encode(st, e)) for e in elements)
+    return blob('OSMData', st.encode() + delimited(2, group))
+
+spec = {}
+exec(open(sys.argv[2]).read(), spec)
+with open(sys.argv[1], 'wb') as out:
+    out.write(blob('OSMHeader', delimited(4, b'OsmSchema-V0.6')))
+    if spec.get('nodes'):
+        out.write(block(1, node, spec['nodes']))
+    if spec.get('ways'):
+        out.write(block(3, way, spec['ways']))
+    if spec.get('relations'):
+        out.write(block(4, relation, spec['relations']))
@@ -0,0 +1,127 @@
+#!/bin/bash
+
+# Load small generated inputs into scratch databases and check what vex makes of them.
+# Usage: tests/run-tests.sh [path/to/vex]   (run by make check)
+
+VEX=$(realpath "${1:-./vex}")
+TESTS=$(dirname "$(realpath "$0")")
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+failures=0
+
+fail () {
+    echo "FAIL $current: $1"
+    failures=$((failures + 1))
+}
+
+# Write a PBF file from the element lists given on standard input (see mkpbf.py).
+pbf () {
+    cat > "$WORK/$1.py"
+    python3 "$TESTS/mkpbf.py" "$WORK/$1" "$WORK/$1.py" || fail "could not write $1"
+}
+
+# Run vex with its messages going to a log, failing the test if it does not succeed.
+vex () {
+    "$VEX" "$@" >> "$WORK/out" 2>> "$WORK/log" || fail "vex $* exited with status $?"
+}
+
+# Start a test with a new empty database directory.
+begin () {
+    current=$1
+    rm -rf "$WORK/db" "$WORK/out" "$WORK/log"
+    mkdir "$WORK/db"
+}
+
+# Element zero of the node, way and node ref files is read before anything has been stored, when a
+# relation's first member is a way that was not loaded or a way's nodes were not loaded.
+begin load_without_ways
+pbf in.pbf <<'END'
+nodes = [(1, 51.50, 0.10), (2, 51.51, 0.11)]
+relations = [(20, [('w', 10, 'outer'), ('n', 1, '')], {'type': 'multipolygon'})]
+END
+vex "$WORK/db" "$WORK/in.pbf"
+vex "$WORK/db" 51 0 52 1 "$WORK/out.pbf"
+
+begin load_ways_only
+pbf in.pbf <<'END'
+ways = [(10, [1, 2, 3], {'highway': 'residential'})]
+END
+vex "$WORK/db" "$WORK/in.pbf"
+vex "$WORK/db" 0 0 1 1 "$WORK/out.pbf"
+
+# Check the answer of changed-since for a generation and bounding box.
+expect_changed () {
+    local answer
+    answer=$("$VEX" "$WORK/db" changed-since "$2" "${@:3}" 2>> "$WORK/log")
+    [ "${answer%% *}" = "$1" ] || fail "changed-since $2 ${*:3} answered '$answer', expected $1"
+}
+
+# Get the current generation of the database, as changed-since prints it.
+generation () {
+    local answer
+    answer=$("$VEX" "$WORK/db" changed-since 0.0 0 0 1 1 2>> "$WORK/log")
+    echo "${answer##* }"
+}
+
+begin changed_since_reload
+pbf in.pbf <<'END'
+nodes = [(1, 51.50, 0.10, {'name': 'a'}), (2, 51.51, 0.11), (3, 48.85, 2.35), (4, 48.86, 2.36)]
+ways = [(10, [1, 2], {'highway': 'residential'}), (11, [3, 4])]
+END
+cat > "$WORK/change.osc" <<'END'
+<?xml version='1.0' encoding='UTF-8'?>
+<osmChange version="0.6">
+<modify>
+  <node id="1" version="2" lat="51.505" lon="0.105"><tag k="name" v="moved"/></node>
+</modify>
+</osmChange>
+END
+vex "$WORK/db" "$WORK/in.pbf"
+loaded=$(generation)
+vex "$WORK/db" apply "$WORK/change.osc"
+updated=$(generation)
+[ "$updated" != "$loaded" ] || fail "the update did not change the generation $loaded"
+expect_changed changed "$loaded" 51 0.05 52 0.5
+expect_changed unchanged "$loaded" 48 2 49 3
+expect_changed unchanged "$updated" 51 0.05 52 0.5
+# A new import, into the same directory or after deleting it, replaces everything.
+vex "$WORK/db" "$WORK/in.pbf"
+expect_changed changed "$updated" 48 2 49 3
+rm -rf "$WORK/db" && mkdir "$WORK/db"
+vex "$WORK/db" "$WORK/in.pbf"
+expect_changed changed "$updated" 48 2 49 3
+expect_changed unchanged "$(generation)" 48 2 49 3
+
+# Moving a node changes the extracts of boxes holding the start of its ways, however far away, and
+# keeps doing so after it has moved once.
+begin changed_since_way_nodes
+pbf in.pbf <<'END'
+nodes = [(1, 51.50, 0.10), (2, 51.90, 0.90), (3, 48.85, 2.35), (4, 48.86, 2.36)]
+ways = [(10, [1, 2], {'highway': 'residential'}), (11, [3, 4])]
+END
+for step in 1 2; do
+    cat > "$WORK/change$step.osc" <<END
+<?xml version='1.0' encoding='UTF-8'?>
+<osmChange version="0.6">
+<modify>
+  <node id="2" version="$((step + 1))" lat="51.9$((step * 4))" lon="0.9$((step * 4))"/>
+</modify>
+</osmChange>
+END
+done
+vex "$WORK/db" "$WORK/in.pbf"
+loaded=$(generation)
+vex "$WORK/db" apply "$WORK/change1.osc"
+moved=$(generation)
+expect_changed changed "$loaded" 51.49 0.09 51.51 0.11
+expect_changed unchanged "$loaded" 48 2 49 3
+vex "$WORK/db" apply "$WORK/change2.osc"
+expect_changed changed "$moved" 51.49 0.09 51.51 0.11
+expect_changed unchanged "$moved" 48 2 49 3
+
+if [ $failures -gt 0 ]; then
+    echo "$failures checks failed, last log:"
+    cat "$WORK/log"
+    exit 1
+fi
+echo "All tests passed."
@@ -1,5 +1,7 @@
 /* vex.c : vanilla-extract main */
 
+#define _GNU_SOURCE // for sync_file_range
+
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/file.h>
@@ -8,15 +10,24 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <stdbool.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#include <inttypes.h>
 #include <google/protobuf-c/protobuf-c.h> // contains varint functions
 #include "intpack.h"
 #include "pbf.h"
 #include "tags.h"
+#include "tagfilter.h"
+#include "tagstats.h"
 #include "idtracker.h"
+#include "iddir.h"
+#include "mempolicy.h"
+#include "osc.h"
 
 // 14 bits -> 1.7km at 45 degrees
 // 13 bits -> 3.4km at 45 degrees
@@ -29,24 +40,46 @@
 /*
   https://taginfo.openstreetmap.org/reports/database_statistics
   There are over 10 times as many nodes as ways in OSM.
+  Nodes and ways are stored by dense internal ID (see iddir.c), so the highest OSM IDs only limit
+  the size of the sparse ID directories, while the number of live nodes and ways limits the arrays.
+  Way IDs are kept in the grid as 32-bit ints. The database files grow as they are written, so these
+  limits only reserve address space (see map_arena).
 */
-#define MAX_NODE_ID   4000000000
-#define MAX_WAY_ID     400000000
-#define MAX_REL_MEMBERS 40000000
-#define MAX_REL_ID       4000000
+#define MAX_NODE_ID  (1LL << 36)
+#define MAX_WAY_ID   INT32_MAX
+#define MAX_NODES    4000000000
+#define MAX_WAYS     MAX_WAY_ID
+#define MAX_REL_MEMBERS  INT32_MAX
+#define MAX_REL_ID       INT32_MAX
+
+/* Assume there are as many active node references as there are live nodes. */
+#define MAX_NODE_REFS MAX_NODES
 
-/* Assume there are as many active node references as there are active and deleted nodes. */
-#define MAX_NODE_REFS MAX_NODE_ID
+/*
+  Each way's list of node refs is packed into the node_refs file starting on a multiple of this many
+  bytes, so a 32-bit offset counting these units can address 16GB of packed refs.
+*/
+#define NODE_REF_UNIT 4
+#define MAX_NODE_REF_UNITS UINT32_MAX
 
 /* Way reference block size is based on the typical number of ways per grid cell. */
 #define WAY_BLOCK_SIZE 32
 
-/* Assume one-fifth as many blocks as cells in the grid. Observed number is ~15000000 blocks. */
-#define MAX_WAY_BLOCKS (GRID_DIM * GRID_DIM / 5)
+/* Way blocks are numbered with 32-bit ints. Observed number is ~15000000 blocks. */
+#define MAX_WAY_BLOCKS INT32_MAX
 
 /* If true, then loaded file should not be persisted to disk. */
 static bool in_memory;
 
+/* Whether database files are only read, as they are by queries (see map_arena). */
+static bool read_only = false;
+
+/* Whether read-only mappings of the files holding elements are paged in as soon as they are made. */
+static bool populate = false;
+
+/* If true, we are continuing an interrupted load, and elements may be seen for a second time. */
+static bool resuming;
+
 /*
   Define the sequence in which elements are read and written, while allowing element types as
   function parameters and array indexes.
@@ -91,23 +124,20 @@ typedef struct {
 } WayBlock;
 
 /*
-  A single OSM node. An array of 2^64 these serves as a map from node ids to nodes.
-  OSM assigns node IDs sequentially, so you only need about the first 2^32 entries as of 2014.
-  Note that when nodes are deleted their IDs are not reused, so there are holes in
-  this range, but sparse file support in the filesystem should take care of that.
+  A single OSM node. Nodes are stored in an array indexed by internal ID, found through node_dir.
+  OSM assigns node IDs sequentially, but when nodes are deleted their IDs are not reused:
   "Deleted node ids must not be reused, unless a former node is now undeleted."
+  Indexing by OSM ID left holes in the array wherever nodes had been deleted, so the directory
+  hands out internal IDs that follow on without holes.
 */
 typedef struct {
     coord_t coord; // compact internal representation of latitude and longitude
     uint32_t tags; // byte offset into the packed tags array where this node's tag list begins
 } Node;
 
-/*
-  A single OSM way. Like nodes, way IDs are assigned sequentially, so a zero-indexed array of these
-  serves as a map from way IDs to ways.
-*/
+/* A single OSM way. Like nodes, ways are stored by internal ID, found through way_dir. */
 typedef struct {
-    uint32_t node_ref_offset; // the index of the first node in this way's node list
+    uint32_t node_ref_offset; // where this way's packed node list begins, in NODE_REF_UNITs
     uint32_t tags; // byte offset into the packed tags array where this node's tag list begins
 } Way;
 
@@ -133,11 +163,12 @@ typedef struct {
   Initially this was a multi-level grid, but it turns out to work fine as a single level.
   Rather than being directly composed of way reference blocks, there is a level of indirection
   because the grid is mostly empty due to ocean and wilderness. 
+  The cells are stored in Morton (Z-curve) order rather than row by row, see cell_index.
   TODO eliminate coastlines etc.
   TODO struct is no longer necessary because this is not a compound type.
 */
 typedef struct {
-    GridCell cells[GRID_DIM][GRID_DIM]; // contains indexes to way_blocks and relations
+    GridCell cells[GRID_DIM * GRID_DIM]; // contains indexes to way_blocks and relations
 } Grid;
 
 /* File descriptor for the lockfile. */
@@ -199,6 +230,39 @@ static char *make_db_path (const char *name, uint32_t subfile) {
     return path_buf;
 }
 
+/*
+  A memory-mapped database file that grows as it is written. Address space is reserved for the
+  largest size the file may ever reach, but the file itself is only extended, in large steps, as
+  data is written to it, so a small load leaves small files and nothing needs to be re-mapped or
+  moved while loader threads hold pointers into the mapping.
+*/
+typedef struct {
+    void *base;
+    size_t reserved;  // size of the address space reserved for the file, the most it can grow to
+    size_t size;      // current length of the file
+    size_t page;      // the file's length is kept a multiple of this, the size of a hugetlbfs page
+    int fd;
+    int kind;         // one of the ARENA_ constants
+    uint64_t written; // the length of the front of the file whose writeback has been started (see writeback_arena)
+    char name[32];
+} Arena;
+
+/* How the file of an arena is extended. */
+#define ARENA_FIXED  0 // the file is given its full size as soon as it is mapped, as a sparse file
+#define ARENA_SPARSE 1 // the file is extended as it is written, leaving holes where it is not
+#define ARENA_DENSE  2 // the file is extended as it is written, with its disk space allocated up front
+
+/* Arenas grow by at least this much, or an eighth of their size once that is larger. */
+#define ARENA_GROWTH (64 << 20)
+
+/* Every arena made by map_arena, so they can all be flushed to disk when taking a checkpoint. */
+#define MAX_MAPPINGS 64
+static Arena arenas[MAX_MAPPINGS];
+static int n_arenas = 0;
+
+/* Serializes growing arenas, since several loader threads may need one to grow at once. */
+static pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /*
   Map a file in the database directory into memory, letting the OS handle paging.
   Note that we cannot reliably re-map a file to the same memory address, so the files should not
@@ -206,35 +270,176 @@ static char *make_db_path (const char *name, uint32_t subfile) {
   wide. We map one file per OSM object type.
 
   Mmap will happily map a zero-length file to a nonzero-length block of memory, but a bus error
-  will occur when you try to write to the memory.
-
-  It is tricky to expand the mapped region on demand you'd need to trap the bus error.
-  Instead we reserve enough address space for the maximum size we ever expect the file to reach.
-  Linux provides the mremap() system call for expanding or shrinking the size of a given mapping.
+  will occur when you try to touch the memory past the end of the file. So we reserve enough address
+  space for the maximum size we ever expect the file to reach, and extend the file before writing
+  past its end (see arena_ensure). Linux provides the mremap() system call for expanding a mapping,
+  but it may move the mapping, which would pull it out from under the other loader threads.
   msync() flushes the changes in memory to disk.
 
   The ext3 and ext4 filesystems understand "holes" via the sparse files mechanism:
   http://en.wikipedia.org/wiki/Sparse_file#Sparse_files_in_Unix
   Creating 100GB of empty file by calling truncate() does not increase the disk usage.
   The files appear to have their full size using 'ls', but 'du' reveals that no blocks are in use.
+
+  Queries open the files read-only and map only as much of each file as it holds, which is quicker
+  than reserving the whole range and cannot change the database by accident. A file that is still
+  empty is given a page of zeros instead, since mmap will not map zero bytes. Small databases can
+  be paged in at once with populate, leaving out the sparse indexes, which are mostly holes.
+
+  An in-memory database may be kept in a hugetlbfs directory instead of POSIX shared memory (see
+  mempolicy.c). Those files can only be sized in whole huge pages, and are mapped without reserving
+  huge pages for the whole address range, which would exhaust the pool at once.
 */
-void *map_file(const char *name, uint32_t subfile, size_t size) {
+static Arena *map_arena (const char *name, uint32_t subfile, size_t reserve, int kind) {
     make_db_path (name, subfile);
     int fd;
-    if (in_memory) {
-        fprintf(stderr, "Opening shared memory object '%s' of size %sB.\n", path_buf, human(size));
-        fd = shm_open(path_buf, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    int open_flags = read_only ? O_RDONLY : O_RDWR | O_CREAT;
+    int prot = read_only ? PROT_READ : PROT_READ | PROT_WRITE;
+    int flags = MAP_SHARED;
+    size_t page = 1;
+    const char *what;
+    const char *hugetlb_dir = MemPolicy_hugetlb_dir ();
+    if (in_memory && hugetlb_dir != NULL) {
+        char name_buf[sizeof(path_buf)];
+        strcpy (name_buf, path_buf);
+        if (snprintf (path_buf, sizeof(path_buf), "%s/%s", hugetlb_dir, name_buf) >= sizeof(path_buf))
+            die ("Name too long.");
+        page = MemPolicy_page_size ();
+        reserve = (reserve + page - 1) / page * page;
+        flags |= MAP_NORESERVE;
+        what = "Opening huge page file";
+        fd = open(path_buf, open_flags, S_IRUSR | S_IWUSR);
+    } else if (in_memory) {
+        what = "Opening shared memory object";
+        fd = shm_open(path_buf, open_flags, S_IRUSR | S_IWUSR);
     } else {
-        fprintf(stderr, "Mapping file '%s' of size %sB.\n", path_buf, human(size));
+        what = "Mapping file";
         // including O_TRUNC causes much slower write (swaps pages in?)
-        fd = open(path_buf, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+        fd = open(path_buf, open_flags, S_IRUSR | S_IWUSR);
+    }
+    if (fd < 0) die ("Could not open database file.");
+    struct stat st;
+    if (fstat (fd, &st) != 0) die ("Could not stat database file.");
+    if (read_only) {
+        reserve = st.st_size;
+        if (populate && kind != ARENA_FIXED) flags |= MAP_POPULATE;
+    }
+    fprintf(stderr, "%s '%s', %s %sB.\n", what, path_buf, read_only ? "read-only" : "reserving", human(reserve));
+    void *base;
+    if (reserve == 0) {
+        reserve = sysconf (_SC_PAGESIZE);
+        base = mmap(NULL, reserve, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    } else {
+        base = mmap(NULL, reserve, prot, flags, fd, 0);
     }
-    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     if (base == MAP_FAILED)
         die("Could not memory map file.");
-    if (ftruncate (fd, size - 1)) // resize file
-        die ("Error resizing file.");
-    return base;
+    MemPolicy_apply (name, base, reserve);
+    size_t size = read_only ? reserve : st.st_size;
+    if (kind == ARENA_FIXED && size < reserve && !read_only) {
+        if (ftruncate (fd, reserve)) // resize file
+            die ("Error resizing file.");
+        size = reserve;
+    }
+    pthread_mutex_lock(&arena_mutex);
+    if (n_arenas == MAX_MAPPINGS)
+        die ("More files are mapped than expected.");
+    Arena *a = &(arenas[n_arenas++]);
+    pthread_mutex_unlock(&arena_mutex);
+    a->base = base;
+    a->reserved = reserve;
+    a->size = size;
+    a->page = page;
+    a->fd = fd;
+    a->kind = kind;
+    a->written = 0;
+    snprintf (a->name, sizeof(a->name), "%s", name);
+    return a;
+}
+
+/* Map a file that is given its full size at once. Used for the grid and other sparse indexes. */
+void *map_file(const char *name, uint32_t subfile, size_t size) {
+    return map_arena (name, subfile, size, ARENA_FIXED)->base;
+}
+
+/* Extend the file of an arena so it reaches at least the given byte offset. */
+static void arena_grow (Arena *a, uint64_t end) {
+    if (end > a->reserved) die ("A database file has outgrown the address space reserved for it.");
+    pthread_mutex_lock(&arena_mutex);
+    if (end > a->size) {
+        size_t step = a->size / 8 > ARENA_GROWTH ? a->size / 8 : ARENA_GROWTH;
+        size_t new_size = a->size + step;
+        if (new_size < end) new_size = (end + ARENA_GROWTH - 1) / ARENA_GROWTH * ARENA_GROWTH;
+        new_size = (new_size + a->page - 1) / a->page * a->page;
+        if (new_size > a->reserved) new_size = a->reserved;
+        if (a->kind == ARENA_DENSE) {
+            if (posix_fallocate (a->fd, a->size, new_size - a->size) != 0)
+                die ("Could not allocate space for a database file.");
+        } else if (ftruncate (a->fd, new_size) != 0) {
+            die ("Error resizing file.");
+        }
+        __atomic_store_n (&(a->size), new_size, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&arena_mutex);
+}
+
+/* Make sure the file of an arena reaches at least the given byte offset before writing below it. */
+static inline void arena_ensure (Arena *a, uint64_t end) {
+    if (end > __atomic_load_n (&(a->size), __ATOMIC_ACQUIRE)) arena_grow (a, end);
+}
+
+/* Flush all mapped files to disk, returning once the data is written. */
+static void sync_mappings () {
+    for (int m = 0; m < n_arenas; m++) {
+        if (msync (arenas[m].base, arenas[m].size, MS_SYNC) != 0)
+            die ("Could not flush mapped file to disk.");
+    }
+}
+
+/* Loaded data is written back to disk in windows of this size as the load moves past them. */
+#define WRITEBACK_WINDOW (64 << 20)
+
+/* Whether the loader writes its data back steadily and drops it from the page cache (see writeback_arena). */
+static bool steady_writeback = false;
+static pthread_mutex_t writeback_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Drop part of a mapped file from memory, once it is on disk. The data is read back if it is touched again. */
+static void release_range (Arena *a, uint64_t offset, uint64_t length) {
+    madvise ((uint8_t *) a->base + offset, length, MADV_DONTNEED);
+    posix_fadvise (a->fd, offset, length, POSIX_FADV_DONTNEED);
+}
+
+/*
+  Left to itself, the kernel lets gigabytes of pages dirtied through the mappings pile up, then
+  writes them out in bursts that stall the loader threads for seconds, and leaves a long flush for
+  the end of the load. For an arena that is filled from front to back up to the given end, this
+  starts writing out each window once the load is a window past it, then waits for the window
+  before that to reach the disk. This keeps the load to the rate the disk can take, and the amount
+  of dirty data to a few windows. The windows of arrays that the load does not read again are then
+  dropped from the page cache, leaving that memory to other work on the host.
+*/
+static void writeback_arena (Arena *a, uint64_t end, bool drop) {
+    if (a == NULL || end < 2 * WRITEBACK_WINDOW) return;
+    uint64_t limit = (end / WRITEBACK_WINDOW - 1) * WRITEBACK_WINDOW; // leave the window being written
+    for (uint64_t w = a->written; w < limit; w += WRITEBACK_WINDOW) {
+        sync_file_range (a->fd, w, WRITEBACK_WINDOW, SYNC_FILE_RANGE_WRITE);
+        if (w < WRITEBACK_WINDOW) continue;
+        uint64_t prev = w - WRITEBACK_WINDOW;
+        sync_file_range (a->fd, prev, WRITEBACK_WINDOW,
+                         SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        if (drop) release_range (a, prev, WRITEBACK_WINDOW);
+    }
+    if (limit > a->written) a->written = limit;
+}
+
+/* Drop every mapped file from the page cache once it has been synced, at the end of a load. */
+static void release_mappings () {
+    for (int m = 0; m < n_arenas; m++) release_range (&(arenas[m]), 0, arenas[m].size);
+}
+
+/* Print the page size each mapped file actually got, showing whether the huge page and NUMA options took effect. */
+static void report_mappings () {
+    for (int m = 0; m < n_arenas; m++) MemPolicy_report (arenas[m].name, arenas[m].base);
 }
 
 /* Open a buffered append FILE in the current working directory, performing some checks. */
@@ -252,9 +457,11 @@ Way       *ways;
 WayBlock  *way_blocks;
 Relation  *relations;
 RelMember *rel_members;
-int64_t   *node_refs;        // A negative node_ref marks the end of a list of refs.
+uint8_t   *node_refs;        // Packed lists of node refs, see node_refs_open.
+/* The arenas holding the arrays that grow as they are loaded. */
+static Arena *nodes_arena, *ways_arena, *way_blocks_arena, *relations_arena, *rel_members_arena, *node_refs_arena;
 uint32_t  n_rel_members = 1; // The number of relation members currently used. start at 1 since zero marks the end of lists.
-uint32_t  n_node_refs = 0;   // The number of node refs currently used.
+uint32_t  n_node_refs = 1;   // The number of NODE_REF_UNITs of node_refs currently used. Unit zero is an empty list.
 // FIXME n_node_refs will eventually overflow. The fact that it's unsigned gives us a little slack.
 // FIXME the n_vars were not initialized before?
 
@@ -269,31 +476,229 @@ static uint32_t new_way_block() {
         fprintf(stderr, "%dk way blocks in use out of %dk.\n", way_block_count/1000, MAX_WAY_BLOCKS/1000);
     if (way_block_count >= MAX_WAY_BLOCKS)
         die("More way reference blocks are used than expected.");
+    arena_ensure (way_blocks_arena, (way_block_count + 1) * sizeof(WayBlock));
     // A negative value in the last ref entry gives the number of free slots in this block.
     way_blocks[way_block_count].refs[WAY_BLOCK_SIZE-1] = -WAY_BLOCK_SIZE;
     // fprintf(stderr, "created way block %d\n", way_block_count);
     return way_block_count++;
 }
 
+/*
+  After loading, the way index can be compacted into one sorted run of way IDs per grid cell in the
+  cell_ways array, found through the cell_offsets array. Each run begins with its length, and offset
+  zero means a cell has no run, so the offsets file stays sparse over empty parts of the grid.
+  Ways added to the grid after compaction still go into way blocks. Blocks numbered below
+  compacted_way_blocks have been folded into the runs, so they are no longer part of any list.
+  The runs are kept in one of two sets of files, so a new set can be built beside the one in use.
+*/
+#define MAX_CELL_WAYS (2 * (uint64_t) MAX_WAYS) // every way, plus the length of each non-empty cell
+uint32_t *cell_offsets = NULL;
+int32_t  *cell_ways = NULL;
+uint32_t cell_index_slot = 0;      // which set of run files is in use (1 or 2), or zero if none
+uint64_t n_cell_ways = 0;          // the number of entries used in cell_ways
+uint32_t compacted_way_blocks = 0; // the number of way blocks allocated when the index was compacted
+
+/*
+  Compaction can also copy the nodes used by the ways in each cell's run into cell_nodes, grouped by
+  cell, so the NODE stage of an extract reads them sequentially instead of from all over the nodes
+  file. Each cell's nodes are a count followed by one record per node in ID order: the difference
+  from the previous ID, the position relative to the cell's lowest corner and the tag offset, all as
+  varints. Nodes used by ways in several cells are copied into each of them. cell_node_offsets gives
+  where each cell's nodes begin, with zero for none.
+*/
+#define MAX_CELL_NODE_BYTES (16 * (uint64_t) MAX_NODE_REFS)
+uint64_t *cell_node_offsets = NULL;
+uint8_t  *cell_nodes = NULL;
+uint64_t n_cell_node_bytes = 0;    // the number of bytes used in cell_nodes, or zero if there are none
+
+/*
+  The number of the update that last changed each grid cell is kept in cell_generations, in the same
+  order as the cells, so a client can ask whether a bounding box has changed since a generation of
+  the database it saw without making an extract. A generation is written as the load ID and the
+  number of updates applied since, such as 1792191078123456.3. The load ID is the time the load
+  began in microseconds, so a generation of a database that has since been reloaded, even after
+  deleting the database directory, never matches one of the new database. A cell holding zero was
+  last changed by the load. The file is only created by the first update, and removed by a new load.
+*/
+uint32_t *cell_generations = NULL;
+
+/*
+  An extract outputs every node of the ways stored in its cells, and those nodes can lie in other
+  cells, so a change there changes the extract too. cell_reach gives the rectangle of cells holding
+  the nodes of each cell's ways, other than the cell itself, and cell_moves the rectangle of cells
+  that nodes have moved to from each cell, so the nodes can still be found after moving. Both only
+  ever grow, so changed-since may answer changed for a change to an unrelated node, but never
+  unchanged for a changed extract. Like cell_generations, they are made by the first update.
+*/
+typedef struct {
+    uint16_t min_x, min_y; // bins of the lowest cell in the rectangle
+    uint16_t end_x, end_y; // one past the bins of the highest cell, or zero for no cells at all
+} CellReach;
+
+CellReach *cell_reach = NULL;
+CellReach *cell_moves = NULL;
+
+/*
+  Each way's node refs are packed as the number of refs followed by each ref's difference from the
+  one before it, all as varints. Neighbouring nodes of a way usually have close IDs, so most refs
+  take one to three bytes instead of eight, and the count means a list can be read in one pass.
+*/
+typedef struct {
+    uint8_t *p;  // the next packed difference
+    int64_t id;  // the last node ID read
+} NodeRefReader;
+
+/* Begin reading the node refs of a way, returning the number of refs in its list. */
+static uint32_t node_refs_open (NodeRefReader *r, uint32_t node_ref_offset) {
+    uint64_t n;
+    r->p = node_refs + (uint64_t) node_ref_offset * NODE_REF_UNIT;
+    r->p += uint64_unpack (r->p, &n);
+    r->id = 0;
+    return n;
+}
+
+/* Read the next node ref of a way, which must not be past the end of its list. */
+static int64_t node_refs_next (NodeRefReader *r) {
+    int64_t delta;
+    r->p += sint64_unpack (r->p, &delta);
+    r->id += delta;
+    return r->id;
+}
+
+/*
+  Directories from OSM node and way IDs to the internal IDs indexing the nodes and ways arrays.
+  Internal ID zero is never assigned, so the node or way of an ID that was not loaded reads as all
+  zeros: a node at (0, 0) without tags, or a way without refs or tags.
+*/
+static IdDirectory node_dir = { .max_id = MAX_NODE_ID, .n_ids = 1, .max_ids = MAX_NODES, .restored = 1 };
+static IdDirectory way_dir  = { .max_id = MAX_WAY_ID,  .n_ids = 1, .max_ids = MAX_WAYS,  .restored = 1 };
+
+/* Get the node with the given OSM ID. */
+static Node *node_for_id (int64_t node_id) {
+    return &(nodes[IdDir_lookup (&node_dir, node_id)]);
+}
+
+/* Get the way with the given OSM ID. */
+static Way *way_for_id (int64_t way_id) {
+    return &(ways[IdDir_lookup (&way_dir, way_id)]);
+}
+
 /* Get the x or y bin for the given x or y coordinate. */
 static uint32_t bin (int32_t xy) {
     return ((uint32_t)(xy)) >> (32 - GRID_BITS); // unsigned: logical shift
 }
 
+/* Spread the low 16 bits of a number out to the even-numbered bits. */
+static uint32_t spread_bits (uint32_t v) {
+    v &= 0xFFFF;
+    v = (v | (v << 8)) & 0x00FF00FF;
+    v = (v | (v << 4)) & 0x0F0F0F0F;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+/* Gather the even-numbered bits of a number together, undoing spread_bits. */
+static uint32_t gather_bits (uint32_t v) {
+    v &= 0x55555555;
+    v = (v | (v >> 1)) & 0x33333333;
+    v = (v | (v >> 2)) & 0x0F0F0F0F;
+    v = (v | (v >> 4)) & 0x00FF00FF;
+    v = (v | (v >> 8)) & 0x0000FFFF;
+    return v;
+}
+
+/*
+  Get the index of the grid cell with the given x and y bins, by interleaving their bits. In this
+  Morton order every aligned square block of cells is one run of indexes, so the cells of a bounding
+  box, and anything else stored per cell, are in a few runs of neighbouring pages instead of one
+  stripe for each column of the box.
+*/
+static uint32_t cell_index (uint32_t xbin, uint32_t ybin) {
+    return (spread_bits (xbin) << 1) | spread_bits (ybin);
+}
+
+/* Get the lowest corner of a grid cell, given its index. */
+static coord_t cell_origin (uint32_t c) {
+    coord_t origin;
+    origin.x = (int32_t) (gather_bits (c >> 1) << (32 - GRID_BITS));
+    origin.y = (int32_t) (gather_bits (c) << (32 - GRID_BITS));
+    return origin;
+}
+
 /* Get the address of the grid cell for the given internal coord. */
 static GridCell *get_grid_cell_for_coord (coord_t coord) {
-    return &(grid->cells[bin(coord.x)][bin(coord.y)]);
+    return &(grid->cells[cell_index (bin(coord.x), bin(coord.y))]);
+}
+
+/* A run of consecutive grid cell indexes, from begin up to but not including end. */
+typedef struct {
+    uint32_t begin;
+    uint32_t end;
+} CellRange;
+
+/* The runs of cell indexes covering a bounding box, in increasing order. */
+typedef struct {
+    uint32_t min_x, min_y, max_x, max_y; // bins of the bounding box, inclusive
+    CellRange *ranges;
+    size_t n_ranges, size;
+} CellCover;
+
+/*
+  Add the cells of the bounding box within an aligned square of cells to a cover. Squares that
+  lie partly outside the box are divided into quarters, which are visited in index order.
+*/
+static void cover_square (CellCover *cc, uint32_t x, uint32_t y, uint32_t side) {
+    if (x > cc->max_x || y > cc->max_y || x + side - 1 < cc->min_x || y + side - 1 < cc->min_y) return;
+    bool inside = (x >= cc->min_x && y >= cc->min_y && x + side - 1 <= cc->max_x && y + side - 1 <= cc->max_y);
+    if (!inside) {
+        side /= 2;
+        cover_square (cc, x, y, side);
+        cover_square (cc, x, y + side, side);
+        cover_square (cc, x + side, y, side);
+        cover_square (cc, x + side, y + side, side);
+        return;
+    }
+    uint32_t begin = cell_index (x, y);
+    if (cc->n_ranges > 0 && cc->ranges[cc->n_ranges - 1].end == begin) {
+        cc->ranges[cc->n_ranges - 1].end += side * side;
+        return;
+    }
+    if (cc->n_ranges == cc->size) {
+        cc->size = (cc->size == 0) ? 64 : cc->size * 2;
+        cc->ranges = realloc (cc->ranges, cc->size * sizeof(CellRange));
+        if (cc->ranges == NULL) die ("Could not allocate grid cell ranges.");
+    }
+    cc->ranges[cc->n_ranges].begin = begin;
+    cc->ranges[cc->n_ranges].end = begin + side * side;
+    cc->n_ranges++;
+}
+
+/* Find the runs of cell indexes covering the cells between the given bins, inclusive. */
+static void cover_cells (CellCover *cc, uint32_t min_x, uint32_t min_y, uint32_t max_x, uint32_t max_y) {
+    memset (cc, 0, sizeof(*cc));
+    cc->min_x = min_x;
+    cc->min_y = min_y;
+    cc->max_x = max_x;
+    cc->max_y = max_y;
+    cover_square (cc, 0, 0, GRID_DIM);
+}
+
+/* Return the GridCell containing the first node of the given way, or NULL if it has no nodes. */
+static GridCell *get_grid_cell_for_way (Way *way) {
+    NodeRefReader refs;
+    if (node_refs_open (&refs, way->node_ref_offset) == 0) return NULL;
+    return get_grid_cell_for_coord (node_for_id (node_refs_next (&refs))->coord);
 }
 
 /* Return the GridCell containing the first member of the given relation. */
 static GridCell *get_grid_cell_for_relation (Relation *r) {
     RelMember first_member = rel_members[r->member_offset];
+    int64_t id = llabs (first_member.id); // negated if it is also the last member
     if (first_member.element_type == NODE) {
-        return get_grid_cell_for_coord (nodes[first_member.id].coord);
+        return get_grid_cell_for_coord (node_for_id (id)->coord);
     } else if (first_member.element_type == WAY) {
-        Way way = ways[first_member.id];
-        Node first_node = nodes[way.node_ref_offset];
-        return get_grid_cell_for_coord (first_node.coord);
+        return get_grid_cell_for_way (way_for_id (id)); // NULL if the way was not loaded
     } else { 
         // (first_member.element_type == RELATION) {
         // TODO recurse... but the referenced relation may not be loaded.
@@ -303,31 +708,193 @@ static GridCell *get_grid_cell_for_relation (Relation *r) {
 }
 
 /*
-  Given a Node struct, return the index of the way reference block at the head of the Node's grid
-  cell, creating a new way reference block if the grid cell is currently empty.
+  Return the index of the way reference block at the head of the given grid cell, creating a new way
+  reference block if the grid cell is currently empty.
 */
-static uint32_t get_grid_way_block (Node *node) {
-    GridCell *cell = get_grid_cell_for_coord (node->coord);
-    if (cell->head_way_block == 0) {
+static uint32_t get_grid_way_block (GridCell *cell) {
+    /* A block left over from before compaction is not part of the list, so the list is empty. */
+    if (cell->head_way_block == 0 || cell->head_way_block < compacted_way_blocks) {
         cell->head_way_block = new_way_block();
     }
     return cell->head_way_block;
 }
 
-/* TODO make this insert a new block at the list head instead of just setting the grid cell contents. */
-static void set_grid_way_block (Node *node, uint32_t way_block_index) {
-    GridCell *cell = get_grid_cell_for_coord (node->coord);
-    cell->head_way_block = way_block_index;
+/* Serializes insertions into the lists of way blocks hanging off the grid cells. */
+static pthread_mutex_t grid_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* 
+  Record that the given way begins in the given grid cell. Not thread safe: loader threads stage
+  their insertions and apply them while holding grid_mutex.
+*/
+static void grid_insert_way (GridCell *cell, int32_t way_id) {
+    uint32_t wbi = get_grid_way_block(cell);
+    WayBlock *wb = &(way_blocks[wbi]);
+    /* If the last node ref is non-negative, no free slots remain. Chain a new empty block. */
+    if (wb->refs[WAY_BLOCK_SIZE - 1] >= 0) {
+        int32_t n_wbi = new_way_block();
+        // Insert new block at head of list to avoid later scanning though large swaths of memory.
+        wb = &(way_blocks[n_wbi]);
+        wb->next = wbi;
+        cell->head_way_block = n_wbi;
+    }
+    /* We are now certain to have a free slot in the current block. */
+    int nfree = wb->refs[WAY_BLOCK_SIZE - 1];
+    if (nfree >= 0) die ("Final ref should be negative, indicating number of empty slots.");
+    /* A final ref < 0 gives the number of free slots in this block. */
+    int free_idx = WAY_BLOCK_SIZE + nfree;
+    wb->refs[free_idx] = way_id;
+    /* If this was not the last available slot, reduce number of free slots in this block by one. */
+    if (nfree != -1) (wb->refs[WAY_BLOCK_SIZE - 1])++;
+}
+
+/* Get the compacted run of ways beginning in a grid cell, or NULL if it has none. */
+static int32_t *cell_run (GridCell *cell) {
+    if (cell_offsets == NULL) return NULL;
+    uint32_t offset = cell_offsets[cell - grid->cells];
+    return offset == 0 ? NULL : &(cell_ways[offset]);
+}
+
+/* Get the index of the first way ID in a sorted array of them that is not less than the given one. */
+static int32_t sorted_lower_bound (int32_t *ids, int32_t n, int32_t id) {
+    int32_t lo = 0, hi = n;
+    while (lo < hi) {
+        int32_t mid = lo + (hi - lo) / 2;
+        if (ids[mid] < id) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Find a way ID in a sorted array of them. */
+static bool sorted_contains (int32_t *ids, int32_t n, int32_t id) {
+    int32_t i = sorted_lower_bound (ids, n, id);
+    return i < n && ids[i] == id;
 }
 
-/* A memory block holding tags for a sub-range of the OSM ID space. */
+/* Check whether the given way is already in the compacted run or the way blocks of a grid cell. */
+static bool grid_contains_way (GridCell *cell, int32_t way_id) {
+    int32_t *run = cell_run (cell);
+    if (run != NULL && sorted_contains (run + 1, run[0], way_id)) return true;
+    for (uint32_t wbi = cell->head_way_block; wbi >= compacted_way_blocks && wbi != 0; wbi = way_blocks[wbi].next) {
+        for (int w = 0; w < WAY_BLOCK_SIZE; w++) {
+            if (way_blocks[wbi].refs[w] == way_id) return true;
+        }
+    }
+    return false;
+}
+
+/* 
+  A memory block holding tags for a sub-range of the OSM ID space. 
+  Loader threads reserve space by atomically advancing pos, so several threads can append at once.
+*/
 typedef struct {
     uint8_t *data;
     size_t pos;
+    Arena *arena;
 } TagSubfile;
 
 #define MAX_SUBFILES 32
-static TagSubfile tag_subfiles[MAX_SUBFILES] = {[0 ... MAX_SUBFILES - 1] {.data=NULL, .pos=0}};
+static TagSubfile tag_subfiles[MAX_SUBFILES] = {[0 ... MAX_SUBFILES - 1] {.data=NULL, .pos=0, .arena=NULL}};
+
+/* Serializes lazy mapping of tag subfiles, since map_arena uses static buffers. */
+static pthread_mutex_t subfile_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* A growable buffer in which one tag list is encoded before being copied to its subfile. */
+typedef struct {
+    uint8_t *data;
+    size_t pos;
+    size_t size;
+} TagBuffer;
+
+/* A way waiting to be inserted into the grid cell of its first node. */
+typedef struct {
+    int64_t first_node; // ID of the way's first node, whose position decides its grid cell
+    uint32_t cell;      // index of that grid cell, once it has been looked up
+    int32_t way_id;
+} StagedWay;
+
+/*
+  What the loader has worked out about one string in the string table of the block being loaded.
+  Strings are classified lazily the first time they are used as a key, value or role, and
+  the results are reused for every other element in the block.
+*/
+typedef struct {
+    uint32_t key;    // as a value: string index of the key it was last encoded with, or UINT32_MAX
+    int32_t code;    // as a value: the tag code for that key and this value
+    int8_t drop;     // as a value: whether the tag filter drops that key with this value
+    int8_t filter;   // as a key: the tag filter verdict (TAG_KEEP etc.), or -1 if not yet known
+    int32_t role;    // as a role: the role code, or -1 if not yet known
+} StringClass;
+
+/*
+  A node or way whose internal ID is not known yet. Internal IDs are assigned to all the elements
+  of a block at once when the block is done, so each thread keeps the elements of its current block.
+*/
+typedef struct {
+    int64_t id;
+    Node node;
+} PendingNode;
+
+typedef struct {
+    int64_t id;
+    Way way;
+} PendingWay;
+
+/*
+  Number of grid insertions a loader thread accumulates before applying them all at once.
+  A larger window gives more ways sharing each grid cell and page of nodes when they are applied.
+*/
+#define MAX_STAGED_WAYS (1 << 18)
+
+/* 
+  State private to each thread that runs loader callbacks. Nodes may be loaded on several threads
+  at once, so anything they would otherwise share is kept here and combined at the end of the load.
+  All instances are chained together so they can be found after their threads have exited.
+*/
+typedef struct LoaderThread LoaderThread;
+struct LoaderThread {
+    TagBuffer tags;          // staging area for the tag list currently being written
+    long nodes_pending;      // nodes loaded by this thread and not yet added to the global count
+    long ways_pending;       // ways loaded by this thread and not yet added to the global count
+    uint32_t node_ref_next;  // next free entry in this thread's reserved chunk of node_refs
+    uint32_t node_ref_end;   // end of this thread's reserved chunk of node_refs
+    StagedWay *staged_ways;  // grid insertions not yet applied
+    int n_staged_ways;
+    PendingNode *pending_nodes; // nodes and ways of the current block, waiting for internal IDs
+    size_t n_pending_nodes, pending_nodes_size;
+    PendingWay *pending_ways;
+    size_t n_pending_ways, pending_ways_size;
+    int64_t *pending_ids;    // buffers for assigning internal IDs to the pending elements
+    uint32_t *pending_internal;
+    size_t pending_ids_size;
+    ProtobufCBinaryData *string_table; // string table of the block this thread is loading
+    StringClass *strings;    // classification of each string in that string table
+    size_t n_strings, strings_size;
+    int64_t min_ids[3];      // lowest and highest ID of each element type loaded by this thread
+    int64_t max_ids[3];
+    LoaderThread *next;
+};
+
+static __thread LoaderThread *loader_thread = NULL;
+static LoaderThread *loader_threads = NULL;
+static pthread_mutex_t loader_threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Get the state for the calling thread, creating and registering it the first time. */
+static LoaderThread *get_loader_thread () {
+    if (loader_thread == NULL) {
+        loader_thread = calloc(1, sizeof(LoaderThread));
+        if (loader_thread == NULL) die ("Could not allocate loader thread state.");
+        for (int t = NODE; t <= RELATION; t++) {
+            loader_thread->min_ids[t] = INT64_MAX;
+            loader_thread->max_ids[t] = INT64_MIN;
+        }
+        pthread_mutex_lock(&loader_threads_mutex);
+        loader_thread->next = loader_threads;
+        loader_threads = loader_thread;
+        pthread_mutex_unlock(&loader_threads_mutex);
+    }
+    return loader_thread;
+}
 
 /*
   The ID space must be split up.
@@ -342,24 +909,37 @@ static uint32_t subfile_index_for_id (int64_t osmid, int entity_type) {
     return subfile;
 }
 
-/* Get the subfile in which the tags for the given OSM entity should be stored. */
-static TagSubfile *tag_subfile_for_id (int64_t osmid, int entity_type) {
-    uint32_t subfile = subfile_index_for_id (osmid, entity_type);
+/* Get the tag subfile with the given index, mapping it the first time it is used. */
+static TagSubfile *tag_subfile (uint32_t subfile) {
     if (subfile >= MAX_SUBFILES) die ("Need more subfiles than expected.");
     TagSubfile *ts = &(tag_subfiles[subfile]);
-    if (ts->data == NULL) {
-        /* Lazy-map a subfile the first time it is needed. */
-        ts->data = map_file("tags", subfile, UINT32_MAX); // all files are 4GB sparse maps
-        /* 
-          Store a tag list terminator byte at the beginning of each file. This empty list will 
-          be shared by all entities that do not have any tags, which all have tag offset zero.
-        */
-        ts->data[0] = INT8_MAX; 
-        ts->pos = 1;
+    if (__atomic_load_n(&(ts->data), __ATOMIC_ACQUIRE) == NULL) {
+        /* Lazy-map a subfile the first time it is needed. Another thread may be doing the same. */
+        pthread_mutex_lock(&subfile_mutex);
+        if (ts->data == NULL) {
+            ts->arena = map_arena("tags", subfile, UINT32_MAX, ARENA_DENSE); // tag offsets are 32 bits
+            uint8_t *data = ts->arena->base;
+            /* 
+              Store a tag list terminator byte at the beginning of each file. This empty list will 
+              be shared by all entities that do not have any tags, which all have tag offset zero.
+            */
+            if (!read_only) {
+                arena_ensure (ts->arena, 1);
+                data[0] = INT8_MAX; 
+                ts->pos = 1;
+            }
+            __atomic_store_n(&(ts->data), data, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&subfile_mutex);
     }
     return ts;
 }
 
+/* Get the subfile in which the tags for the given OSM entity should be stored. */
+static TagSubfile *tag_subfile_for_id (int64_t osmid, int entity_type) {
+    return tag_subfile (subfile_index_for_id (osmid, entity_type));
+}
+
 /*
   Grab a pointer to tag subfile data directly. Convenience method to avoid manually dereferencing.
   This does not seek to the element within the tag file, it returns the beginning adress.
@@ -369,17 +949,71 @@ static uint8_t *tag_data_for_id (int64_t osmid, int entity_type) {
     return tag_subfile_for_id(osmid, entity_type)->data;
 }
 
-/* Write a ProtobufCBinaryData out to a TagSubfile, updating the subfile position accordingly. */
-static void ts_write(ProtobufCBinaryData *bd, TagSubfile *ts) {
-    uint8_t *dst = ts->data + ts->pos;
-    uint8_t *src = bd->data;
-    for (int i = 0; i < bd->len; i++) *(dst++) = *(src++);
-    ts->pos += bd->len;
+/* Make room for at least n more bytes in a TagBuffer. */
+static void tb_reserve(size_t n, TagBuffer *tb) {
+    if (tb->pos + n <= tb->size) return;
+    size_t size = tb->size == 0 ? 4096 : tb->size;
+    while (size < tb->pos + n) size *= 2;
+    tb->data = realloc(tb->data, size);
+    if (tb->data == NULL) die ("Could not grow tag buffer.");
+    tb->size = size;
+}
+
+/* Write a ProtobufCBinaryData out to a TagBuffer, updating the buffer position accordingly. */
+static void tb_write(ProtobufCBinaryData *bd, TagBuffer *tb) {
+    tb_reserve(bd->len, tb);
+    memcpy(tb->data + tb->pos, bd->data, bd->len);
+    tb->pos += bd->len;
+}
+
+/* Write a tag code out to a TagBuffer, updating the buffer position accordingly. */
+static void tb_put_code(int32_t code, TagBuffer *tb) {
+    tb_reserve(MAX_TAG_CODE_BYTES, tb);
+    tb->pos += write_tag_code(code, tb->data + tb->pos);
+}
+
+/* Write a single char out to a TagBuffer, updating the buffer position accordingly. */
+static void tb_putc(char c, TagBuffer *tb) {
+    tb_reserve(1, tb);
+    tb->data[(tb->pos)++] = c;
 }
 
-/* Write a single char out to a TagSubfile, updating the subfile position accordingly. */
-static void ts_putc(char c, TagSubfile *ts) {
-    ts->data[(ts->pos)++] = c;
+/* 
+  Copy the contents of a TagBuffer to the end of a TagSubfile, returning the position where they
+  were written. The space is reserved atomically so several threads can append to one subfile.
+*/
+static uint64_t ts_append(TagBuffer *tb, TagSubfile *ts) {
+    uint64_t position = __sync_fetch_and_add(&(ts->pos), tb->pos);
+    if (position + tb->pos > UINT32_MAX) die ("A tag file index has overflowed.");
+    arena_ensure (ts->arena, position + tb->pos);
+    memcpy(ts->data + position, tb->data, tb->pos);
+    return position;
+}
+
+/* String table callback, clearing the calling thread's string classifications for a new block. */
+static void handle_block_strings (ProtobufCBinaryData *string_table, size_t n_strings) {
+    LoaderThread *lt = get_loader_thread();
+    if (n_strings > lt->strings_size) {
+        free (lt->strings);
+        lt->strings_size = n_strings * 2;
+        lt->strings = malloc (sizeof(StringClass) * lt->strings_size);
+        if (lt->strings == NULL) die ("Could not allocate string classifications.");
+    }
+    for (size_t s = 0; s < n_strings; s++) {
+        StringClass *sc = &(lt->strings[s]);
+        sc->key = UINT32_MAX;
+        sc->filter = -1;
+        sc->role = -1;
+    }
+    lt->string_table = string_table;
+    lt->n_strings = n_strings;
+}
+
+/* Get the classification of one string in the string table of the block this thread is loading. */
+static StringClass *classify_string (LoaderThread *lt, ProtobufCBinaryData *string_table, uint32_t s) {
+    if (string_table != lt->string_table) die ("Block strings were not classified before loading.");
+    if (s >= lt->n_strings) die ("String table index out of range.");
+    return &(lt->strings[s]);
 }
 
 /*
@@ -390,119 +1024,371 @@ static void ts_putc(char c, TagSubfile *ts) {
 static uint32_t write_tags (uint32_t *keys, uint32_t *vals, int n, ProtobufCBinaryData *string_table, TagSubfile *ts) {
     /* If there are no tags, point to index 0, which contains a single tag list terminator char. */
     if (n == 0) return 0;
-    uint64_t position = ts->pos;
-    if (position > UINT32_MAX) die ("A tag file index has overflowed.");
+    /* Encode the list in a private buffer, then copy it to the subfile in one piece. */
+    LoaderThread *lt = get_loader_thread();
+    TagBuffer *tb = &(lt->tags);
+    tb->pos = 0;
     int n_tags_written = 0;
     for (int t = 0; t < n; t++) {
         ProtobufCBinaryData key = string_table[keys[t]];
         ProtobufCBinaryData val = string_table[vals[t]];
-        // skip unneeded keys
-        if (memcmp("created_by",  key.data, key.len) == 0 ||
-            memcmp("import_uuid", key.data, key.len) == 0 ||
-            memcmp("attribution", key.data, key.len) == 0 ||
-            memcmp("source",      key.data, 6) == 0 ||
-            memcmp("tiger:",      key.data, 6) == 0) {
-            continue;
+        StringClass *key_class = classify_string (lt, string_table, keys[t]);
+        if (key_class->filter < 0) key_class->filter = TagFilter_key (key);
+        if (key_class->filter == TAG_DROP) continue; // skip unneeded keys
+        /* The same key and value always give the same result, so remember it with the value. */
+        StringClass *val_class = classify_string (lt, string_table, vals[t]);
+        if (val_class->key != keys[t]) {
+            val_class->key = keys[t];
+            val_class->drop = key_class->filter == TAG_BY_VALUE && TagFilter_drop_tag (key, val);
+            val_class->code = encode_tag(key, val);
         }
-        int8_t code = encode_tag(key, val);
+        if (val_class->drop) continue;
+        int32_t code = val_class->code;
         // Code always written out to encode a key and/or a value, or indicate they are free text.
-        ts_putc(code, ts);
+        tb_put_code(code, tb);
         if (code == 0) {
             // Code 0 means zero-terminated key and value are written out in full.
             // Saving only tags with 'known' keys (nonzero codes) cuts file sizes in half.
             // Some are reduced by over 4x, which seem to contain a lot of bot tags.
             // continue;
-            ts_write(&key, ts);
-            ts_putc(0, ts);
-            ts_write(&val, ts);
-            ts_putc(0, ts);
+            tb_write(&key, tb);
+            tb_putc(0, tb);
+            tb_write(&val, tb);
+            tb_putc(0, tb);
         } else if (code < 0) {
             // Negative code provides key lookup, but value is written as zero-terminated free text.
-            ts_write(&val, ts);
-            ts_putc(0, ts);
+            tb_write(&val, tb);
+            tb_putc(0, tb);
         }
         n_tags_written++;
     }
     /* If all tags were skipped, return the index of the shared zero-length list. */
     if (n_tags_written == 0) return 0;
     /* The tag list is terminated with a single character. TODO maybe use 0 as terminator. */
-    ts_putc(INT8_MAX, ts);
+    tb_putc(INT8_MAX, tb);
+    uint64_t position = ts_append(tb, ts);
     return position;
 }
 
-/* Count the number of nodes and ways loaded, just for progress reporting. */
+/* 
+  Count the number of nodes and ways loaded, just for progress reporting. Nodes and ways may be 
+  loaded on several threads, which add their counts to the totals in batches.
+*/
+#define COUNT_BATCH 65536
 static long nodes_loaded = 0;
 static long ways_loaded = 0;
 static long rels_loaded = 0;
 
-/* Node callback handed to the general-purpose PBF loading code. */
+/* The lowest and highest ID of each element type loaded, or INT64_MAX and INT64_MIN if there are none. */
+static int64_t min_ids[3] = { INT64_MAX, INT64_MAX, INT64_MAX };
+static int64_t max_ids[3] = { INT64_MIN, INT64_MIN, INT64_MIN };
+
+/* Widen a loader thread's range of IDs for the given element type. */
+static void note_id_range (LoaderThread *lt, int element_type, int64_t min_id, int64_t max_id) {
+    if (min_id < lt->min_ids[element_type]) lt->min_ids[element_type] = min_id;
+    if (max_id > lt->max_ids[element_type]) lt->max_ids[element_type] = max_id;
+}
+
+/* Count n elements in a per-thread counter, adding batches to the total and reporting progress. */
+static void count_loaded (long n, long *pending, long *total, const char *element_type) {
+    *pending += n;
+    if (*pending >= COUNT_BATCH) {
+        long batch = *pending;
+        long t = __sync_add_and_fetch(total, batch);
+        *pending = 0;
+        if (t / 1000000 != (t - batch) / 1000000)
+            fprintf(stderr, "loaded %ldM %s\n", t / 1000000, element_type);
+    }
+}
+
+/* 
+  Make room for n NODE_REF_UNITs in the node_refs array, returning the offset of the room. Each
+  thread claims large chunks at once with an atomic add, so threads do not contend on n_node_refs
+  for every way. The caller then claims only as many units as its packed list actually takes, by
+  advancing node_ref_next. The unused tail of a chunk is left empty, which is harmless since refs
+  are only reached through a way.
+*/
+#define NODE_REF_CHUNK 65536
+static uint32_t reserve_node_refs (uint32_t n, LoaderThread *lt) {
+    if ((uint64_t) lt->node_ref_next + n > lt->node_ref_end) {
+        uint32_t chunk = n > NODE_REF_CHUNK ? n : NODE_REF_CHUNK;
+        uint64_t begin = __sync_fetch_and_add(&n_node_refs, chunk);
+        if (begin + chunk >= MAX_NODE_REF_UNITS) die ("Node refs index is about to overflow.");
+        arena_ensure (node_refs_arena, (begin + chunk) * NODE_REF_UNIT);
+        lt->node_ref_next = begin;
+        lt->node_ref_end = begin + chunk;
+    }
+    return lt->node_ref_next;
+}
+
+/* Order staged ways by their first node. */
+static int compare_first_node (const void *a, const void *b) {
+    const StagedWay *x = a, *y = b;
+    return (x->first_node > y->first_node) - (x->first_node < y->first_node);
+}
+
+/* Order staged ways by grid cell, and by way ID within a cell. */
+static int compare_cell (const void *a, const void *b) {
+    const StagedWay *x = a, *y = b;
+    if (x->cell != y->cell) return x->cell < y->cell ? -1 : 1;
+    return (x->way_id > y->way_id) - (x->way_id < y->way_id);
+}
+
+/*
+  Apply all the grid insertions staged by one loader thread. The first node of each way is looked
+  up in node ID order, and the ways are then inserted in cell order, so the nodes, grid and way
+  blocks are all visited mostly in sequence instead of at random. This matters most when the
+  database is much larger than memory and each random access is a page fault.
+*/
+static void flush_staged_ways (LoaderThread *lt) {
+    GridCell *cells = grid->cells;
+    qsort(lt->staged_ways, lt->n_staged_ways, sizeof(StagedWay), compare_first_node);
+    for (int i = 0; i < lt->n_staged_ways; i++) {
+        StagedWay *sw = &(lt->staged_ways[i]);
+        sw->cell = get_grid_cell_for_coord (node_for_id (sw->first_node)->coord) - cells;
+    }
+    qsort(lt->staged_ways, lt->n_staged_ways, sizeof(StagedWay), compare_cell);
+    pthread_mutex_lock(&grid_mutex);
+    for (int i = 0; i < lt->n_staged_ways; i++) {
+        StagedWay *sw = &(lt->staged_ways[i]);
+        /* A negative ID marks a way replayed after resuming, which may already be in the grid. */
+        if (sw->way_id < 0 && grid_contains_way (&(cells[sw->cell]), -sw->way_id)) continue;
+        grid_insert_way (&(cells[sw->cell]), abs(sw->way_id));
+    }
+    pthread_mutex_unlock(&grid_mutex);
+    lt->n_staged_ways = 0;
+}
+
+/* 
+  Stage the insertion of a way into the grid cell of its first node, applying the staged insertions
+  when the buffer is full. A negative way ID means the way should only be inserted if it is not
+  already present.
+*/
+static void stage_way (int64_t first_node, int32_t way_id, LoaderThread *lt) {
+    if (lt->staged_ways == NULL) {
+        lt->staged_ways = malloc(sizeof(StagedWay) * MAX_STAGED_WAYS);
+        if (lt->staged_ways == NULL) die ("Could not allocate staged way buffer.");
+    }
+    StagedWay *sw = &(lt->staged_ways[lt->n_staged_ways++]);
+    sw->first_node = first_node;
+    sw->way_id = way_id;
+    if (lt->n_staged_ways == MAX_STAGED_WAYS) flush_staged_ways(lt);
+}
+
+/* Get a slot for one more pending node in a loader thread. */
+static PendingNode *pending_node (LoaderThread *lt) {
+    if (lt->n_pending_nodes == lt->pending_nodes_size) {
+        lt->pending_nodes_size = (lt->pending_nodes_size == 0) ? 8192 : lt->pending_nodes_size * 2;
+        lt->pending_nodes = realloc (lt->pending_nodes, lt->pending_nodes_size * sizeof(PendingNode));
+        if (lt->pending_nodes == NULL) die ("Could not allocate pending nodes.");
+    }
+    return &(lt->pending_nodes[lt->n_pending_nodes++]);
+}
+
+/* Get a slot for one more pending way in a loader thread. */
+static PendingWay *pending_way (LoaderThread *lt) {
+    if (lt->n_pending_ways == lt->pending_ways_size) {
+        lt->pending_ways_size = (lt->pending_ways_size == 0) ? 8192 : lt->pending_ways_size * 2;
+        lt->pending_ways = realloc (lt->pending_ways, lt->pending_ways_size * sizeof(PendingWay));
+        if (lt->pending_ways == NULL) die ("Could not allocate pending ways.");
+    }
+    return &(lt->pending_ways[lt->n_pending_ways++]);
+}
+
+/* Make room for assigning internal IDs to n pending elements. */
+static void reserve_pending_ids (LoaderThread *lt, size_t n) {
+    if (n <= lt->pending_ids_size) return;
+    lt->pending_ids_size = n * 2;
+    free (lt->pending_ids);
+    free (lt->pending_internal);
+    lt->pending_ids = malloc (lt->pending_ids_size * sizeof(int64_t));
+    lt->pending_internal = malloc (lt->pending_ids_size * sizeof(uint32_t));
+    if (lt->pending_ids == NULL || lt->pending_internal == NULL) die ("Could not allocate internal IDs.");
+}
+
+/* Order pending nodes or ways by OSM ID. Both begin with the ID. */
+static int compare_pending (const void *a, const void *b) {
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+  Assign internal IDs to the pending nodes and ways of a loader thread and store them. Blocks are
+  almost always already in ID order, in which case they are not sorted again.
+*/
+static void store_pending (LoaderThread *lt) {
+    if (lt->n_pending_nodes > 0) {
+        size_t n = lt->n_pending_nodes;
+        PendingNode *pn = lt->pending_nodes;
+        reserve_pending_ids (lt, n);
+        for (size_t i = 1; i < n; i++) {
+            if (pn[i].id < pn[i - 1].id) {
+                qsort (pn, n, sizeof(PendingNode), compare_pending);
+                break;
+            }
+        }
+        for (size_t i = 0; i < n; i++) lt->pending_ids[i] = pn[i].id;
+        IdDir_assign (&node_dir, lt->pending_ids, n, lt->pending_internal);
+        arena_ensure (nodes_arena, (uint64_t) node_dir.n_ids * sizeof(Node));
+        for (size_t i = 0; i < n; i++) nodes[lt->pending_internal[i]] = pn[i].node;
+        lt->n_pending_nodes = 0;
+    }
+    if (lt->n_pending_ways > 0) {
+        size_t n = lt->n_pending_ways;
+        PendingWay *pw = lt->pending_ways;
+        reserve_pending_ids (lt, n);
+        for (size_t i = 1; i < n; i++) {
+            if (pw[i].id < pw[i - 1].id) {
+                qsort (pw, n, sizeof(PendingWay), compare_pending);
+                break;
+            }
+        }
+        for (size_t i = 0; i < n; i++) lt->pending_ids[i] = pw[i].id;
+        IdDir_assign (&way_dir, lt->pending_ids, n, lt->pending_internal);
+        arena_ensure (ways_arena, (uint64_t) way_dir.n_ids * sizeof(Way));
+        for (size_t i = 0; i < n; i++) ways[lt->pending_internal[i]] = pw[i].way;
+        lt->n_pending_ways = 0;
+    }
+}
+
+/*
+  Write back the arrays filled from front to back (see writeback_arena), on one loader thread at a
+  time. Nodes, ways and way blocks are read again as the load goes on, so they stay in memory.
+*/
+static void writeback_loaded () {
+    if (pthread_mutex_trylock (&writeback_mutex) != 0) return;
+    writeback_arena (nodes_arena, (uint64_t) __atomic_load_n (&(node_dir.n_ids), __ATOMIC_RELAXED) * sizeof(Node), false);
+    writeback_arena (ways_arena, (uint64_t) __atomic_load_n (&(way_dir.n_ids), __ATOMIC_RELAXED) * sizeof(Way), false);
+    writeback_arena (way_blocks_arena, (uint64_t) way_block_count * sizeof(WayBlock), false);
+    writeback_arena (node_refs_arena, (uint64_t) __atomic_load_n (&n_node_refs, __ATOMIC_RELAXED) * NODE_REF_UNIT, true);
+    writeback_arena (rel_members_arena, (uint64_t) n_rel_members * sizeof(RelMember), true);
+    for (int s = 0; s < MAX_SUBFILES; s++) {
+        TagSubfile *ts = &(tag_subfiles[s]);
+        if (__atomic_load_n (&(ts->data), __ATOMIC_ACQUIRE) == NULL) continue; // not mapped yet
+        writeback_arena (ts->arena, __atomic_load_n (&(ts->pos), __ATOMIC_RELAXED), true);
+    }
+    pthread_mutex_unlock (&writeback_mutex);
+}
+
+/* Block done callback handed to the general-purpose PBF loading code. */
+static void handle_block_done () {
+    store_pending (get_loader_thread());
+    if (steady_writeback && !in_memory) writeback_loaded ();
+}
+
+/* 
+  Node callback handed to the general-purpose PBF loading code.
+  This may run on several threads at once. Each thread keeps the nodes of its current block until
+  they are given internal IDs, and space for their tags is reserved atomically, so no locking is needed.
+*/
 static void handle_node (OSMPBF__Node *node, ProtobufCBinaryData *string_table) {
     if (node->id > MAX_NODE_ID)
         die("OSM data contains nodes with larger IDs than expected.");
     if (ways_loaded > 0)
         die("All nodes must appear before any ways in input file.");
+    LoaderThread *lt = get_loader_thread();
+    PendingNode *pn = pending_node (lt);
+    pn->id = node->id;
     // lat and lon are in nanodegrees
     double lat = node->lat * 0.000000001;
     double lon = node->lon * 0.000000001;
-    to_coord(&(nodes[node->id].coord), lat, lon);
+    to_coord(&(pn->node.coord), lat, lon);
     TagSubfile *ts = tag_subfile_for_id(node->id, NODE);
-    nodes[node->id].tags = write_tags (node->keys, node->vals, node->n_keys, string_table, ts);
-    nodes_loaded++;
-    if (nodes_loaded % 1000000 == 0)
-        fprintf(stderr, "loaded %ldM nodes\n", nodes_loaded / 1000000);
-    //printf ("---\nlon=%.5f lat=%.5f\nx=%d y=%d\n", lon, lat, nodes[node->id].x, nodes[node->id].y);
+    pn->node.tags = write_tags (node->keys, node->vals, node->n_keys, string_table, ts);
+    note_id_range (lt, NODE, node->id, node->id);
+    count_loaded (1, &(lt->nodes_pending), &nodes_loaded, "nodes");
+    //printf ("---\nlon=%.5f lat=%.5f\nx=%d y=%d\n", lon, lat, pn->node.coord.x, pn->node.coord.y);
+}
+
+/*
+  Dense node callback handed to the general-purpose PBF loading code, receiving a whole group at once.
+  Coordinates are converted and stored in one pass, then tags are written in a second pass.
+  Like handle_node, this may run on several threads at once without locking.
+*/
+static void handle_dense_nodes (PbfDenseNodes *dense, ProtobufCBinaryData *string_table) {
+    if (ways_loaded > 0)
+        die("All nodes must appear before any ways in input file.");
+    LoaderThread *lt = get_loader_thread();
+    int64_t *ids = dense->ids;
+    size_t first = lt->n_pending_nodes;
+    for (size_t n = 0; n < dense->n_nodes; n++) {
+        if (ids[n] > MAX_NODE_ID)
+            die("OSM data contains nodes with larger IDs than expected.");
+        PendingNode *pn = pending_node (lt);
+        pn->id = ids[n];
+        // lat and lon are in nanodegrees
+        to_coord(&(pn->node.coord), dense->lats[n] * 0.000000001, dense->lons[n] * 0.000000001);
+    }
+    uint32_t *tag_offsets = dense->tag_offsets;
+    for (size_t n = 0; n < dense->n_nodes; n++) {
+        TagSubfile *ts = tag_subfile_for_id(ids[n], NODE);
+        uint32_t t = tag_offsets[n];
+        lt->pending_nodes[first + n].node.tags = write_tags (dense->keys + t, dense->vals + t,
+                                                             tag_offsets[n + 1] - t, string_table, ts);
+    }
+    if (dense->n_nodes > 0) {
+        int64_t min_id = ids[0], max_id = ids[0];
+        for (size_t n = 1; n < dense->n_nodes; n++) {
+            if (ids[n] < min_id) min_id = ids[n];
+            if (ids[n] > max_id) max_id = ids[n];
+        }
+        note_id_range (lt, NODE, min_id, max_id);
+    }
+    count_loaded (dense->n_nodes, &(lt->nodes_pending), &nodes_loaded, "nodes");
+}
+
+/*
+  Pack the node references of a way into a sub-segment of one big array, returning the offset where
+  the packed list begins. They are delta coded in PBF just as they are stored, so they are copied
+  without decoding. All the refs within a way are always known at once, so the list is prefixed with
+  its length (unlike the lists of ways within a grid cell).
+*/
+static uint32_t pack_node_refs (OSMPBF__Way *way, LoaderThread *lt) {
+    uint32_t max_units = (5 + 10 * (uint64_t) way->n_refs + NODE_REF_UNIT - 1) / NODE_REF_UNIT;
+    uint32_t offset = reserve_node_refs (max_units, lt);
+    uint8_t *out = node_refs + (uint64_t) offset * NODE_REF_UNIT;
+    size_t pos = uint64_pack (way->n_refs, out);
+    for (int r = 0; r < way->n_refs; r++)
+        pos += sint64_pack (way->refs[r], out + pos);
+    lt->node_ref_next += (pos + NODE_REF_UNIT - 1) / NODE_REF_UNIT;
+    return offset;
 }
 
 /*
   Way callback handed to the general-purpose PBF loading code.
   All nodes must come before any ways in the input for this to work.
+  This may run on several threads at once. Node refs are copied into chunks reserved by each thread,
+  insertions into the grid are staged per thread and applied in batches under a lock, and the ways
+  of a block are kept until they are given internal IDs when the block is done.
 */
 static void handle_way (OSMPBF__Way *way, ProtobufCBinaryData *string_table) {
     if (way->id > MAX_WAY_ID)
         die("OSM data contains ways greater IDs than expected.");
-    /*
-       Copy node references into a sub-segment of one big array, reversing the PBF delta coding so
-       they are absolute IDs. All the refs within a way or relation are always known at once, so
-       we can use exact-length lists (unlike the lists of ways within a grid cell).
-       Each way stores the index of the first node reference in its list, and a negative node
-       ID is used to signal the end of the list.
-    */
-    ways[way->id].node_ref_offset = n_node_refs;
+    if (way->n_refs == 0) return; // logic below expects at least one node reference
+    LoaderThread *lt = get_loader_thread();
+    /* When resuming, ways that were loaded after the last checkpoint may already be in the grid. */
+    bool replayed = resuming && IdDir_seen (&way_dir, way->id);
+    PendingWay *pw = pending_way (lt);
+    pw->id = way->id;
+    pw->way.node_ref_offset = pack_node_refs (way, lt);
     //fprintf(stderr, "WAY %ld\n", way->id);
-    //fprintf(stderr, "node ref offset %d\n", ways[way->id].node_ref_offset);
-    int64_t node_id = 0;
-    for (int r = 0; r < way->n_refs; r++, n_node_refs++) {
-        node_id += way->refs[r]; // node refs are delta coded
-        node_refs[n_node_refs] = node_id;
-        if (n_node_refs == UINT32_MAX) die ("Node refs index is about to overflow.");
-    }
-    node_refs[n_node_refs - 1] *= -1; // Negate last node ref to signal end of list.
+    //fprintf(stderr, "node ref offset %d\n", pw->way.node_ref_offset);
     /* Index this way, as being in the grid cell of its first node. */
-    uint32_t wbi = get_grid_way_block(&(nodes[way->refs[0]]));
-    WayBlock *wb = &(way_blocks[wbi]);
-    /* If the last node ref is non-negative, no free slots remain. Chain a new empty block. */
-    if (wb->refs[WAY_BLOCK_SIZE - 1] >= 0) {
-        int32_t n_wbi = new_way_block();
-        // Insert new block at head of list to avoid later scanning though large swaths of memory.
-        wb = &(way_blocks[n_wbi]);
-        wb->next = wbi;
-        set_grid_way_block(&(nodes[way->refs[0]]), n_wbi);
-    }
-    /* We are now certain to have a free slot in the current block. */
-    int nfree = wb->refs[WAY_BLOCK_SIZE - 1];
-    if (nfree >= 0) die ("Final ref should be negative, indicating number of empty slots.");
-    /* A final ref < 0 gives the number of free slots in this block. */
-    int free_idx = WAY_BLOCK_SIZE + nfree;
-    wb->refs[free_idx] = way->id;
-    /* If this was not the last available slot, reduce number of free slots in this block by one. */
-    if (nfree != -1) (wb->refs[WAY_BLOCK_SIZE - 1])++;
-    ways_loaded++;
+    stage_way (way->refs[0], replayed ? -way->id : way->id, lt);
     /* Save tags to compacted tag array, and record the index where that tag list begins. */
     TagSubfile *ts = tag_subfile_for_id(way->id, WAY);
-    ways[way->id].tags = write_tags (way->keys, way->vals, way->n_keys, string_table, ts);
-    if (ways_loaded % 1000000 == 0) {
-        fprintf(stderr, "loaded %ldM ways\n", ways_loaded / 1000000);
+    pw->way.tags = write_tags (way->keys, way->vals, way->n_keys, string_table, ts);
+    note_id_range (lt, WAY, way->id, way->id);
+    count_loaded (1, &(lt->ways_pending), &ways_loaded, "ways");
+}
+
+/* Check whether the given relation is already in the list of relations in a grid cell. */
+static bool grid_cell_contains_relation (GridCell *cell, uint32_t rel_id) {
+    if (cell == NULL) return false;
+    for (uint32_t r = cell->head_relation; r != 0; r = relations[r].next) {
+        if (r == rel_id) return true;
     }
+    return false;
 }
 
 /*
@@ -512,22 +1398,31 @@ static void handle_way (OSMPBF__Way *way, ProtobufCBinaryData *string_table) {
 */
 static void handle_relation (OSMPBF__Relation* relation, ProtobufCBinaryData *string_table) {
     if (relation->n_memids == 0) return; // logic below expects at least one member reference
+    if (relation->id > MAX_REL_ID)
+        die("OSM data contains relations with larger IDs than expected.");
+    arena_ensure (relations_arena, (relation->id + 1) * sizeof(Relation));
     Relation *r = &(relations[relation->id]); // the Vex struct into which we are copying the PBF relation
+    LoaderThread *lt = get_loader_thread();
+    /* When resuming, relations that were loaded after the last checkpoint may already be in the grid. */
+    bool replayed = resuming && r->member_offset != 0;
     r->member_offset = n_rel_members;
     RelMember *rm = &(rel_members[n_rel_members]);
     /* Check to avoid writing past the end of the relation members file. */
-    if (n_rel_members + relation->n_memids >= MAX_REL_MEMBERS) {
+    if ((uint64_t) n_rel_members + relation->n_memids >= MAX_REL_MEMBERS) {
         die ("relation members index is about to exceed its maximum allowed value.");
     }
+    arena_ensure (rel_members_arena, (n_rel_members + relation->n_memids) * sizeof(RelMember));
     /* Copy all the relation members from PBF into the VEx array. */
     int64_t last_id = 0;
     for (int m = 0; m < relation->n_memids; m++, n_rel_members++, rm++) {
-        rm->role = encode_role(string_table[relation->roles_sid[m]]);
+        StringClass *role_class = classify_string (lt, string_table, relation->roles_sid[m]);
+        if (role_class->role < 0) role_class->role = encode_role(string_table[relation->roles_sid[m]]);
+        rm->role = role_class->role;
         /* OSMPBF NODE, WAY, RELATION constants use the same ints as ours. */
         rm->element_type = relation->types[m];
         int64_t id = relation->memids[m] + last_id; // delta-decode
         last_id = id;
-        rm->id = (uint32_t)id; // currently, 2^31 < max osmid < 2^32
+        rm->id = id;
     }
     (rm - 1)->id *= -1; // Negate the last relation member id to signal the end of the list
     /* Save tags to compacted tag array, and record the index where this relation's tag list begins. */
@@ -536,16 +1431,410 @@ static void handle_relation (OSMPBF__Relation* relation, ProtobufCBinaryData *st
     /* Insert this relation at the head of a linked list in its containing spatial index grid cell.
        The GridCell's head field is initially set to zero since it is in a new mmapped file. */
     GridCell *grid_cell = get_grid_cell_for_relation (r);
-    r->next = 0; // zero means no next relation in this grid cell (we start real relations at index 1).
-    if (grid_cell != NULL) {
-        r->next = grid_cell->head_relation;
-        grid_cell->head_relation = relation->id;
+    if ( ! (replayed && grid_cell_contains_relation (grid_cell, relation->id))) {
+        r->next = 0; // zero means no next relation in this grid cell (we start real relations at index 1).
+        if (grid_cell != NULL) {
+            r->next = grid_cell->head_relation;
+            grid_cell->head_relation = relation->id;
+        }
     }
+    /* Relations are only loaded on one thread, so they can update the totals directly. */
+    if (relation->id < min_ids[RELATION]) min_ids[RELATION] = relation->id;
+    if (relation->id > max_ids[RELATION]) max_ids[RELATION] = relation->id;
     rels_loaded++;
     if (rels_loaded % 1000 == 0)
         fprintf(stderr, "loaded %ldk relations\n", rels_loaded / 1000);
 }
 
+/* 
+  Apply the grid insertions staged in a loader thread, and add the counts and ID ranges it has
+  accumulated to the totals. Only call this while the thread is not running any callbacks.
+*/
+static void apply_loader_thread (LoaderThread *lt) {
+    store_pending (lt);
+    flush_staged_ways (lt);
+    nodes_loaded += lt->nodes_pending;
+    ways_loaded += lt->ways_pending;
+    lt->nodes_pending = 0;
+    lt->ways_pending = 0;
+    for (int t = NODE; t <= RELATION; t++) {
+        if (lt->min_ids[t] < min_ids[t]) min_ids[t] = lt->min_ids[t];
+        if (lt->max_ids[t] > max_ids[t]) max_ids[t] = lt->max_ids[t];
+    }
+}
+
+/* Apply the pending work of all loader threads, then release their state. */
+static void finish_loader_threads () {
+    LoaderThread *lt = loader_threads;
+    while (lt != NULL) {
+        LoaderThread *next = lt->next;
+        apply_loader_thread (lt);
+        free (lt->staged_ways);
+        free (lt->pending_nodes);
+        free (lt->pending_ways);
+        free (lt->pending_ids);
+        free (lt->pending_internal);
+        free (lt->strings);
+        free (lt->tags.data);
+        free (lt);
+        lt = next;
+    }
+    loader_threads = NULL;
+    loader_thread = NULL;
+}
+
+/*
+  Write a small file into the database directory, replacing any existing file of the same name
+  atomically by writing to a temporary file and renaming it once its contents are on disk.
+*/
+static void write_db_file (const char *name, void *data, size_t size) {
+    char tmp_path[sizeof(path_buf)];
+    char tmp_name[64];
+    snprintf (tmp_name, sizeof(tmp_name), "%s.tmp", name);
+    strcpy (tmp_path, make_db_path (tmp_name, 0));
+    FILE *file = fopen (tmp_path, "w");
+    if (file == NULL) die ("Could not open database file for writing.");
+    if (fwrite (data, size, 1, file) != 1 || fflush (file) != 0 || fsync (fileno (file)) != 0)
+        die ("Could not write database file.");
+    fclose (file);
+    if (rename (tmp_path, make_db_path (name, 0)) != 0)
+        die ("Could not rename database file.");
+}
+
+/* Read a small file written by write_db_file. Returns false if the file does not exist. */
+static bool read_db_file (const char *name, void *data, size_t size) {
+    FILE *file = fopen (make_db_path (name, 0), "r");
+    if (file == NULL) return false;
+    if (fread (data, size, 1, file) != 1) die ("Database file is truncated.");
+    fclose (file);
+    return true;
+}
+
+/*
+  The superblock describes a database as a whole. It records the layout parameters the database was
+  built with, so a program compiled with different parameters will refuse to open it instead of
+  misreading it, as well as the allocation cursors, element counts and ID ranges left by the loader.
+  It is kept in the file 'superblock' in the database directory and rewritten at the start and end
+  of each load and at every checkpoint. The version must be incremented whenever this struct or the
+  layout of any mapped file changes.
+*/
+#define SUPERBLOCK_MAGIC "VEXSUPER"
+#define SUPERBLOCK_VERSION 10
+#define DB_LOADING  1
+#define DB_COMPLETE 2
+#define DB_UPDATING 3 // an OsmChange file is being applied, see apply_changes
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t state;             // DB_LOADING, DB_COMPLETE or DB_UPDATING
+    /* Layout parameters, which must match those compiled into the program. */
+    uint32_t grid_bits;
+    uint32_t way_block_size;
+    uint32_t max_subfiles;
+    uint32_t struct_sizes[6];   // sizes of Node, Way, Relation, RelMember, WayBlock and GridCell
+    uint64_t max_node_id;
+    uint64_t max_way_id;
+    uint64_t max_rel_id;
+    uint64_t max_nodes;
+    uint64_t max_ways;
+    uint64_t max_rel_members;
+    uint64_t max_node_ref_units;
+    uint64_t max_way_blocks;
+    /* Allocation cursors, giving the used part of each append-only file. */
+    uint32_t n_node_refs;
+    uint32_t way_block_count;
+    uint32_t n_rel_members;
+    uint32_t n_node_ids;        // internal node and way IDs allocated, see iddir.c
+    uint32_t n_way_ids;
+    uint32_t load_epoch;        // incremented by every load, including resumed ones
+    uint64_t tag_pos[MAX_SUBFILES];
+    /* Number of elements loaded and their ID ranges, indexed by NODE, WAY and RELATION. */
+    int64_t counts[3];
+    int64_t min_ids[3];
+    int64_t max_ids[3];
+    int64_t load_started;       // Unix times at which the load began and completed
+    int64_t load_finished;
+    uint32_t dictionary_hash;   // hash of the learned tag dictionary, or zero for the built-in one
+    /* The compacted way index, see compact_way_index. */
+    uint32_t cell_index_slot;   // which set of cell_offsets and cell_ways files is in use, or zero
+    uint32_t compacted_way_blocks;
+    uint64_t n_cell_ways;
+    uint64_t n_cell_node_bytes; // the size of the clustered node store, or zero if there is none
+    /* Updates applied since the load, see apply_changes. */
+    uint32_t n_updates;
+    int64_t last_update;        // Unix time at which the last update was applied
+    uint64_t load_id;           // microseconds since the epoch at which the load began, see cell_generations
+} Superblock;
+
+static Superblock superblock;
+
+/* Fill in the layout parameters of this program. */
+static void superblock_layout (Superblock *sb) {
+    memcpy (sb->magic, SUPERBLOCK_MAGIC, sizeof(sb->magic));
+    sb->version = SUPERBLOCK_VERSION;
+    sb->grid_bits = GRID_BITS;
+    sb->way_block_size = WAY_BLOCK_SIZE;
+    sb->max_subfiles = MAX_SUBFILES;
+    sb->struct_sizes[0] = sizeof(Node);
+    sb->struct_sizes[1] = sizeof(Way);
+    sb->struct_sizes[2] = sizeof(Relation);
+    sb->struct_sizes[3] = sizeof(RelMember);
+    sb->struct_sizes[4] = sizeof(WayBlock);
+    sb->struct_sizes[5] = sizeof(GridCell);
+    sb->max_node_id = MAX_NODE_ID;
+    sb->max_way_id = MAX_WAY_ID;
+    sb->max_rel_id = MAX_REL_ID;
+    sb->max_nodes = MAX_NODES;
+    sb->max_ways = MAX_WAYS;
+    sb->max_rel_members = MAX_REL_MEMBERS;
+    sb->max_node_ref_units = MAX_NODE_REF_UNITS;
+    sb->max_way_blocks = MAX_WAY_BLOCKS;
+}
+
+/*
+  Read and validate the superblock of the database, if it has one.
+  Returns false for a new database, dies if the database was built with a different layout.
+*/
+static bool open_superblock () {
+    if (in_memory) return false; // shared memory objects do not outlive the loading process
+    if (!read_db_file ("superblock", &superblock, sizeof(superblock))) return false;
+    if (memcmp (superblock.magic, SUPERBLOCK_MAGIC, sizeof(superblock.magic)) != 0)
+        die ("Database superblock is not valid.");
+    if (superblock.version != SUPERBLOCK_VERSION)
+        die ("Database was built by an incompatible version of vex.");
+    Superblock expected = superblock;
+    superblock_layout (&expected);
+    if (memcmp (&expected, &superblock, sizeof(superblock)) != 0)
+        die ("Database was built with different layout parameters than this program.");
+    return true;
+}
+
+/* Copy the allocation cursors, counts and ID ranges into the superblock. */
+static void superblock_capture (Superblock *sb) {
+    sb->n_node_refs = n_node_refs;
+    sb->way_block_count = way_block_count;
+    sb->n_rel_members = n_rel_members;
+    sb->n_node_ids = node_dir.n_ids;
+    sb->n_way_ids = way_dir.n_ids;
+    sb->load_epoch = node_dir.epoch;
+    sb->cell_index_slot = cell_index_slot;
+    sb->compacted_way_blocks = compacted_way_blocks;
+    sb->n_cell_ways = n_cell_ways;
+    sb->n_cell_node_bytes = n_cell_node_bytes;
+    for (int s = 0; s < MAX_SUBFILES; s++)
+        sb->tag_pos[s] = tag_subfiles[s].pos;
+    sb->counts[NODE] = nodes_loaded;
+    sb->counts[WAY] = ways_loaded;
+    sb->counts[RELATION] = rels_loaded;
+    for (int t = NODE; t <= RELATION; t++) {
+        sb->min_ids[t] = min_ids[t];
+        sb->max_ids[t] = max_ids[t];
+    }
+}
+
+/* Restore the allocation cursors, counts and ID ranges from the superblock. */
+static void superblock_restore (Superblock *sb) {
+    n_node_refs = sb->n_node_refs;
+    way_block_count = sb->way_block_count;
+    n_rel_members = sb->n_rel_members;
+    if (sb->n_node_ids != 0) node_dir.n_ids = node_dir.restored = sb->n_node_ids;
+    if (sb->n_way_ids != 0) way_dir.n_ids = way_dir.restored = sb->n_way_ids;
+    node_dir.epoch = way_dir.epoch = sb->load_epoch;
+    cell_index_slot = sb->cell_index_slot;
+    compacted_way_blocks = sb->compacted_way_blocks;
+    n_cell_ways = sb->n_cell_ways;
+    n_cell_node_bytes = sb->n_cell_node_bytes;
+    for (int s = 0; s < MAX_SUBFILES; s++) {
+        if (sb->tag_pos[s] == 0) continue;
+        tag_subfile (s)->pos = sb->tag_pos[s];
+    }
+    nodes_loaded = sb->counts[NODE];
+    ways_loaded = sb->counts[WAY];
+    rels_loaded = sb->counts[RELATION];
+    for (int t = NODE; t <= RELATION; t++) {
+        min_ids[t] = sb->min_ids[t];
+        max_ids[t] = sb->max_ids[t];
+    }
+}
+
+/* Record the current state of the database in its superblock, and save the superblock. */
+static void save_superblock (uint32_t state) {
+    superblock_layout (&superblock);
+    superblock_capture (&superblock);
+    if (state == DB_COMPLETE && superblock.state == DB_LOADING) superblock.load_finished = time (NULL);
+    superblock.state = state;
+    if (!in_memory) write_db_file ("superblock", &superblock, sizeof(superblock));
+}
+
+/*
+  Learn a tag dictionary from every nth block of the input file, and use it for the rest of the load.
+  It is saved in the file 'dictionary' in the database directory, in the same format as tags.txt,
+  and its hash is recorded in the superblock.
+*/
+static void learn_dictionary (const char *filename, int every) {
+    fprintf(stderr, "Learning the tag dictionary from one in %d blocks of the input.\n", every);
+    TagStats_read (filename, every);
+    char *text;
+    size_t size;
+    FILE *out = open_memstream (&text, &size);
+    if (out == NULL) die ("Could not allocate tag dictionary.");
+    TagStats_write_dictionary (out);
+    fclose (out);
+    TagStats_clear ();
+    if (!in_memory) write_db_file ("dictionary", text, size);
+    superblock.dictionary_hash = tag_dictionary_load (text, size);
+    free (text);
+}
+
+/* Map the compacted way index of an existing database, if it has one. */
+static void open_way_index () {
+    cell_index_slot = superblock.cell_index_slot;
+    compacted_way_blocks = superblock.compacted_way_blocks;
+    n_cell_ways = superblock.n_cell_ways;
+    n_cell_node_bytes = superblock.n_cell_node_bytes;
+    if (cell_index_slot == 0) return;
+    cell_offsets = map_file ("cell_offsets", cell_index_slot, sizeof(uint32_t) * GRID_DIM * GRID_DIM);
+    cell_ways    = map_arena ("cell_ways",   cell_index_slot, sizeof(int32_t) * MAX_CELL_WAYS, ARENA_DENSE)->base;
+    if (n_cell_node_bytes == 0) return;
+    cell_node_offsets = map_file ("cell_node_offsets", cell_index_slot, sizeof(uint64_t) * GRID_DIM * GRID_DIM);
+    cell_nodes        = map_arena ("cell_nodes",       cell_index_slot, MAX_CELL_NODE_BYTES, ARENA_DENSE)->base;
+}
+
+/* Use the learned tag dictionary of an existing database, if it has one. */
+static void open_dictionary () {
+    if (superblock.dictionary_hash == 0) return;
+    struct stat st;
+    if (stat (make_db_path ("dictionary", 0), &st) != 0) die ("Database tag dictionary is missing.");
+    char *text = malloc (st.st_size);
+    if (text == NULL) die ("Could not allocate tag dictionary.");
+    read_db_file ("dictionary", text, st.st_size);
+    if (tag_dictionary_load (text, st.st_size) != superblock.dictionary_hash)
+        die ("Database tag dictionary is not the one the database was loaded with.");
+    free (text);
+}
+
+/*
+  The state needed to continue an interrupted load, saved in the database directory alongside the
+  mapped files. This is a copy of the superblock as of the resume point, since the superblock itself
+  may be saved again before the checkpoint file is replaced. The input file's size and modification
+  time are recorded to make sure a load is only ever resumed from the same input.
+*/
+#define CHECKPOINT_MAGIC "VEXCKPT2"
+typedef struct {
+    char magic[8];
+    uint64_t pbf_size;
+    int64_t pbf_mtime;
+    PbfResumePoint resume;
+    Superblock db;
+} Checkpoint;
+
+/* The input file of the current load, whose identity is recorded in checkpoints. */
+static const char *load_filename;
+
+/* Fill in the identity of the input file in a checkpoint. */
+static void checkpoint_identify_input (Checkpoint *ckpt) {
+    struct stat st;
+    if (stat(load_filename, &st) != 0) die ("Could not stat input file.");
+    ckpt->pbf_size = st.st_size;
+    ckpt->pbf_mtime = st.st_mtime;
+}
+
+/*
+  Checkpoint callback handed to the general-purpose PBF loading code. It is called when no other
+  callbacks are running, so all the loader threads' pending work can be applied here. The mapped
+  files are flushed to disk before the checkpoint file is replaced, so a checkpoint never describes
+  data that was not yet written.
+*/
+static void handle_checkpoint (PbfResumePoint *resume) {
+    for (LoaderThread *lt = loader_threads; lt != NULL; lt = lt->next)
+        apply_loader_thread (lt);
+    sync_mappings ();
+    save_superblock (DB_LOADING);
+    Checkpoint ckpt;
+    memset (&ckpt, 0, sizeof(ckpt));
+    memcpy (ckpt.magic, CHECKPOINT_MAGIC, sizeof(ckpt.magic));
+    checkpoint_identify_input (&ckpt);
+    ckpt.resume = *resume;
+    ckpt.db = superblock;
+    write_db_file ("checkpoint", &ckpt, sizeof(ckpt));
+    fprintf(stderr, "checkpoint at position %ldMB: %ld nodes, %ld ways, %ld relations loaded.\n",
+            (long)(resume->offset / 1024 / 1024), nodes_loaded, ways_loaded, rels_loaded);
+}
+
+/*
+  Restore the state saved in the checkpoint file, so a load can continue from its resume point.
+  Elements loaded after the checkpoint was taken are loaded again, which handle_way and handle_relation
+  tolerate when the resuming flag is set.
+*/
+static void restore_checkpoint (PbfResumePoint *resume) {
+    Checkpoint ckpt, input;
+    if (!read_db_file ("checkpoint", &ckpt, sizeof(ckpt)))
+        die ("No checkpoint found in database, cannot resume.");
+    if (memcmp (ckpt.magic, CHECKPOINT_MAGIC, sizeof(ckpt.magic)) != 0)
+        die ("Checkpoint file is not valid.");
+    checkpoint_identify_input (&input);
+    if (input.pbf_size != ckpt.pbf_size || input.pbf_mtime != ckpt.pbf_mtime)
+        die ("Input file has changed since the checkpoint was taken.");
+    *resume = ckpt.resume;
+    superblock = ckpt.db;
+    superblock_restore (&superblock);
+    /* Way blocks allocated after the checkpoint may already be linked into the grid, so keep them. */
+    while ((way_block_count + 1) * sizeof(WayBlock) <= way_blocks_arena->size &&
+           way_blocks[way_block_count].refs[WAY_BLOCK_SIZE-1] != 0)
+        way_block_count++;
+    resuming = true;
+    fprintf(stderr, "resuming from checkpoint: %ld nodes, %ld ways, %ld relations already loaded.\n",
+            nodes_loaded, ways_loaded, rels_loaded);
+}
+
+/* Print one line of the capacity report. */
+static void print_capacity (const char *name, uint64_t used, uint64_t max) {
+    printf ("  %-12s %12"PRIu64" of %12"PRIu64" (%.2f%%)\n", name, used, max, used * 100.0 / max);
+}
+
+/* Print the contents of the superblock: layout parameters, element counts and used capacity. */
+static void print_superblock () {
+    Superblock *sb = &superblock;
+    const char *names[3] = { "nodes", "ways", "relations" };
+    printf ("database %s, format version %u, %s\n", database_path, sb->version,
+            sb->state == DB_COMPLETE ? "complete" : sb->state == DB_UPDATING ? "update in progress or interrupted"
+                                                                            : "load in progress or interrupted");
+    time_t started = sb->load_started, finished = sb->load_finished, updated = sb->last_update;
+    printf ("load started %s", ctime (&started));
+    if (sb->state != DB_LOADING) printf ("load finished %s", ctime (&finished));
+    if (sb->n_updates > 0) printf ("%u updates applied, the last %s", sb->n_updates, ctime (&updated));
+    printf ("generation %"PRIu64".%u\n", sb->load_id, sb->n_updates);
+    printf ("grid %d bits, way blocks of %d refs\n", sb->grid_bits, sb->way_block_size);
+    for (int t = NODE; t <= RELATION; t++) {
+        if (sb->counts[t] == 0) printf ("%s: none\n", names[t]);
+        else printf ("%s: %"PRId64" with IDs %"PRId64" to %"PRId64"\n", names[t], sb->counts[t],
+                     sb->min_ids[t], sb->max_ids[t]);
+    }
+    printf ("capacity used:\n");
+    print_capacity ("node IDs", sb->counts[NODE] ? sb->max_ids[NODE] : 0, sb->max_node_id);
+    print_capacity ("way IDs", sb->counts[WAY] ? sb->max_ids[WAY] : 0, sb->max_way_id);
+    print_capacity ("nodes", sb->n_node_ids, sb->max_nodes);
+    print_capacity ("ways", sb->n_way_ids, sb->max_ways);
+    print_capacity ("relation IDs", sb->counts[RELATION] ? sb->max_ids[RELATION] : 0, sb->max_rel_id);
+    print_capacity ("node ref units", sb->n_node_refs, sb->max_node_ref_units);
+    print_capacity ("way blocks", sb->way_block_count, sb->max_way_blocks);
+    if (sb->cell_index_slot != 0)
+        print_capacity ("cell ways", sb->n_cell_ways, 2 * sb->max_ways);
+    if (sb->n_cell_node_bytes != 0)
+        printf ("clustered nodes: %sB\n", human (sb->n_cell_node_bytes));
+    print_capacity ("rel members", sb->n_rel_members, sb->max_rel_members);
+    uint64_t tag_bytes = 0;
+    int n_subfiles = 0;
+    for (int s = 0; s < sb->max_subfiles; s++) {
+        if (sb->tag_pos[s] == 0) continue;
+        tag_bytes += sb->tag_pos[s];
+        n_subfiles++;
+    }
+    printf ("tags: %sB in %d subfiles\n", human (tag_bytes), n_subfiles);
+    if (sb->dictionary_hash == 0) printf ("tag dictionary: built in\n");
+    else printf ("tag dictionary: learned from the input (hash %08x)\n", sb->dictionary_hash);
+}
+
 /*
   Used for setting the grid side empirically.
   With 8 bit (256x256) grid, planet.pbf gives 36.87% full
@@ -553,19 +1842,502 @@ static void handle_relation (OSMPBF__Relation* relation, ProtobufCBinaryData *st
 */
 static void fillFactor () {
     int used = 0;
-    for (int i = 0; i < GRID_DIM; ++i) {
-        for (int j = 0; j < GRID_DIM; ++j) {
-            if (grid->cells[i][j].head_way_block != 0) used++;
-        }
+    for (int c = 0; c < GRID_DIM * GRID_DIM; ++c) {
+        if (grid->cells[c].head_way_block != 0) used++;
     }
     fprintf(stderr, "index grid: %d used, %.2f%% full\n",
         used, ((double)used) / (GRID_DIM * GRID_DIM) * 100);
 }
 
+/* Order way IDs for qsort. */
+static int compare_way_ids (const void *a, const void *b) {
+    int32_t x = *(const int32_t *) a, y = *(const int32_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Order node IDs for qsort. */
+static int compare_node_ids (const void *a, const void *b) {
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+  Copy the nodes used by the given ways into a cell's part of a clustered node store, as described
+  at cell_nodes. The node ID buffer is reused between calls. Returns the number of bytes written.
+*/
+static size_t write_cell_nodes (Arena *store, uint64_t offset, uint32_t c, int32_t *way_ids, size_t n_ways,
+                                int64_t **node_ids, size_t *node_ids_size) {
+    size_t n = 0;
+    for (size_t w = 0; w < n_ways; w++) {
+        NodeRefReader refs;
+        uint32_t n_refs = node_refs_open (&refs, way_for_id (way_ids[w])->node_ref_offset);
+        if (n + n_refs > *node_ids_size) {
+            *node_ids_size = (n + n_refs) * 2;
+            *node_ids = realloc (*node_ids, *node_ids_size * sizeof(int64_t));
+            if (*node_ids == NULL) die ("Could not allocate clustered nodes.");
+        }
+        for (uint32_t r = 0; r < n_refs; r++)
+            (*node_ids)[n++] = node_refs_next (&refs);
+    }
+    qsort (*node_ids, n, sizeof(int64_t), compare_node_ids);
+    size_t n_unique = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (n_unique == 0 || (*node_ids)[i] != (*node_ids)[n_unique - 1]) (*node_ids)[n_unique++] = (*node_ids)[i];
+    }
+    /* A record takes at most ten bytes for the ID difference and five for each of the other fields. */
+    if (offset + 10 + 25 * (uint64_t) n_unique > store->reserved)
+        die ("More clustered node bytes are needed than expected.");
+    arena_ensure (store, offset + 10 + 25 * (uint64_t) n_unique);
+    uint8_t *out = (uint8_t *) store->base + offset;
+    coord_t origin = cell_origin (c);
+    size_t pos = uint64_pack (n_unique, out);
+    int64_t last_id = 0;
+    for (size_t i = 0; i < n_unique; i++) {
+        Node node = *node_for_id ((*node_ids)[i]);
+        pos += sint64_pack ((*node_ids)[i] - last_id, out + pos);
+        pos += sint64_pack ((int32_t) ((uint32_t) node.coord.x - (uint32_t) origin.x), out + pos);
+        pos += sint64_pack ((int32_t) ((uint32_t) node.coord.y - (uint32_t) origin.y), out + pos);
+        pos += uint64_pack (node.tags, out + pos);
+        last_id = (*node_ids)[i];
+    }
+    return pos;
+}
+
+/* Give back the disk space of way blocks that are no longer part of any list, where possible. */
+static void release_way_blocks (uint32_t end) {
+    size_t page = sysconf (_SC_PAGESIZE);
+    size_t first = (sizeof(WayBlock) + page - 1) / page * page; // block zero is never used
+    size_t last = (size_t) end * sizeof(WayBlock) / page * page;
+    if (last <= first) return;
+    if (madvise ((uint8_t *) way_blocks + first, last - first, MADV_REMOVE) != 0)
+        fprintf(stderr, "Could not release old way blocks, they will keep their disk space.\n");
+}
+
+/*
+  Rewrite the way index as one sorted run of way IDs per grid cell, merging the current runs with any
+  way blocks added since the last compaction. The new runs are written to the set of files not in use
+  and flushed to disk before the superblock is switched over to them, so an interrupted compaction
+  leaves the database as it was. If requested, a clustered node store is built from the new runs.
+*/
+static void compact_way_index (bool with_nodes) {
+    uint32_t old_slot = cell_index_slot;
+    uint32_t slot = (old_slot == 1) ? 2 : 1;
+    unlink (make_db_path ("cell_offsets", slot)); // left by an interrupted compaction
+    unlink (make_db_path ("cell_ways", slot));
+    unlink (make_db_path ("cell_node_offsets", slot));
+    unlink (make_db_path ("cell_nodes", slot));
+    uint32_t *new_offsets = map_file ("cell_offsets", slot, sizeof(uint32_t) * GRID_DIM * GRID_DIM);
+    Arena *ways_store = map_arena ("cell_ways", slot, sizeof(int32_t) * MAX_CELL_WAYS, ARENA_DENSE);
+    int32_t *new_ways = ways_store->base;
+    uint64_t *new_node_offsets = NULL;
+    Arena *nodes_store = NULL;
+    if (with_nodes) {
+        new_node_offsets = map_file ("cell_node_offsets", slot, sizeof(uint64_t) * GRID_DIM * GRID_DIM);
+        nodes_store = map_arena ("cell_nodes", slot, MAX_CELL_NODE_BYTES, ARENA_DENSE);
+    }
+    int64_t *node_ids = NULL;
+    size_t node_ids_size = 0;
+    uint64_t n = 1; // offset zero means a cell has no run
+    uint64_t n_node_bytes = 1; // and likewise has no nodes
+    uint64_t n_blocks = 0, n_cells = 0;
+    int32_t *ids = NULL;
+    size_t ids_size = 0;
+    GridCell *cells = grid->cells;
+    for (uint32_t c = 0; c < GRID_DIM * GRID_DIM; c++) {
+        /* Gather the ways in the cell's current run and its way blocks. */
+        size_t n_ids = 0;
+        int32_t *run = cell_run (&(cells[c]));
+        size_t max_ids = (run == NULL ? 0 : run[0]);
+        for (uint32_t wbi = cells[c].head_way_block; wbi >= compacted_way_blocks && wbi != 0; wbi = way_blocks[wbi].next)
+            max_ids += WAY_BLOCK_SIZE;
+        if (max_ids == 0) continue;
+        if (max_ids > ids_size) {
+            ids_size = max_ids * 2;
+            ids = realloc (ids, ids_size * sizeof(int32_t));
+            if (ids == NULL) die ("Could not allocate way index.");
+        }
+        if (run != NULL) {
+            memcpy (ids, run + 1, run[0] * sizeof(int32_t));
+            n_ids = run[0];
+        }
+        for (uint32_t wbi = cells[c].head_way_block; wbi >= compacted_way_blocks && wbi != 0; wbi = way_blocks[wbi].next) {
+            WayBlock *wb = &(way_blocks[wbi]);
+            for (int w = 0; w < WAY_BLOCK_SIZE && wb->refs[w] > 0; w++)
+                ids[n_ids++] = wb->refs[w];
+            n_blocks++;
+        }
+        /* Sort the ways and drop any that were listed twice, as a resumed load may do. */
+        qsort (ids, n_ids, sizeof(int32_t), compare_way_ids);
+        size_t n_unique = 0;
+        for (size_t i = 0; i < n_ids; i++) {
+            if (n_unique == 0 || ids[i] != ids[n_unique - 1]) ids[n_unique++] = ids[i];
+        }
+        if (n_unique == 0) continue;
+        if (n + 1 + n_unique > MAX_CELL_WAYS) die ("More cell way entries are needed than expected.");
+        arena_ensure (ways_store, (n + 1 + n_unique) * sizeof(int32_t));
+        new_offsets[c] = n;
+        new_ways[n] = n_unique;
+        memcpy (&(new_ways[n + 1]), ids, n_unique * sizeof(int32_t));
+        n += 1 + n_unique;
+        n_cells++;
+        if (with_nodes) {
+            new_node_offsets[c] = n_node_bytes;
+            n_node_bytes += write_cell_nodes (nodes_store, n_node_bytes, c, ids, n_unique, &node_ids, &node_ids_size);
+        }
+    }
+    free (ids);
+    free (node_ids);
+    /* Only switch the database over to the new runs once they are on disk. */
+    sync_mappings ();
+    cell_index_slot = slot;
+    n_cell_ways = n;
+    n_cell_node_bytes = with_nodes ? n_node_bytes : 0;
+    compacted_way_blocks = way_block_count;
+    superblock_capture (&superblock);
+    write_db_file ("superblock", &superblock, sizeof(superblock));
+    if (old_slot != 0) {
+        unlink (make_db_path ("cell_offsets", old_slot));
+        unlink (make_db_path ("cell_ways", old_slot));
+        unlink (make_db_path ("cell_node_offsets", old_slot));
+        unlink (make_db_path ("cell_nodes", old_slot));
+    }
+    release_way_blocks (compacted_way_blocks);
+    fprintf(stderr, "compacted %"PRIu64" way blocks into runs for %"PRIu64" cells, %sB of way IDs.\n",
+            n_blocks, n_cells, human (n * sizeof(int32_t)));
+    if (with_nodes) fprintf(stderr, "clustered the nodes of those cells into %sB.\n", human (n_node_bytes));
+}
+
+/*
+  An OsmChange file, such as a minutely, hourly or daily replication diff, is applied to a complete
+  database in place, on one thread. New and modified elements get new tag lists and node ref lists
+  appended, as in a load, and the old ones are left unused. Ways are kept in the grid cell of their
+  first node, and relations in that of their first member, so when a node moves to another cell the
+  ways and relations that begin with it move with it, and likewise for ways and the relations that
+  begin with them. Deleted ways and relations are removed from the grid. Deleted nodes are left where
+  they are, since nodes are only reached through ways. The clustered node store made by compact -n
+  is a copy of the nodes, so it is no longer used once anything has been applied.
+*/
+
+/* The number of elements created, modified and deleted by the file being applied, by OSC action. */
+static long n_applied[3];
+
+/* A growable list of way or relation IDs, collected from a grid cell before they are moved. */
+static int64_t *moving_ids = NULL;
+static size_t n_moving_ids, moving_ids_size;
+
+static void add_moving_id (int64_t id) {
+    if (n_moving_ids == moving_ids_size) {
+        moving_ids_size = moving_ids_size == 0 ? 64 : moving_ids_size * 2;
+        moving_ids = realloc (moving_ids, moving_ids_size * sizeof(int64_t));
+        if (moving_ids == NULL) die ("Could not allocate list of moving elements.");
+    }
+    moving_ids[n_moving_ids++] = id;
+}
+
+/* Record that the current update changed a grid cell. */
+static void touch_cell (GridCell *cell) {
+    if (cell != NULL) cell_generations[cell - grid->cells] = superblock.n_updates;
+}
+
+/* Get the number of ways in a way block, which is filled from the front. */
+static int way_block_fill (WayBlock *wb) {
+    int32_t last = wb->refs[WAY_BLOCK_SIZE - 1];
+    return last >= 0 ? WAY_BLOCK_SIZE : WAY_BLOCK_SIZE + last;
+}
+
+/* Widen a rectangle of cells to take in the cell with the given bins. */
+static void reach_add (CellReach *reach, uint32_t x, uint32_t y) {
+    if (reach->end_x == 0) {
+        reach->min_x = x;
+        reach->min_y = y;
+        reach->end_x = x + 1;
+        reach->end_y = y + 1;
+        return;
+    }
+    if (x < reach->min_x) reach->min_x = x;
+    if (y < reach->min_y) reach->min_y = y;
+    if (x >= reach->end_x) reach->end_x = x + 1;
+    if (y >= reach->end_y) reach->end_y = y + 1;
+}
+
+/* Widen a rectangle of cells to take in another. */
+static void reach_merge (CellReach *reach, CellReach *other) {
+    if (other->end_x == 0) return;
+    reach_add (reach, other->min_x, other->min_y);
+    reach_add (reach, other->end_x - 1, other->end_y - 1);
+}
+
+/* Widen the reach of the grid cell a way is stored in to take in the cells of all the way's nodes. */
+static void reach_way (GridCell *cell, int32_t way_id) {
+    uint32_t c = cell - grid->cells;
+    coord_t origin = cell_origin (c);
+    NodeRefReader refs;
+    uint32_t n_refs = node_refs_open (&refs, way_for_id (way_id)->node_ref_offset);
+    for (uint32_t r = 0; r < n_refs; r++) {
+        Node *node = node_for_id (node_refs_next (&refs));
+        if (node == &(nodes[0])) continue; // not loaded, so it has no cell
+        uint32_t x = bin (node->coord.x), y = bin (node->coord.y);
+        if (x != bin (origin.x) || y != bin (origin.y)) reach_add (&(cell_reach[c]), x, y);
+    }
+}
+
+/* Find the reach of every grid cell from the ways loaded, before the first update changes them. */
+static void build_cell_reach () {
+    fprintf (stderr, "Finding the cells holding the nodes of each cell's ways.\n");
+    for (uint32_t c = 0; c < GRID_DIM * GRID_DIM; c++) {
+        GridCell *cell = &(grid->cells[c]);
+        int32_t *run = cell_run (cell);
+        if (run != NULL) {
+            for (int32_t w = 1; w <= run[0]; w++) reach_way (cell, run[w]);
+        }
+        for (uint32_t wbi = cell->head_way_block; wbi >= compacted_way_blocks && wbi != 0; wbi = way_blocks[wbi].next) {
+            WayBlock *wb = &(way_blocks[wbi]);
+            int n = way_block_fill (wb);
+            for (int w = 0; w < n; w++) reach_way (cell, wb->refs[w]);
+        }
+    }
+}
+
+/* Remove a way from the compacted run or the way blocks of a grid cell, returning whether it was there. */
+static bool grid_remove_way (GridCell *cell, int32_t way_id) {
+    int32_t *run = cell_run (cell);
+    if (run != NULL) {
+        int32_t lo = sorted_lower_bound (run + 1, run[0], way_id);
+        if (lo < run[0] && run[1 + lo] == way_id) {
+            memmove (&(run[1 + lo]), &(run[2 + lo]), (run[0] - lo - 1) * sizeof(int32_t));
+            run[0]--;
+            return true;
+        }
+    }
+    uint32_t head = cell->head_way_block;
+    for (uint32_t wbi = head; wbi >= compacted_way_blocks && wbi != 0; wbi = way_blocks[wbi].next) {
+        WayBlock *wb = &(way_blocks[wbi]);
+        int n = way_block_fill (wb);
+        for (int w = 0; w < n; w++) {
+            if (wb->refs[w] != way_id) continue;
+            /* Fill the gap with the last way in the head block, so every block stays filled from the front. */
+            WayBlock *hb = &(way_blocks[head]);
+            int k = way_block_fill (hb);
+            wb->refs[w] = hb->refs[k - 1];
+            hb->refs[k - 1] = 0;
+            hb->refs[WAY_BLOCK_SIZE - 1] = (k - 1) - WAY_BLOCK_SIZE;
+            /* Drop an emptied head block from the list, so the next gap can be filled from its successor. */
+            if (k == 1 && hb->next != 0) cell->head_way_block = hb->next;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Remove a relation from the list of relations in a grid cell, returning whether it was there. */
+static bool grid_remove_relation (GridCell *cell, uint32_t rel_id) {
+    for (uint32_t *link = &(cell->head_relation); *link != 0; link = &(relations[*link].next)) {
+        if (*link == rel_id) {
+            *link = relations[rel_id].next;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Move the relations of a grid cell whose first member is the given element into another cell. */
+static void move_relations (GridCell *from, GridCell *to, int element_type, int64_t id) {
+    n_moving_ids = 0;
+    for (uint32_t r = from->head_relation; r != 0; r = relations[r].next) {
+        RelMember *first = &(rel_members[relations[r].member_offset]);
+        if (first->element_type == element_type && llabs (first->id) == id) add_moving_id (r);
+    }
+    for (size_t i = 0; i < n_moving_ids; i++) {
+        uint32_t r = moving_ids[i];
+        grid_remove_relation (from, r);
+        relations[r].next = to->head_relation;
+        to->head_relation = r;
+    }
+}
+
+/* Move a way, and the relations beginning with it, from one grid cell to another. */
+static void move_way (GridCell *from, GridCell *to, int32_t way_id) {
+    if (from != NULL) grid_remove_way (from, way_id);
+    grid_insert_way (to, way_id);
+    if (from != NULL) move_relations (from, to, WAY, way_id);
+}
+
+/* Check whether a way begins with the given node. */
+static bool way_begins_with (int32_t way_id, int64_t node_id) {
+    NodeRefReader refs;
+    return node_refs_open (&refs, way_for_id (way_id)->node_ref_offset) > 0 && node_refs_next (&refs) == node_id;
+}
+
+/* Move the ways and relations beginning with a node that has moved from one grid cell to another. */
+static void move_first_node (GridCell *from, GridCell *to, int64_t node_id) {
+    n_moving_ids = 0;
+    int32_t *run = cell_run (from);
+    if (run != NULL) {
+        for (int32_t w = 1; w <= run[0]; w++)
+            if (way_begins_with (run[w], node_id)) add_moving_id (run[w]);
+    }
+    for (uint32_t wbi = from->head_way_block; wbi >= compacted_way_blocks && wbi != 0; wbi = way_blocks[wbi].next) {
+        WayBlock *wb = &(way_blocks[wbi]);
+        int n = way_block_fill (wb);
+        for (int w = 0; w < n; w++)
+            if (way_begins_with (wb->refs[w], node_id)) add_moving_id (wb->refs[w]);
+    }
+    /* Moving a way reuses the list for its relations, so take the ways from the end one at a time. */
+    while (n_moving_ids > 0) {
+        int32_t way_id = moving_ids[--n_moving_ids];
+        size_t remaining = n_moving_ids;
+        move_way (from, to, way_id);
+        reach_way (to, way_id);
+        n_moving_ids = remaining;
+    }
+    move_relations (from, to, NODE, node_id);
+}
+
+/* Get the internal ID of a node or way an update creates, making room for it in its directory page. */
+static uint32_t new_internal_id (IdDirectory *dir, int64_t id, Arena *arena, uint8_t *array, size_t size) {
+    IdMove moves[IDDIR_PAGE_SIZE];
+    int n_moves = IdDir_open_page (dir, id, moves);
+    arena_ensure (arena, (uint64_t) dir->n_ids * size);
+    for (int m = 0; m < n_moves; m++)
+        memcpy (array + (uint64_t) moves[m].to * size, array + (uint64_t) moves[m].from * size, size);
+    uint32_t internal;
+    IdDir_assign (dir, &id, 1, &internal);
+    arena_ensure (arena, (uint64_t) dir->n_ids * size);
+    return internal;
+}
+
+/* OsmChange node callback: store the node, moving what begins with it if it changes grid cell. */
+static void apply_node (int action, OSMPBF__Node *node, ProtobufCBinaryData *string_table) {
+    if (node->id <= 0 || node->id > MAX_NODE_ID) die ("OsmChange file contains a node ID out of range.");
+    n_applied[action]++;
+    if (action == OSC_DELETE) return;
+    uint32_t internal = IdDir_lookup (&node_dir, node->id);
+    bool existed = (internal != 0);
+    if (!existed) {
+        internal = new_internal_id (&node_dir, node->id, nodes_arena, (uint8_t *) nodes, sizeof(Node));
+        note_id_range (get_loader_thread (), NODE, node->id, node->id);
+        nodes_loaded++;
+    }
+    Node *n = &(nodes[internal]);
+    GridCell *from = get_grid_cell_for_coord (n->coord);
+    to_coord (&(n->coord), node->lat * 0.000000001, node->lon * 0.000000001);
+    GridCell *to = get_grid_cell_for_coord (n->coord);
+    if (existed && from != to) {
+        move_first_node (from, to, node->id);
+        reach_add (&(cell_moves[from - grid->cells]), bin (n->coord.x), bin (n->coord.y));
+    }
+    if (existed) touch_cell (from);
+    touch_cell (to);
+    n->tags = write_tags (node->keys, node->vals, node->n_keys, string_table, tag_subfile_for_id (node->id, NODE));
+}
+
+/* OsmChange way callback: store the way, moving it to another grid cell if its first node is in one. */
+static void apply_way (int action, OSMPBF__Way *way, ProtobufCBinaryData *string_table) {
+    if (way->id <= 0 || way->id > MAX_WAY_ID) die ("OsmChange file contains a way ID out of range.");
+    n_applied[action]++;
+    uint32_t internal = IdDir_lookup (&way_dir, way->id);
+    GridCell *from = (internal != 0) ? get_grid_cell_for_way (&(ways[internal])) : NULL;
+    touch_cell (from);
+    if (action == OSC_DELETE || way->n_refs == 0) {
+        if (from != NULL) {
+            grid_remove_way (from, way->id);
+            ways_loaded--;
+        }
+        if (internal != 0) memset (&(ways[internal]), 0, sizeof(Way));
+        return;
+    }
+    LoaderThread *lt = get_loader_thread ();
+    if (internal == 0) internal = new_internal_id (&way_dir, way->id, ways_arena, (uint8_t *) ways, sizeof(Way));
+    if (from == NULL) {
+        note_id_range (lt, WAY, way->id, way->id);
+        ways_loaded++;
+    }
+    Way *w = &(ways[internal]);
+    w->node_ref_offset = pack_node_refs (way, lt);
+    w->tags = write_tags (way->keys, way->vals, way->n_keys, string_table, tag_subfile_for_id (way->id, WAY));
+    GridCell *to = get_grid_cell_for_coord (node_for_id (way->refs[0])->coord);
+    if (from != to) move_way (from, to, way->id);
+    reach_way (to, way->id);
+    touch_cell (to);
+}
+
+/* OsmChange relation callback: take the relation out of its grid cell, then store it as in a load. */
+static void apply_relation (int action, OSMPBF__Relation *relation, ProtobufCBinaryData *string_table) {
+    if (relation->id <= 0 || relation->id > MAX_REL_ID) die ("OsmChange file contains a relation ID out of range.");
+    n_applied[action]++;
+    arena_ensure (relations_arena, (relation->id + 1) * sizeof(Relation));
+    Relation *r = &(relations[relation->id]);
+    bool existed = (r->member_offset != 0);
+    if (existed) {
+        GridCell *cell = get_grid_cell_for_relation (r);
+        if (cell != NULL) grid_remove_relation (cell, relation->id);
+        touch_cell (cell);
+        memset (r, 0, sizeof(Relation));
+        rels_loaded--;
+    }
+    if (action == OSC_DELETE) return;
+    handle_relation (relation, string_table); // counts the relation again if it has any members
+    if (r->member_offset != 0) touch_cell (get_grid_cell_for_relation (r));
+}
+
+/* Apply the changes in an OsmChange file to a complete database. */
+static void apply_changes (const char *filename) {
+    if (n_cell_node_bytes != 0) {
+        fprintf (stderr, "The clustered node store will not be used until the database is compacted with -n again.\n");
+        n_cell_node_bytes = 0;
+        cell_nodes = NULL;
+        cell_node_offsets = NULL;
+    }
+    cell_generations = map_file ("cell_generations", 0, sizeof(uint32_t) * GRID_DIM * GRID_DIM);
+    cell_reach = map_file ("cell_reach", 0, sizeof(CellReach) * GRID_DIM * GRID_DIM);
+    cell_moves = map_file ("cell_moves", 0, sizeof(CellReach) * GRID_DIM * GRID_DIM);
+    if (superblock.n_updates == 0) build_cell_reach ();
+    superblock.n_updates++;
+    /* Until the changes are all on disk, the database is neither the old version nor the new one. */
+    save_superblock (DB_UPDATING);
+    OscReadCallbacks callbacks = {
+        .node = &apply_node,
+        .way = &apply_way,
+        .relation = &apply_relation,
+        .block_strings = &handle_block_strings
+    };
+    osc_read (filename, &callbacks);
+    finish_loader_threads ();
+    free (moving_ids);
+    sync_mappings ();
+    superblock.last_update = time (NULL);
+    save_superblock (DB_COMPLETE);
+    fprintf (stderr, "applied %ld creations, %ld modifications and %ld deletions as generation %"PRIu64".%u.\n",
+             n_applied[OSC_CREATE], n_applied[OSC_MODIFY], n_applied[OSC_DELETE],
+             superblock.load_id, superblock.n_updates);
+}
+
 /* Print out a message explaining command line parameters to the user, then exit. */
 static void usage () {
-    fprintf(stderr, "usage:\nvex database_dir input.osm.pbf\n");
-    fprintf(stderr, "vex database_dir min_lat min_lon max_lat max_lon (output_file.pbf|-)\n");
+    fprintf(stderr, "usage:\nvex [-r|--resume] [-s] [-c seconds] [-d n] [-f filter_file] [-t threads] [-H huge_pages] [-N numa] [-w]\n");
+    fprintf(stderr, "    database_dir input.osm.pbf\n");
+    fprintf(stderr, "vex [-p] [-H huge_pages] [-N numa] database_dir min_lat min_lon max_lat max_lon (output_file.pbf|-)\n");
+    fprintf(stderr, "vex database_dir info\n");
+    fprintf(stderr, "vex [-n] database_dir compact\n");
+    fprintf(stderr, "vex [-f filter_file] database_dir apply change.osc[.gz]\n");
+    fprintf(stderr, "vex database_dir changed-since generation min_lat min_lon max_lat max_lon\n");
+    fprintf(stderr, "vex [-d n] [-f filter_file] [-s] [-t threads] tagstats input.osm.pbf > dictionary.txt\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -c seconds  interval between load checkpoints, or 0 to disable them (default: 600)\n");
+    fprintf(stderr, "  -d n        learn the tag dictionary from one in n blocks of the input before loading,\n");
+    fprintf(stderr, "              or with tagstats, count only one in n blocks (counts are approximate\n");
+    fprintf(stderr, "              once rare entries have been discarded)\n");
+    fprintf(stderr, "  -f file     keep and drop tags according to the rules in a filter file\n");
+    fprintf(stderr, "  -H thp|dir  back mapped files with transparent huge pages, or keep a database in memory\n");
+    fprintf(stderr, "              in a directory on a hugetlbfs mount\n");
+    fprintf(stderr, "  -n          with compact, also copy the nodes of each grid cell's ways into a clustered store\n");
+    fprintf(stderr, "  -N [array=]interleave|node,...  interleave mapped files across NUMA nodes or bind them\n");
+    fprintf(stderr, "              to one node, optionally per array (nodes, ways, grid, ...)\n");
+    fprintf(stderr, "  -p          with a query, read all the elements into memory at once, for small databases\n");
+    fprintf(stderr, "  -r, --resume  resume an interrupted load from its last checkpoint\n");
+    fprintf(stderr, "  -s          decode PBF blocks in place with the streaming decoder instead of protobuf-c\n");
+    fprintf(stderr, "  -t threads  number of threads decompressing PBF blocks (default: one per processor)\n");
+    fprintf(stderr, "  -w          write loaded data to disk steadily, and drop it from the page cache once written\n");
     exit(EXIT_SUCCESS);
 }
 
@@ -596,7 +2368,7 @@ void print_tags (uint8_t *tag_data) {
 }
 
 void print_node (uint64_t node_id) {
-    Node node = nodes[node_id];
+    Node node = *node_for_id (node_id);
     fprintf (stderr, "  node %ld (%.6f, %.6f) ", node_id, get_lat(&node.coord), get_lon(&node.coord));
     uint8_t *tag_data = tag_data_for_id (node_id, NODE);
     fprintf (stderr, "(offset %d)", node.tags);
@@ -607,7 +2379,7 @@ void print_node (uint64_t node_id) {
 void print_way (int64_t way_id) {
     fprintf (stderr, "way %ld ", way_id);
     uint8_t *tag_data = tag_data_for_id (way_id, WAY);
-    print_tags (tag_data + ways[way_id].tags);
+    print_tags (tag_data + way_for_id (way_id)->tags);
     fprintf (stderr, "\n");
 }
 
@@ -689,8 +2461,7 @@ static void vexbin_write_tags (uint8_t *tag_data) {
     }
 }
 
-static void vexbin_write_node (int64_t node_id) {
-    Node node = nodes[node_id];
+static void vexbin_write_node (int64_t node_id, Node node) {
     int64_t id_delta = node_id - last_node_id;
     // TODO convert to fixed-point lat,lon as in PBF?
     int32_t x_delta = node.coord.x - last_x;
@@ -707,20 +2478,15 @@ static void vexbin_write_node (int64_t node_id) {
 }
 
 static void vexbin_write_way (int64_t way_id) {
-    Way way = ways[way_id];
+    Way way = *way_for_id (way_id);
     int64_t id_delta = way_id - last_way_id;
     vexbin_write_signed (id_delta);
-    /* Count the number of node refs in this way and write out the count before the list. */
-    int n_refs = 0;
-    for (int64_t *node_ref_p = node_refs + way.node_ref_offset; true; node_ref_p++) {
-        n_refs++;
-        if (*node_ref_p < 0) break;
-    }
+    /* The number of node refs in this way is written out before the list. */
+    NodeRefReader refs;
+    uint32_t n_refs = node_refs_open (&refs, way.node_ref_offset);
     vexbin_write_length (n_refs);
-    int64_t *node_refs_for_way = node_refs + way.node_ref_offset;
-    for (int r = 0; r < n_refs; r++) {
-        int64_t node_ref = node_refs_for_way[r];
-        if (node_ref < 0) node_ref = -node_ref;
+    for (uint32_t r = 0; r < n_refs; r++) {
+        int64_t node_ref = node_refs_next (&refs);
         // Delta code way references (even across ways) 
         int64_t ref_delta = node_ref - last_node_id;
         last_node_id = node_ref; 
@@ -732,36 +2498,372 @@ static void vexbin_write_way (int64_t way_id) {
     last_way_id = way_id;
 }
 
+/* Output one node in an extract. */
+static void extract_node (int64_t node_id, Node node, bool vexformat) {
+    if (vexformat) {
+        vexbin_write_node (node_id, node);
+    } else {
+        uint8_t *tags = tag_data_for_id(node_id, NODE);
+        pbf_write_node(node_id, get_lat(&(node.coord)),
+            get_lon(&(node.coord)), &(tags[node.tags]));
+    }
+}
+
+/* Output one way found in the grid in the NODE or WAY stage of an extract: either its nodes or the way itself. */
+static void extract_way (int stage, int64_t way_id, bool vexformat) {
+    Way way = *way_for_id (way_id);
+    if (stage == WAY) {
+        // print_way (way_id); // DEBUG
+        if (vexformat) {
+            vexbin_write_way (way_id);
+        } else {
+            uint8_t *tags = tag_data_for_id(way_id, WAY);
+            pbf_write_way(way_id, node_refs + (uint64_t) way.node_ref_offset * NODE_REF_UNIT, &(tags[way.tags]));
+        }
+    } else if (stage == NODE) {
+        /* Output all nodes in this way. */
+        NodeRefReader refs;
+        uint32_t n_refs = node_refs_open (&refs, way.node_ref_offset);
+        for (uint32_t r = 0; r < n_refs; r++) {
+            int64_t node_id = node_refs_next (&refs);
+            // print_node (node_id); // DEBUG
+            /* Mark this node, and skip outputting it if already seen. */
+            if (IDTracker_set (node_id)) continue;
+            extract_node (node_id, *node_for_id (node_id), vexformat);
+        }
+    }
+}
+
+/* Output the nodes of a cell's compacted run from the clustered node store, skipping any already seen. */
+static void extract_cell_nodes (uint32_t c, bool vexformat) {
+    uint64_t offset = cell_node_offsets[c];
+    if (offset == 0) return;
+    uint8_t *p = &(cell_nodes[offset]);
+    coord_t origin = cell_origin (c);
+    uint64_t n, tags;
+    int64_t node_id = 0, delta;
+    p += uint64_unpack (p, &n);
+    for (; n > 0; n--) {
+        Node node;
+        p += sint64_unpack (p, &delta);
+        node_id += delta;
+        p += sint64_unpack (p, &delta);
+        node.coord.x = (int32_t) ((uint32_t) origin.x + (uint32_t) delta);
+        p += sint64_unpack (p, &delta);
+        node.coord.y = (int32_t) ((uint32_t) origin.y + (uint32_t) delta);
+        p += uint64_unpack (p, &tags);
+        node.tags = tags;
+        if (IDTracker_set (node_id)) continue;
+        extract_node (node_id, node, vexformat);
+    }
+}
+
+/*
+  Print whether an extract of a bounding box has changed since the given generation, followed by
+  the current generation of the database, which the client can give next time it asks. That is
+  whether any cell of the box, or holding nodes of its ways, has changed, see cell_reach.
+*/
+static void changed_since (const char *argv[]) {
+    char *end;
+    uint64_t load_id = strtoull (argv[3], &end, 10);
+    if (*end != '.' || end == argv[3]) die ("Generation must be a load ID and an update number, as printed by changed-since.");
+    const char *update = end + 1;
+    unsigned long since = strtoul (update, &end, 10);
+    if (*end != '\0' || end == update) die ("Generation must be a load ID and an update number, as printed by changed-since.");
+    double min_lat = strtod(argv[4], NULL);
+    double min_lon = strtod(argv[5], NULL);
+    double max_lat = strtod(argv[6], NULL);
+    double max_lon = strtod(argv[7], NULL);
+    check_lat_range(min_lat);
+    check_lat_range(max_lat);
+    check_lon_range(min_lon);
+    check_lon_range(max_lon);
+    if (min_lat >= max_lat) die ("min lat must be less than max lat.");
+    if (min_lon >= max_lon) die ("min lon must be less than max lon.");
+    coord_t cmin, cmax;
+    to_coord(&cmin, min_lat, min_lon);
+    to_coord(&cmax, max_lat, max_lon);
+    fprintf(stderr, "Acquiring shared read lock on database.\n");
+    flock(lock_fd, LOCK_SH);
+    /*
+      A generation of another load means the database was replaced, so everything changed. So does
+      one this load has not reached, which can only come from an earlier load with the same ID.
+    */
+    bool changed = (load_id != superblock.load_id || since > superblock.n_updates);
+    if (!changed && superblock.n_updates > since) {
+        read_only = true;
+        cell_generations = map_file ("cell_generations", 0, sizeof(uint32_t) * GRID_DIM * GRID_DIM);
+        cell_reach = map_file ("cell_reach", 0, sizeof(CellReach) * GRID_DIM * GRID_DIM);
+        cell_moves = map_file ("cell_moves", 0, sizeof(CellReach) * GRID_DIM * GRID_DIM);
+        /* Take in the cells holding nodes of the ways in the box, then those any of their nodes moved to. */
+        CellReach area = {0}, before;
+        reach_add (&area, bin(cmin.x), bin(cmin.y));
+        reach_add (&area, bin(cmax.x), bin(cmax.y));
+        CellCover cover;
+        cover_cells (&cover, bin(cmin.x), bin(cmin.y), bin(cmax.x), bin(cmax.y));
+        for (size_t r = 0; r < cover.n_ranges; r++) {
+            for (uint32_t c = cover.ranges[r].begin; c < cover.ranges[r].end; c++) reach_merge (&area, &(cell_reach[c]));
+        }
+        do {
+            free (cover.ranges);
+            before = area;
+            cover_cells (&cover, area.min_x, area.min_y, area.end_x - 1, area.end_y - 1);
+            for (size_t r = 0; r < cover.n_ranges; r++) {
+                for (uint32_t c = cover.ranges[r].begin; c < cover.ranges[r].end; c++) reach_merge (&area, &(cell_moves[c]));
+            }
+        } while (memcmp (&before, &area, sizeof(area)) != 0);
+        for (size_t r = 0; r < cover.n_ranges && !changed; r++) {
+            for (uint32_t c = cover.ranges[r].begin; c < cover.ranges[r].end; c++) {
+                if (cell_generations[c] > since) {
+                    changed = true;
+                    break;
+                }
+            }
+        }
+        free (cover.ranges);
+    }
+    flock(lock_fd, LOCK_UN);
+    printf ("%s %"PRIu64".%u\n", changed ? "changed" : "unchanged", superblock.load_id, superblock.n_updates);
+}
+
 int main (int argc, const char * argv[]) {
 
-    if (argc != 3 && argc != 7) usage();
+    /* Options come before the positional parameters. */
+    int threads = 0;
+    int decoder = PBF_DECODER_PROTOBUF;
+    int checkpoint_interval = -1;
+    bool resume = false;
+    const char *filter_file = NULL;
+    int learn_every = 0;
+    bool cluster_nodes = false;
+    const char *huge_pages = NULL;
+    const char *numa = NULL;
+    static struct option long_options[] = {
+        {"resume", no_argument, NULL, 'r'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    /* The leading + stops at the first positional parameter, so negative coordinates are not taken for options. */
+    while ((opt = getopt_long(argc, (char * const *) argv, "+c:d:f:H:nN:prst:w", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'c':
+            checkpoint_interval = atoi(optarg);
+            break;
+        case 'd':
+            learn_every = atoi(optarg);
+            if (learn_every < 1) usage();
+            break;
+        case 'f':
+            filter_file = optarg;
+            break;
+        case 'H':
+            huge_pages = optarg;
+            break;
+        case 'n':
+            cluster_nodes = true;
+            break;
+        case 'N':
+            numa = optarg;
+            break;
+        case 'p':
+            populate = true;
+            break;
+        case 'r':
+            resume = true;
+            break;
+        case 's':
+            decoder = PBF_DECODER_STREAM;
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'w':
+            steady_writeback = true;
+            break;
+        default:
+            usage();
+        }
+    }
+    /* Shift away the options, keeping the program name in argv[0]. */
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (argc != 3 && argc != 7 && !(argc == 4 && strcmp(argv[2], "apply") == 0)
+                               && !(argc == 8 && strcmp(argv[2], "changed-since") == 0)) usage();
+    if (argc == 3 && strcmp(argv[1], "tagstats") == 0) {
+        /* Count the tags and roles in the file and write the dictionary learned from them, without a database. */
+        pbf_read_set_threads (threads);
+        pbf_read_set_decoder (decoder);
+        TagFilter_init (filter_file);
+        TagStats_read (argv[2], learn_every > 0 ? learn_every : 1);
+        TagStats_write_dictionary (stdout);
+        TagStats_clear ();
+        return EXIT_SUCCESS;
+    }
     database_path = argv[1];
     in_memory = (strcmp(database_path, "memory") == 0);
+    MemPolicy_init (huge_pages, numa);
+    if (MemPolicy_hugetlb_dir () != NULL && !in_memory)
+        die ("Only a database in memory can be kept in a hugetlbfs directory.");
     lock_fd = open("/tmp/vex.lock", O_CREAT, S_IRWXU);
     if (lock_fd == -1) die ("Error opening or creating lock file.");
 
-    /* Memory-map files for each OSM element type, and for references between them. */
+    /* Check the database was built with the same layout before mapping (and possibly resizing) its files. */
+    bool existing = open_superblock();
+    if (argc == 3 && strcmp(argv[2], "info") == 0) {
+        if (!existing) die ("No database found.");
+        print_superblock();
+        return EXIT_SUCCESS;
+    }
+    if (argc == 8) {
+        if (!existing) die ("No database found, load a PBF file first.");
+        if (superblock.state == DB_UPDATING)
+            die ("An update to the database was interrupted. Reload it before querying.");
+        if (superblock.state != DB_COMPLETE)
+            die ("Database load did not complete. Resume it with -r before querying.");
+        changed_since (argv);
+        return EXIT_SUCCESS;
+    }
+    bool compact = (argc == 3 && strcmp(argv[2], "compact") == 0);
+    if (compact) {
+        if (in_memory) die ("A database in memory cannot be compacted.");
+        if (!existing) die ("No database found, load a PBF file first.");
+        if (superblock.state == DB_UPDATING)
+            die ("An update to the database was interrupted. Reload it before compacting.");
+        if (superblock.state != DB_COMPLETE)
+            die ("Database load did not complete. Resume it with -r before compacting.");
+    }
+    bool apply = (argc == 4);
+    if (apply) {
+        if (in_memory) die ("Changes cannot be applied to a database in memory, which ends with the load.");
+        if (!existing) die ("No database found, load a PBF file first.");
+        if (superblock.state == DB_UPDATING)
+            die ("An earlier update to the database was interrupted. Reload it before applying more changes.");
+        if (superblock.state != DB_COMPLETE)
+            die ("Database load did not complete. Resume it with -r before applying changes.");
+        open_dictionary ();
+    }
+    if (argc == 7) {
+        if (!in_memory && !existing) die ("No database found, load a PBF file first.");
+        if (existing && superblock.state == DB_UPDATING)
+            die ("An update to the database was interrupted. Reload it before querying.");
+        if (existing && superblock.state != DB_COMPLETE)
+            die ("Database load did not complete. Resume it with -r before querying.");
+        open_dictionary ();
+    }
+
+    /* Memory-map files for each OSM element type, and for references between them. Queries only read them. */
+    read_only = (argc == 7);
     grid        = map_file("grid",        0, sizeof(Grid));
-    ways        = map_file("ways",        0, sizeof(Way)       * MAX_WAY_ID);
-    nodes       = map_file("nodes",       0, sizeof(Node)      * MAX_NODE_ID);
-    node_refs   = map_file("node_refs",   0, sizeof(int64_t)   * MAX_NODE_REFS);
-    way_blocks  = map_file("way_blocks",  0, sizeof(WayBlock)  * MAX_WAY_BLOCKS);
-    relations   = map_file("relations",   0, sizeof(Relation)  * MAX_REL_ID);
-    rel_members = map_file("rel_members", 0, sizeof(RelMember) * MAX_REL_MEMBERS);
-
-    if (argc == 3) {
+    node_dir.pages = map_file("node_dir", 0, IdDir_size (MAX_NODE_ID));
+    way_dir.pages  = map_file("way_dir",  0, IdDir_size (MAX_WAY_ID));
+    ways_arena        = map_arena("ways",        0, sizeof(Way)       * MAX_WAYS,  ARENA_DENSE);
+    nodes_arena       = map_arena("nodes",       0, sizeof(Node)      * MAX_NODES, ARENA_DENSE);
+    node_refs_arena   = map_arena("node_refs",   0, (size_t) NODE_REF_UNIT * MAX_NODE_REF_UNITS, ARENA_DENSE);
+    way_blocks_arena  = map_arena("way_blocks",  0, sizeof(WayBlock)  * (size_t) MAX_WAY_BLOCKS,  ARENA_DENSE);
+    relations_arena   = map_arena("relations",   0, sizeof(Relation)  * (size_t) MAX_REL_ID,      ARENA_SPARSE);
+    rel_members_arena = map_arena("rel_members", 0, sizeof(RelMember) * (size_t) MAX_REL_MEMBERS, ARENA_DENSE);
+    ways        = ways_arena->base;
+    nodes       = nodes_arena->base;
+    node_refs   = node_refs_arena->base;
+    way_blocks  = way_blocks_arena->base;
+    relations   = relations_arena->base;
+    rel_members = rel_members_arena->base;
+    /*
+      Element zero of these arrays is read before anything is stored in it: unknown node and way IDs
+      look up element zero, and unit zero of node_refs is the empty list. Make sure they are within
+      the files, so inputs without ways or with dangling references do not touch past the end.
+    */
+    if (!read_only) {
+        arena_ensure (nodes_arena, sizeof(Node));
+        arena_ensure (ways_arena, sizeof(Way));
+        arena_ensure (node_refs_arena, NODE_REF_UNIT);
+        arena_ensure (rel_members_arena, sizeof(RelMember));
+    }
+    if (argc == 7 || compact || apply) open_way_index ();
+    bool report_pages = (huge_pages != NULL || numa != NULL);
+    if (report_pages) report_mappings ();
+
+    if (compact) {
+        /* Request an exclusive write lock, blocking while reads complete. */
+        fprintf(stderr, "Acquiring exclusive write lock on database.\n");
+        flock(lock_fd, LOCK_EX);
+        superblock_restore (&superblock);
+        compact_way_index (cluster_nodes);
+        flock(lock_fd, LOCK_UN);
+        return EXIT_SUCCESS;
+    } else if (apply) {
+        /* UPDATE */
+        fprintf(stderr, "Acquiring exclusive write lock on database.\n");
+        flock(lock_fd, LOCK_EX);
+        /* Tags are filtered as they are written, so use the same filter file as the load. */
+        TagFilter_init (filter_file);
+        superblock_restore (&superblock);
+        apply_changes (argv[3]);
+        flock(lock_fd, LOCK_UN);
+        return EXIT_SUCCESS;
+    } else if (argc == 3) {
         /* LOAD */
         const char *filename = argv[2];
         PbfReadCallbacks callbacks = {
             .way  = &handle_way,
             .node = &handle_node,
-            .relation = &handle_relation
+            .dense_nodes = &handle_dense_nodes,
+            .block_strings = &handle_block_strings,
+            .block_done = &handle_block_done,
+            .relation = &handle_relation,
+            .checkpoint = &handle_checkpoint,
+            .concurrent_nodes = true,
+            .concurrent_ways = true
         };
         /* Request an exclusive write lock, blocking while reads complete. */
         fprintf(stderr, "Acquiring exclusive write lock on database.\n");
         flock(lock_fd, LOCK_EX);
-        pbf_read (filename, &callbacks); // we could just pass the callbacks by value
+        pbf_read_set_threads (threads);
+        pbf_read_set_decoder (decoder);
+        TagFilter_init (filter_file);
+        /* A database in shared memory does not survive the process, so there is nothing to resume. */
+        if (in_memory || checkpoint_interval == 0) callbacks.checkpoint = NULL;
+        else if (checkpoint_interval > 0) pbf_read_set_checkpoint_interval (checkpoint_interval);
+        load_filename = filename;
+        /* Every load gets a new epoch, so the ID directories can tell its pages from older ones. */
+        uint32_t epoch = superblock.load_epoch + 1;
+        if (resume) {
+            if (in_memory) die ("Cannot resume loading into memory.");
+            if (learn_every > 0) die ("The tag dictionary cannot be changed when resuming a load.");
+            PbfResumePoint resume_point;
+            restore_checkpoint (&resume_point);
+            node_dir.epoch = way_dir.epoch = epoch;
+            save_superblock (DB_LOADING);
+            open_dictionary ();
+            pbf_read_resume (filename, &callbacks, &resume_point);
+        } else {
+            memset (&superblock, 0, sizeof(superblock));
+            superblock.load_started = time (NULL);
+            /* A reload changes everything, so it gets an ID no generation of the old database has. */
+            struct timespec now;
+            clock_gettime (CLOCK_REALTIME, &now);
+            superblock.load_id = (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+            if (!in_memory) {
+                unlink (make_db_path ("cell_generations", 0));
+                unlink (make_db_path ("cell_reach", 0));
+                unlink (make_db_path ("cell_moves", 0));
+            }
+            node_dir.epoch = way_dir.epoch = epoch;
+            if (learn_every > 0) learn_dictionary (filename, learn_every);
+            else if (!in_memory) unlink (make_db_path ("dictionary", 0)); // left by an earlier load
+            save_superblock (DB_LOADING);
+            pbf_read (filename, &callbacks); // we could just pass the callbacks by value
+        }
+        finish_loader_threads();
+        /* Only mark the database complete once all its data is on disk. */
+        if (!in_memory) sync_mappings ();
+        save_superblock (DB_COMPLETE);
+        if (steady_writeback && !in_memory) release_mappings ();
+        /* The load is complete, so any checkpoint left from an earlier attempt no longer applies. */
+        if (!in_memory) unlink (make_db_path ("checkpoint", 0));
         fillFactor();
+        if (report_pages) report_mappings ();
         /* Release exclusive write lock, allowing reads to begin. */
         flock(lock_fd, LOCK_UN);
         fprintf(stderr, "loaded %ld nodes, %ld ways, and %ld relations total.\n", 
@@ -817,12 +2919,17 @@ int main (int argc, const char * argv[]) {
         /* Initialize the ID tracker so we can avoid outputting nodes more than once. */
         IDTracker_reset ();
         
+        /* Find the runs of grid cell indexes covering the bounding box. */
+        CellCover cover;
+        cover_cells (&cover, min_xbin, min_ybin, max_xbin, max_ybin);
+
         /* Make three passes, first outputting all nodes, then all ways, then all relations. */
         for (int stage = NODE; stage <= RELATION; stage++) {
-            for (uint32_t x = min_xbin; x <= max_xbin; x++) {
-                for (uint32_t y = min_ybin; y <= max_ybin; y++) {
+            for (size_t r = 0; r < cover.n_ranges; r++) {
+                for (uint32_t c = cover.ranges[r].begin; c < cover.ranges[r].end; c++) {
+                    GridCell *cell = &(grid->cells[c]);
                     if (stage == RELATION) {
-                        uint32_t rel_id = grid->cells[x][y].head_relation;
+                        uint32_t rel_id = cell->head_relation;
                         while (rel_id > 0) {
                             Relation rel = relations[rel_id];
                             if (vexformat) {
@@ -833,59 +2940,33 @@ int main (int argc, const char * argv[]) {
                             }
                             rel_id = rel.next; // list links within a cell are embedded in relations
                         }
-                        continue; // all the rest of the code in the y loop body is for WAY and NODE
+                        continue; // all the rest of the code in the cell loop body is for WAY and NODE
                     }
                     /* Following code handles NODE and WAY if RELATION clause was not entered. */
-                    uint32_t wbidx = grid->cells[x][y].head_way_block;
-                    // printf ("xbin=%d ybin=%d way bin index %u\n", x, y, wbidx);
-                    if (wbidx == 0) continue; // There are no ways in this grid cell.
-                    /* Iterate over all ways in this block, and its chained blocks. */
-                    WayBlock *wb = &(way_blocks[wbidx]);
-                    for (;;) {
+                    /* Ways in the cell's compacted run are read sequentially, then any added since. */
+                    int32_t *run = cell_run (cell);
+                    if (run != NULL && stage == NODE && cell_nodes != NULL) {
+                        extract_cell_nodes (c, vexformat);
+                    } else if (run != NULL) {
+                        for (int32_t w = 1; w <= run[0]; w++)
+                            extract_way (stage, run[w], vexformat);
+                    }
+                    /* Iterate over all ways in the cell's way blocks. */
+                    for (uint32_t wbidx = cell->head_way_block; wbidx >= compacted_way_blocks && wbidx != 0;
+                         wbidx = way_blocks[wbidx].next) {
+                        WayBlock *wb = &(way_blocks[wbidx]);
                         for (int w = 0; w < WAY_BLOCK_SIZE; w++) {
                             int64_t way_id = wb->refs[w];
                             if (way_id <= 0) break;
-                            Way way = ways[way_id];
-                            if (stage == WAY) {
-                                // print_way (way_id); // DEBUG
-                                if (vexformat) {
-                                    vexbin_write_way (way_id);
-                                } else {
-                                    uint8_t *tags = tag_data_for_id(way_id, WAY);
-                                    pbf_write_way(way_id, &(node_refs[way.node_ref_offset]), &(tags[way.tags]));
-                                }
-                            } else if (stage == NODE) {
-                                /* Output all nodes in this way. */
-                                uint32_t nr = way.node_ref_offset;
-                                bool more = true;
-                                for (; more; nr++) {
-                                    int64_t node_id = node_refs[nr];
-                                    if (node_id < 0) {
-                                        node_id = -node_id;
-                                        more = false;
-                                    }
-                                    // print_node (node_id); // DEBUG
-                                    /* Mark this node, and skip outputting it if already seen. */
-                                    if (IDTracker_set (node_id)) continue;
-                                    if (vexformat) {
-                                        vexbin_write_node (node_id);
-                                    } else {
-                                        Node node = nodes[node_id];
-                                        uint8_t *tags = tag_data_for_id(node_id, NODE);
-                                        pbf_write_node(node_id, get_lat(&(node.coord)),
-                                            get_lon(&(node.coord)), &(tags[node.tags]));
-                                    }
-                                }
-                            }
+                            extract_way (stage, way_id, vexformat);
                         }
-                        if (wb->next == 0) break;
-                        wb = &(way_blocks[wb->next]);
                     }
                 }
             }
             /* Write out any buffered nodes or ways before beginning the next PBF writing stage. */
             if (!vexformat) pbf_write_flush();
         }
+        free (cover.ranges);
         fclose(pbf_file);
         flock(lock_fd, LOCK_UN); // release the shared lock, allowing writes to begin.
     }